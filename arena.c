@@ -0,0 +1,130 @@
+//cJSON allocation arena: the cJSON work of a public call is bump allocated and released in one go
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_internal.h"
+
+#define ARENA_ALIGN     8
+
+static upip_cjson_arena_stats_t arena_stats;
+
+void upip_cjson_arena_get_stats(upip_cjson_arena_stats_t *out) {
+    *out = arena_stats;
+    out->size = UPIP_CJSON_ARENA ? UPIP_CJSON_ARENA_SIZE : 0;
+}
+
+void upip_cjson_arena_reset_stats(void) {
+    memset(&arena_stats, 0, sizeof(arena_stats));
+}
+
+#if UPIP_CJSON_ARENA
+static uint8_t *arena;
+static size_t arena_used;
+static int arena_depth;
+
+static bool in_arena(const void *ptr) {
+    return arena && (const uint8_t *)ptr >= arena && (const uint8_t *)ptr < arena + UPIP_CJSON_ARENA_SIZE;
+}
+
+static void *arena_malloc(size_t size) {
+    size_t start = (arena_used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > UPIP_CJSON_ARENA_SIZE || start > UPIP_CJSON_ARENA_SIZE - size) {
+        //full, the heap takes over until the call returns
+        arena_stats.overflows++;
+        arena_stats.overflow_bytes += size;
+        return malloc(size);
+    }
+    arena_used = start + size;
+    if (arena_used > arena_stats.high_water) arena_stats.high_water = arena_used;
+    return arena + start;
+}
+
+static void arena_free(void *ptr) {
+    if (!in_arena(ptr)) free(ptr); //trees built outside the call or spilled to the heap
+}
+
+void cjson_arena_enter(void) {
+    if (arena_depth++ > 0 || !(arena = malloc(UPIP_CJSON_ARENA_SIZE))) return;
+
+    cJSON_Hooks hooks = {arena_malloc, arena_free};
+    arena_used = 0;
+    cJSON_InitHooks(&hooks);
+}
+
+void cjson_arena_leave(void) {
+    if (--arena_depth > 0 || !arena) return;
+
+    cJSON_InitHooks(NULL);
+    arena_stats.last_used = arena_used;
+    free(arena);
+    arena = NULL;
+    arena_used = 0;
+}
+
+cJSON *cjson_arena_export(cJSON *item) {
+    if (!arena || !item) return item;
+
+    //duplicate with the default allocator, the arena copy goes away with the arena
+    cJSON_InitHooks(NULL);
+    cJSON *copy = cJSON_Duplicate(item, 1);
+    cJSON_Hooks hooks = {arena_malloc, arena_free};
+    cJSON_InitHooks(&hooks);
+
+    cJSON_Delete(item);
+    return copy;
+}
+
+size_t cjson_arena_mark(void) {
+    return arena_used;
+}
+
+void cjson_arena_release(size_t mark) {
+    if (arena && mark <= arena_used) arena_used = mark;
+}
+
+void cjson_arena_suspend(cjson_arena_t *saved) {
+    saved->arena = arena;
+    saved->used = arena_used;
+    saved->depth = arena_depth;
+    if (arena) cJSON_InitHooks(NULL);
+    arena = NULL;
+    arena_used = 0;
+    arena_depth = 0;
+}
+
+void cjson_arena_resume(const cjson_arena_t *saved) {
+    arena = saved->arena;
+    arena_used = saved->used;
+    arena_depth = saved->depth;
+    if (arena) {
+        cJSON_Hooks hooks = {arena_malloc, arena_free};
+        cJSON_InitHooks(&hooks);
+    }
+}
+#else
+void cjson_arena_enter(void) {}
+void cjson_arena_leave(void) {}
+
+cJSON *cjson_arena_export(cJSON *item) {
+    return item;
+}
+
+size_t cjson_arena_mark(void) {
+    return 0;
+}
+
+void cjson_arena_release(size_t mark) {
+    (void)mark;
+}
+
+void cjson_arena_suspend(cjson_arena_t *saved) {
+    (void)saved;
+}
+
+void cjson_arena_resume(const cjson_arena_t *saved) {
+    (void)saved;
+}
+#endif
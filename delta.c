@@ -0,0 +1,71 @@
+//Streaming binary patch applier, rebuilds a file from the installed copy and a patch as the patch arrives
+#include <stdint.h>
+#include <string.h>
+
+#include "upip.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+#define PATCH_OP_COPY       'C'
+#define PATCH_OP_ADD        'A'
+#define PATCH_COPY_BUF      256
+
+static uint8_t op_size(uint8_t op) {
+    return op == PATCH_OP_COPY ? 9 : 5;
+}
+
+static bool copy_from_src(patch_t *p, uint32_t offset, uint32_t length) {
+    uint8_t buf[PATCH_COPY_BUF];
+    UINT br;
+
+    if (f_lseek(p->src, offset) != FR_OK) return false;
+    while (length > 0) {
+        UINT n = length < sizeof(buf) ? length : sizeof(buf);
+        if (f_read(p->src, buf, n, &br) != FR_OK || br != n) return false;
+        if (!p->write(buf, n, p->arg)) return false;
+        length -= n;
+    }
+    return true;
+}
+
+void patch_init(patch_t *p, FIL *src, patch_write_fn write, void *arg) {
+    memset(p, 0, sizeof(*p));
+    p->src = src;
+    p->write = write;
+    p->arg = arg;
+}
+
+bool patch_feed(patch_t *p, const uint8_t *data, size_t len) {
+    while (len > 0 && !p->failed) {
+        //literal bytes of an add op go straight through
+        if (p->add_left > 0) {
+            UINT n = len < p->add_left ? (UINT)len : p->add_left;
+            if (!p->write(data, n, p->arg)) p->failed = true;
+            p->add_left -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        //collect an op header, it may be split over two pieces
+        p->op[p->op_have++] = *data++;
+        len--;
+        if (p->op[0] != PATCH_OP_COPY && p->op[0] != PATCH_OP_ADD) {
+            p->failed = true;
+            break;
+        }
+        if (p->op_have < op_size(p->op[0])) continue;
+
+        if (p->op[0] == PATCH_OP_COPY) {
+            p->failed = !copy_from_src(p, upip_get_le32(p->op + 1), upip_get_le32(p->op + 5));
+        } else {
+            p->add_left = upip_get_le32(p->op + 1);
+        }
+        p->op_have = 0;
+    }
+    return !p->failed;
+}
+
+bool patch_done(const patch_t *p) {
+    return !p->failed && p->op_have == 0 && p->add_left == 0;
+}
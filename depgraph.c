@@ -0,0 +1,522 @@
+//Dependency graph: edges from installed packages to their dependencies with per package counts, in an on-disk hash table
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+#define DEPGRAPH_MAGIC          "UPDG"
+#define DEPGRAPH_FORMAT         1
+#define DEPGRAPH_TMP_PATH       DEPGRAPH_FILE_PATH ".tmp"
+#define NODE                    0xFFFF  //ordinal of a package record, edges are numbered from 0
+
+enum { SLOT_EMPTY = 0, SLOT_USED = 1, SLOT_DELETED = 2 };
+
+/**
+ * a package has one record with ordinal NODE and one record per dependency with ordinals 0..
+ * dependencies - 1, all keyed by name and ordinal, so listing the dependencies of a package probes
+ * for each of them and the count of its dependents is read from one record. a removed edge leaves a
+ * hole (empty target) that the next edge added to the package takes.
+ * dependents is raised before an edge becomes visible and lowered after it is hidden, a power loss in
+ * between leaves it too high: the package is kept longer than needed but never removed while needed
+ */
+typedef struct {
+    char state;
+    char pad;
+    uint16_t ordinal;
+    uint16_t dependents;        //node: edges into it
+    uint16_t dependencies;      //node: edge ordinals in use, holes included
+    char name[PKGDB_NAME_SIZE];
+    char target[PKGDB_NAME_SIZE];   //edge: the dependency, empty for a hole
+} depgraph_record_t;
+
+static uint32_t slot_of(const depgraph_t *g, const char *name, uint16_t ordinal) {
+    return (upip_hash_str(name) + ordinal * 2654435761u) & (g->hdr.slots - 1);
+}
+
+static FRESULT read_record(FIL *file, uint32_t slot, depgraph_record_t *rec) {
+    FRESULT res;
+    UINT br;
+    FTRY(f_lseek(file, sizeof(depgraph_header_t) + (FSIZE_t)slot * sizeof(*rec)));
+    FTRY(f_read(file, rec, sizeof(*rec), &br));
+    if (br != sizeof(*rec)) res = FR_INT_ERR;
+cleanup:
+    return res;
+}
+
+static FRESULT write_record(FIL *file, uint32_t slot, const depgraph_record_t *rec) {
+    FRESULT res;
+    UINT bw;
+    FTRY(f_lseek(file, sizeof(depgraph_header_t) + (FSIZE_t)slot * sizeof(*rec)));
+    FTRY(f_write(file, rec, sizeof(*rec), &bw));
+    if (bw != sizeof(*rec)) res = FR_DENIED;
+cleanup:
+    return res;
+}
+
+static FRESULT write_header(FIL *file, const depgraph_header_t *hdr) {
+    FRESULT res;
+    UINT bw;
+    FTRY(f_lseek(file, 0));
+    FTRY(f_write(file, hdr, sizeof(*hdr), &bw));
+    if (bw != sizeof(*hdr)) res = FR_DENIED;
+cleanup:
+    return res;
+}
+
+static FRESULT read_header(FIL *file, depgraph_header_t *hdr) {
+    FRESULT res;
+    UINT br;
+    FTRY(f_lseek(file, 0));
+    FTRY(f_read(file, hdr, sizeof(*hdr), &br));
+    if (br != sizeof(*hdr) || memcmp(hdr->magic, DEPGRAPH_MAGIC, 4) != 0 ||
+        hdr->format != DEPGRAPH_FORMAT || hdr->record_size != sizeof(depgraph_record_t) ||
+        hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) != 0) {
+        res = FR_NO_FILESYSTEM;
+    }
+cleanup:
+    return res;
+}
+
+/**
+ * linear probing, as in pkgdb.c. on a miss *slot_out is where the record would go and rec->state
+ * tells whether that slot is empty or deleted
+ */
+static FRESULT find(depgraph_t *g, const char *name, uint16_t ordinal, uint32_t *slot_out, depgraph_record_t *rec, bool *found) {
+    FRESULT res = FR_OK;
+    uint32_t mask = g->hdr.slots - 1;
+    uint32_t slot = slot_of(g, name, ordinal);
+    uint32_t insert_at = UINT32_MAX;
+    char insert_state = SLOT_EMPTY;
+    *found = false;
+
+    for (uint32_t probes = 0; probes < g->hdr.slots; probes++, slot = (slot + 1) & mask) {
+        FTRY(read_record(&g->file, slot, rec));
+        if (rec->state == SLOT_EMPTY) {
+            if (insert_at == UINT32_MAX) insert_at = slot;
+            break;
+        }
+        if (rec->state == SLOT_DELETED) {
+            if (insert_at == UINT32_MAX) {
+                insert_at = slot;
+                insert_state = SLOT_DELETED;
+            }
+            continue;
+        }
+        if (rec->ordinal == ordinal && strncmp(rec->name, name, PKGDB_NAME_SIZE) == 0) {
+            *found = true;
+            insert_at = slot;
+            break;
+        }
+    }
+
+    *slot_out = insert_at;
+    if (!*found) rec->state = insert_state;
+    if (insert_at == UINT32_MAX) res = FR_DENIED; //table full, callers grow before that happens
+cleanup:
+    return res;
+}
+
+//the record of name at ordinal, a fresh one when there is none
+static FRESULT load(depgraph_t *g, const char *name, uint16_t ordinal, depgraph_record_t *rec, bool *found) {
+    uint32_t slot;
+    FRESULT res = find(g, name, ordinal, &slot, rec, found);
+    if (res == FR_DENIED) res = FR_OK;
+    if (res == FR_OK && !*found) {
+        memset(rec, 0, sizeof(*rec));
+        rec->state = SLOT_USED;
+        rec->ordinal = ordinal;
+        strcpy(rec->name, name);
+    }
+    return res;
+}
+
+static FRESULT store(depgraph_t *g, const depgraph_record_t *rec) {
+    FRESULT res;
+    depgraph_record_t probe;
+    uint32_t slot;
+    bool found;
+    FTRY(find(g, rec->name, rec->ordinal, &slot, &probe, &found));
+    FTRY(write_record(&g->file, slot, rec));
+    if (!found && probe.state == SLOT_EMPTY) {
+        g->hdr.used++;
+        FTRY(write_header(&g->file, &g->hdr));
+    }
+cleanup:
+    return res;
+}
+
+static FRESULT drop(depgraph_t *g, const char *name, uint16_t ordinal) {
+    FRESULT res;
+    depgraph_record_t rec;
+    uint32_t slot;
+    bool found;
+    FTRY(find(g, name, ordinal, &slot, &rec, &found));
+    if (!found) goto cleanup;
+    rec.state = SLOT_DELETED;
+    FTRY(write_record(&g->file, slot, &rec));
+cleanup:
+    return res == FR_DENIED ? FR_OK : res;
+}
+
+static uint32_t slots_for(uint32_t count) {
+    uint32_t slots = UPIP_DEPGRAPH_MIN_SLOTS;
+    while (slots * 3 < (count + 1) * 4) slots *= 2; //keep the load factor under 3/4
+    return slots;
+}
+
+//copies the used records of src (NULL for none) into DEPGRAPH_TMP_PATH, deleted ones are dropped
+static FRESULT rebuild(FATFS *fs, depgraph_t *src, uint32_t slots) {
+    FRESULT res;
+    depgraph_t dst = {0};
+    depgraph_record_t rec = {0};
+    bool opened = false;
+
+    dst.hdr = (depgraph_header_t){{0}, DEPGRAPH_FORMAT, sizeof(depgraph_record_t), slots, 0};
+    FTRY(f_open(fs, &dst.file, DEPGRAPH_TMP_PATH, FA_READ | FA_WRITE | FA_CREATE_ALWAYS));
+    opened = true;
+    FTRY(write_header(&dst.file, &dst.hdr));
+    for (uint32_t i = 0; i < slots; i++) {
+        FTRY(write_record(&dst.file, i, &rec));
+    }
+
+    for (uint32_t i = 0; src && i < src->hdr.slots; i++) {
+        FTRY(read_record(&src->file, i, &rec));
+        if (rec.state != SLOT_USED) continue;
+        FTRY(store(&dst, &rec));
+    }
+
+    memcpy(dst.hdr.magic, DEPGRAPH_MAGIC, 4);
+    FTRY(write_header(&dst.file, &dst.hdr));
+    FTRY(f_sync(&dst.file));
+
+cleanup:
+    if (opened) f_close(&dst.file);
+    return res;
+}
+
+static FRESULT swap_in(FATFS *fs) {
+    FRESULT res = f_unlink(fs, DEPGRAPH_FILE_PATH);
+    if (res != FR_OK && res != FR_NO_FILE) return res;
+    return f_rename(fs, DEPGRAPH_TMP_PATH, DEPGRAPH_FILE_PATH);
+}
+
+static FRESULT open_file(FATFS *fs, depgraph_t *g) {
+    FRESULT res = f_open(fs, &g->file, DEPGRAPH_FILE_PATH, g->writable ? FA_READ | FA_WRITE : FA_READ);
+    if (res != FR_OK) return res;
+    res = read_header(&g->file, &g->hdr);
+    if (res != FR_OK) f_close(&g->file);
+    return res;
+}
+
+//makes room for records more records before any of them is written
+static FRESULT reserve(depgraph_t *g, uint32_t records) {
+    FRESULT res = FR_OK;
+    if ((g->hdr.used + records) * 4 <= g->hdr.slots * 3) return FR_OK;
+
+    FTRY(rebuild(g->fs, g, slots_for(g->hdr.used + records)));
+    f_close(&g->file);
+    g->open = false;
+    FTRY(swap_in(g->fs));
+    FTRY(open_file(g->fs, g));
+    g->open = true;
+cleanup:
+    return res;
+}
+
+/**
+ * revdeptree.json migration. the tree maps a dependency to its dependents, older versions recorded
+ * every package of a plan as a dependent of every other one, so an edge is only carried over when
+ * the metadata kept of the dependent lists the dependency, or when no metadata is kept
+ */
+static bool lists_dependency(FATFS *fs, const char *dependent, const char *dependency) {
+    char version[PKGDB_VERSION_SIZE];
+    bool listed = true;
+    if (pkgdb_lookup(fs, dependent, version, sizeof(version)) != FR_OK) return false;
+
+    cJSON *meta = meta_cache_peek(fs, dependent, version);
+    cJSON *deps = cJSON_GetObjectItem(meta, "dependencies");
+    if (cJSON_IsArray(deps)) {
+        cJSON *dep = NULL;
+        listed = false;
+        cJSON_ArrayForEach(dep, deps) {
+            const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(dep, "name"));
+            if (name && strcmp(name, dependency) == 0) listed = true;
+        }
+    }
+    if (meta) cJSON_Delete(meta);
+    return listed;
+}
+
+typedef struct {
+    depgraph_t *graph;
+    uint32_t edges;     //edges the migration may add, sizes the table so that it never grows
+    FRESULT res;
+} migrate_ctx_t;
+
+static void count_record(char op, const char *a, const char *b, void *arg) {
+    (void)a; (void)b;
+    if (op == JOURNAL_RDEP_ADD) ((migrate_ctx_t *)arg)->edges++;
+}
+
+/**
+ * the journal is taken in whole, pkgs.db records included: it is cut once the migration is done, so
+ * that the edges recorded by older versions are never replayed on top of the graph
+ */
+static void migrate_record(char op, const char *a, const char *b, void *arg) {
+    migrate_ctx_t *ctx = arg;
+    FATFS *fs = ctx->graph->fs;
+    char version[PKGDB_VERSION_SIZE];
+    if (ctx->res != FR_OK) return;
+
+    switch (op) {
+    case JOURNAL_INSTALLED:
+        if (b && (pkgdb_lookup(fs, a, version, sizeof(version)) != FR_OK || strcmp(version, b) != 0)) {
+            ctx->res = pkgdb_set(fs, a, b);
+        }
+        break;
+    case JOURNAL_UNINSTALLED:
+        ctx->res = pkgdb_remove(fs, a);
+        if (ctx->res == FR_NO_FILE) ctx->res = FR_OK;
+        if (ctx->res == FR_OK) ctx->res = depgraph_remove_node(ctx->graph, a);
+        break;
+    case JOURNAL_RDEP_ADD:
+        if (b && lists_dependency(fs, b, a)) ctx->res = depgraph_add_edge(ctx->graph, b, a);
+        break;
+    case JOURNAL_RDEP_REMOVE:
+        if (b) ctx->res = depgraph_remove_edge(ctx->graph, b, a);
+        break;
+    default:
+        break;
+    }
+}
+
+static FRESULT migrate(FATFS *fs) {
+    FRESULT res;
+    FILINFO fno;
+    cJSON *tree = NULL;
+    depgraph_t g = {0};
+    migrate_ctx_t ctx = {&g, 0, FR_OK};
+
+    //a finished snapshot that did not get renamed before a power loss
+    if (f_stat(fs, REV_DEPS_TREE_FILE_PATH, &fno) == FR_NO_FILE && f_stat(fs, REV_DEPS_TREE_TMP_PATH, &fno) == FR_OK) {
+        f_rename(fs, REV_DEPS_TREE_TMP_PATH, REV_DEPS_TREE_FILE_PATH);
+    }
+    res = __f_load_file_to_json(fs, REV_DEPS_TREE_FILE_PATH, &tree);
+    if (res != FR_OK && res != FR_NO_FILE) goto cleanup;
+
+    cJSON *dependency = NULL;
+    cJSON_ArrayForEach(dependency, tree) ctx.edges += cJSON_GetArraySize(dependency);
+    FTRY(journal_replay(fs, count_record, &ctx));
+
+    //every edge adds at most three records
+    FTRY(rebuild(fs, NULL, slots_for(ctx.edges * 3)));
+    g.fs = fs;
+    g.writable = true;
+    FTRY(f_open(fs, &g.file, DEPGRAPH_TMP_PATH, FA_READ | FA_WRITE));
+    g.open = true;
+    FTRY(read_header(&g.file, &g.hdr));
+    //incomplete until the magic is written back
+    memset(g.hdr.magic, 0, sizeof(g.hdr.magic));
+    FTRY(write_header(&g.file, &g.hdr));
+
+    cJSON_ArrayForEach(dependency, tree) {
+        cJSON *dependent = NULL;
+        cJSON_ArrayForEach(dependent, dependency) {
+            if (cJSON_IsString(dependent)) migrate_record(JOURNAL_RDEP_ADD, dependency->string, dependent->valuestring, &ctx);
+        }
+    }
+    //records the snapshot did not take in yet
+    FTRY(journal_replay(fs, migrate_record, &ctx));
+    FTRY(ctx.res);
+
+    memcpy(g.hdr.magic, DEPGRAPH_MAGIC, 4);
+    FTRY(write_header(&g.file, &g.hdr));
+    FTRY(f_sync(&g.file));
+    f_close(&g.file);
+    g.open = false;
+
+    //a power loss from here on finds a complete tmp file, which ensure_db swaps in
+    FTRY(journal_reset(fs));
+    FTRY(swap_in(fs));
+
+cleanup:
+    if (g.open) f_close(&g.file);
+    if(tree) cJSON_Delete(tree);
+    return res;
+}
+
+/**
+ * makes sure deps.db exists: finishes an interrupted swap, or builds it from revdeptree.json and
+ * the journal once
+ */
+static FRESULT ensure_db(FATFS *fs) {
+    FRESULT res;
+    FILINFO fno;
+    FIL file;
+    depgraph_header_t hdr;
+
+    if (f_stat(fs, DEPGRAPH_FILE_PATH, &fno) == FR_OK) return FR_OK;
+
+    if (f_open(fs, &file, DEPGRAPH_TMP_PATH, FA_READ) == FR_OK) {
+        res = read_header(&file, &hdr);
+        f_close(&file);
+        if (res == FR_OK) {
+            FTRY(swap_in(fs));
+            goto done;
+        }
+    }
+    FTRY(migrate(fs));
+
+done:
+    f_unlink(fs, REV_DEPS_TREE_FILE_PATH);
+cleanup:
+    return res;
+}
+
+/**
+ * internal apis
+ */
+FRESULT depgraph_open(FATFS *fs, depgraph_t *g, bool writable) {
+    FRESULT res;
+    memset(g, 0, sizeof(*g));
+    g->fs = fs;
+    g->writable = writable;
+    FTRY(ensure_db(fs));
+    FTRY(open_file(fs, g));
+    g->open = true;
+cleanup:
+    return res;
+}
+
+void depgraph_close(depgraph_t *g) {
+    if (!g->open) return;
+    if (g->writable) f_sync(&g->file);
+    f_close(&g->file);
+    g->open = false;
+}
+
+FRESULT depgraph_dependents(depgraph_t *g, const char *name, uint16_t *count) {
+    FRESULT res;
+    depgraph_record_t node;
+    bool found;
+    *count = 0;
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_OK;
+    FTRY(load(g, name, NODE, &node, &found));
+    *count = node.dependents;
+cleanup:
+    return res;
+}
+
+FRESULT depgraph_dependencies(depgraph_t *g, const char *name, cJSON **out) {
+    FRESULT res;
+    depgraph_record_t node, edge;
+    bool found;
+    *out = cJSON_CreateArray();
+    if (!*out) return FR_NOT_ENOUGH_CORE;
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_OK;
+
+    FTRY(load(g, name, NODE, &node, &found));
+    for (uint16_t i = 0; i < node.dependencies; i++) {
+        FTRY(load(g, name, i, &edge, &found));
+        if (edge.target[0]) cJSON_AddItemToArray(*out, cJSON_CreateString(edge.target));
+    }
+cleanup:
+    return res;
+}
+
+FRESULT depgraph_add_edge(depgraph_t *g, const char *dependent, const char *dependency) {
+    FRESULT res;
+    depgraph_record_t from, to, edge;
+    bool found;
+    uint16_t hole = NODE;
+
+    if (strlen(dependent) >= PKGDB_NAME_SIZE || strlen(dependency) >= PKGDB_NAME_SIZE) return FR_INVALID_NAME;
+    if (strcmp(dependent, dependency) == 0) return FR_OK;
+    FTRY(reserve(g, 3));
+
+    FTRY(load(g, dependent, NODE, &from, &found));
+    for (uint16_t i = 0; i < from.dependencies; i++) {
+        FTRY(load(g, dependent, i, &edge, &found));
+        if (strcmp(edge.target, dependency) == 0) goto cleanup; //already there
+        if (!edge.target[0] && hole == NODE) hole = i;
+    }
+    if (hole == NODE && from.dependencies == NODE - 1) {
+        res = FR_DENIED;
+        goto cleanup;
+    }
+
+    FTRY(load(g, dependency, NODE, &to, &found));
+    to.dependents++;
+    FTRY(store(g, &to));
+
+    FTRY(load(g, dependent, hole != NODE ? hole : from.dependencies, &edge, &found));
+    strcpy(edge.target, dependency);
+    FTRY(store(g, &edge));
+    if (hole == NODE) {
+        from.dependencies++;
+        FTRY(store(g, &from));
+    }
+cleanup:
+    return res;
+}
+
+FRESULT depgraph_remove_edge(depgraph_t *g, const char *dependent, const char *dependency) {
+    FRESULT res;
+    depgraph_record_t from, to, edge;
+    bool found;
+
+    if (strlen(dependent) >= PKGDB_NAME_SIZE || strlen(dependency) >= PKGDB_NAME_SIZE) return FR_OK;
+    FTRY(load(g, dependent, NODE, &from, &found));
+    for (uint16_t i = 0; i < from.dependencies; i++) {
+        FTRY(load(g, dependent, i, &edge, &found));
+        if (strcmp(edge.target, dependency) != 0) continue;
+
+        edge.target[0] = '\0';
+        FTRY(store(g, &edge));
+        FTRY(load(g, dependency, NODE, &to, &found));
+        if (found && to.dependents > 0) {
+            to.dependents--;
+            FTRY(store(g, &to));
+        }
+        break;
+    }
+cleanup:
+    return res;
+}
+
+//drops the edges out of name, and its record once nothing depends on it any more
+FRESULT depgraph_remove_node(depgraph_t *g, const char *name) {
+    FRESULT res;
+    depgraph_record_t node, edge;
+    bool found;
+
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_OK;
+    FTRY(load(g, name, NODE, &node, &found));
+    if (!found) goto cleanup;
+    for (uint16_t i = 0; i < node.dependencies; i++) {
+        FTRY(load(g, name, i, &edge, &found));
+        if (edge.target[0]) FTRY(depgraph_remove_edge(g, name, edge.target));
+    }
+
+    //the node record goes before its edge slots, a replay then finds nothing left to do
+    node.dependencies = 0;
+    if (node.dependents == 0) {
+        FTRY(drop(g, name, NODE));
+    } else {
+        FTRY(store(g, &node));
+    }
+    for (uint16_t i = 0; i < UINT16_MAX; i++) {
+        FTRY(load(g, name, i, &edge, &found));
+        if (!found) break;
+        FTRY(drop(g, name, i));
+    }
+cleanup:
+    return res;
+}
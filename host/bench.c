@@ -0,0 +1,289 @@
+/**
+ * host benchmark harness: upip against a FAT volume in memory and the mock repository of mockrepo.c.
+ * built by host/Makefile, with a MicroPython checkout for oofatfs and cJSON from the system:
+ *
+ *   make -C host MPY=/path/to/micropython upip_bench
+ *   host/upip_bench [latency_ms [downlink_bytes_per_s]]
+ *
+ * every scenario runs on a fresh volume and reports wall time on the host, time on the simulated
+ * link, round trips (all of them, and those spent on resolve and metadata), bytes moved, sectors
+ * written and the heap peak seen at phase boundaries
+ */
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "upip.h"
+#include "mockrepo.h"
+#include "ramdisk.h"
+
+#define BENCH_DISK_SIZE     (4 * 1024 * 1024)
+
+typedef struct {
+    const char *name;
+    double drop_rate;
+    void (*populate)(void);
+    bool (*prepare)(FATFS *fs);     //untimed setup, may be NULL
+    bool (*run)(FATFS *fs);
+} scenario_t;
+
+static size_t heap_base;
+static size_t heap_peak;
+
+static size_t heap_used(void) {
+    return mallinfo2().uordblks;
+}
+
+static void sample_heap(upip_phase_t phase, bool end, uint32_t elapsed_ms, void *arg) {
+    (void)phase; (void)end; (void)elapsed_ms; (void)arg;
+    size_t used = heap_used();
+    if (used > heap_peak) heap_peak = used;
+}
+
+/**
+ * scenarios
+ */
+#define DEEP_LEVELS     12
+#define WIDE_FANOUT     24
+#define PINNED_LIBS     6
+#define PINNED_VERSIONS 4
+#define MANIFEST_APPS   15
+#define MANIFEST_LOCK_PATH  "/manifest.lock"
+
+static void populate_deep(void) {
+    char name[16], deps[32];
+    for (int i = 0; i < DEEP_LEVELS; i++) {
+        snprintf(name, sizeof(name), "deep%d", i);
+        snprintf(deps, sizeof(deps), "deep%d:>=1.0.0", i + 1);
+        mock_repo_add(name, "1.0.0", i + 1 < DEEP_LEVELS ? deps : "", 2, 4096);
+        mock_repo_add(name, "1.1.0", i + 1 < DEEP_LEVELS ? deps : "", 2, 4096);
+    }
+}
+
+static void populate_wide(void) {
+    char name[16], deps[WIDE_FANOUT * 16] = "";
+    for (int i = 0; i < WIDE_FANOUT; i++) {
+        snprintf(name, sizeof(name), "leaf%d", i);
+        mock_repo_add(name, "1.0.0", "", 1, 2048);
+        snprintf(deps + strlen(deps), sizeof(deps) - strlen(deps), "%s%s:*", i ? ";" : "", name);
+    }
+    mock_repo_add("wide", "1.0.0", deps, 1, 2048);
+}
+
+static void populate_large(void) {
+    mock_repo_add("large", "1.0.0", "", 2, 512 * 1024);
+}
+
+//the newest a wants a newer c than b accepts, only a 1.x fits
+static void populate_diamond(void) {
+    mock_repo_add("app", "1.0.0", "a:*;b:*", 1, 1024);
+    mock_repo_add("a", "1.0.0", "c:<2.0.0", 1, 1024);
+    mock_repo_add("a", "1.1.0", "c:<2.0.0", 1, 1024);
+    mock_repo_add("a", "2.0.0", "c:>=2.0.0", 1, 1024);
+    mock_repo_add("b", "1.0.0", "c:>=1.0.0,<2.0.0", 1, 1024);
+    mock_repo_add("c", "1.0.0", "", 1, 1024);
+    mock_repo_add("c", "1.5.0", "", 1, 1024);
+    mock_repo_add("c", "2.0.0", "", 1, 1024);
+    mock_repo_add("c", "2.1.0", "", 1, 1024);
+}
+
+//lib<i> x.0.0 pins core x.0.0, the last lib only exists as 1.0.0 so every other lib has to walk down to it
+static void populate_pinned(void) {
+    char name[16], deps[PINNED_LIBS * 16 + 16] = "", version[16], pin[32];
+    for (int v = 1; v <= PINNED_VERSIONS; v++) {
+        snprintf(version, sizeof(version), "%d.0.0", v);
+        mock_repo_add("core", version, "", 1, 1024);
+        for (int i = 0; i < PINNED_LIBS; i++) {
+            if (i == PINNED_LIBS - 1 && v > 1) break;
+            snprintf(name, sizeof(name), "lib%d", i);
+            snprintf(pin, sizeof(pin), "core:==%s", version);
+            mock_repo_add(name, version, pin, 1, 1024);
+        }
+    }
+    for (int i = 0; i < PINNED_LIBS; i++) {
+        snprintf(deps + strlen(deps), sizeof(deps) - strlen(deps), "%slib%d:*", i ? ";" : "", i);
+    }
+    strcat(deps, ";core:*");
+    mock_repo_add("app", "1.0.0", deps, 1, 1024);
+}
+
+//a device manifest: every app needs the shared util and core, each with its own helper
+static void populate_manifest(void) {
+    char name[16], deps[64];
+    mock_repo_add("util", "1.0.0", "", 1, 2048);
+    mock_repo_add("util", "1.1.0", "", 1, 2048);
+    mock_repo_add("core", "1.2.0", "util:^1.0", 1, 2048);
+    mock_repo_add("core", "1.2.5", "util:^1.0", 1, 2048);
+    for (int i = 0; i < MANIFEST_APPS; i++) {
+        snprintf(name, sizeof(name), "helper%d", i);
+        mock_repo_add(name, "1.0.0", "util:^1.0", 1, 1024);
+        snprintf(deps, sizeof(deps), "helper%d:*;core:~1.2;util:>=1.0.0", i);
+        snprintf(name, sizeof(name), "app%d", i);
+        mock_repo_add(name, "1.0.0", deps, 1, 1024);
+    }
+}
+
+static bool refresh_index(FATFS *fs) {
+    return upip_index_refresh(fs) && upip_index_revision(fs) != 0;
+}
+
+static bool run_app(FATFS *fs) {
+    return install_package(fs, "app", "*");
+}
+
+static bool run_deep(FATFS *fs) {
+    return install_package(fs, "deep0", "*");
+}
+
+static bool run_wide(FATFS *fs) {
+    return install_package(fs, "wide", "*");
+}
+
+static bool run_large(FATFS *fs) {
+    return install_package(fs, "large", "*");
+}
+
+static bool run_manifest_serial(FATFS *fs) {
+    char name[16];
+    for (int i = 0; i < MANIFEST_APPS; i++) {
+        snprintf(name, sizeof(name), "app%d", i);
+        if (!install_package(fs, name, "*")) return false;
+    }
+    return true;
+}
+
+//the same installs with the package database held in RAM and written back once
+static bool run_manifest_session(FATFS *fs) {
+    upip_ctx_t *ctx = upip_ctx_open(fs);
+    bool ok = ctx && run_manifest_serial(fs);
+    return upip_ctx_close(ctx) && ok;
+}
+
+static bool run_manifest_joint(FATFS *fs) {
+    char names[MANIFEST_APPS][16];
+    upip_requirement_t manifest[MANIFEST_APPS];
+    for (int i = 0; i < MANIFEST_APPS; i++) {
+        snprintf(names[i], sizeof(names[i]), "app%d", i);
+        manifest[i].name = names[i];
+        manifest[i].constraint = "^1.0";
+    }
+    return install_packages(fs, manifest, MANIFEST_APPS) && is_installed(fs, "core");
+}
+
+static bool export_manifest_lock(FATFS *fs) {
+    char names[MANIFEST_APPS][16];
+    upip_requirement_t manifest[MANIFEST_APPS];
+    for (int i = 0; i < MANIFEST_APPS; i++) {
+        snprintf(names[i], sizeof(names[i]), "app%d", i);
+        manifest[i].name = names[i];
+        manifest[i].constraint = "^1.0";
+    }
+    return upip_lock_export(fs, manifest, MANIFEST_APPS, MANIFEST_LOCK_PATH);
+}
+
+//the joint plan pinned by a lockfile, the link carries file chunks only
+static bool run_manifest_locked(FATFS *fs) {
+    return install_locked(fs, MANIFEST_LOCK_PATH) && is_installed(fs, "core");
+}
+
+//the same plan received one package at a time
+static bool run_wide_serial(FATFS *fs) {
+    upip_set_download_workers(1);
+    bool ok = run_wide(fs);
+    upip_set_download_workers(UPIP_DOWNLOAD_WORKERS);
+    return ok;
+}
+
+static bool run_cascade(FATFS *fs) {
+    char last[16];
+    snprintf(last, sizeof(last), "deep%d", DEEP_LEVELS - 1);
+    return uninstall_package(fs, "deep0") && !is_installed(fs, last);
+}
+
+static const scenario_t scenarios[] = {
+    {"deep-install",    0.0,  populate_deep,  NULL,     run_deep},
+    {"wide-install",    0.0,  populate_wide,  NULL,     run_wide},
+    {"wide-serial",     0.0,  populate_wide,  NULL,     run_wide_serial},
+    {"large-file",      0.0,  populate_large, NULL,     run_large},
+    {"large-lossy",     0.02, populate_large, NULL,     run_large},
+    {"uninstall-chain", 0.0,  populate_deep,  run_deep, run_cascade},
+    {"conflict-diamond",0.0,  populate_diamond, NULL,   run_app},
+    {"conflict-pinned", 0.0,  populate_pinned, NULL,    run_app},
+    {"deep-indexed",    0.0,  populate_deep,  refresh_index, run_deep},
+    {"pinned-indexed",  0.0,  populate_pinned, refresh_index, run_app},
+    {"manifest-serial", 0.0,  populate_manifest, NULL,  run_manifest_serial},
+    {"manifest-session",0.0,  populate_manifest, NULL,  run_manifest_session},
+    {"manifest-joint",  0.0,  populate_manifest, NULL,  run_manifest_joint},
+    {"manifest-locked", 0.0,  populate_manifest, export_manifest_lock, run_manifest_locked},
+};
+
+/**
+ * runner
+ */
+static double wall_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void run_scenario(const scenario_t *sc, uint32_t latency_ms, uint32_t bandwidth) {
+    FATFS fs;
+    ramdisk_t disk;
+    mock_link_t link = {latency_ms, bandwidth, sc->drop_rate, 0.0, 1};
+    mock_counters_t net;
+    upip_stats_t stats;
+    upip_cjson_arena_stats_t arena;
+    struct timespec start;
+
+    mock_repo_init(&link);
+    sc->populate();
+    if (!ramdisk_mount(&disk, &fs, BENCH_DISK_SIZE)) {
+        printf("%-16s cannot create the volume\n", sc->name);
+        return;
+    }
+    upip_meta_cache_clear();
+
+    if (sc->prepare && !sc->prepare(&fs)) {
+        printf("%-16s setup failed\n", sc->name);
+        goto cleanup;
+    }
+
+    mock_repo_reset_counters();
+    upip_stats_reset();
+    upip_cjson_arena_reset_stats();
+    disk.sectors_written = disk.syncs = 0;
+    uint32_t link_start = mock_repo_now();
+    heap_base = heap_peak = heap_used();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = sc->run(&fs);
+    double wall = wall_ms(&start);
+
+    mock_repo_get_counters(&net);
+    upip_stats_get(&stats);
+    upip_cjson_arena_get_stats(&arena);
+    printf("%-16s %-4s %9.1f %9lu %6lu %8lu %10lu %10lu %8lu %6lu %9zu %8zu\n",
+           sc->name, ok ? "ok" : "FAIL", wall, (unsigned long)(mock_repo_now() - link_start), net.requests,
+           stats.phase[UPIP_PHASE_RESOLVE].calls + stats.phase[UPIP_PHASE_METADATA].calls, net.bytes_down, stats.bytes_written, disk.sectors_written, stats.retries, heap_peak - heap_base,
+           arena.high_water);
+
+cleanup:
+    ramdisk_unmount(&disk, &fs);
+    mock_repo_free();
+}
+
+int main(int argc, char **argv) {
+    uint32_t latency_ms = argc > 1 ? (uint32_t)atoi(argv[1]) : 50;
+    uint32_t bandwidth = argc > 2 ? (uint32_t)atoi(argv[2]) : 256 * 1024;
+
+    upip_stats_set_hook(sample_heap, NULL);
+    printf("latency %u ms, downlink %u B/s\n", latency_ms, bandwidth);
+    printf("%-16s %-4s %9s %9s %6s %8s %10s %10s %8s %6s %9s %8s\n", "scenario", "", "wall_ms", "link_ms", "rtts",
+           "res_rtts", "bytes_down", "written", "sectors", "retry", "heap_peak", "arena_hw");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run_scenario(&scenarios[i], latency_ms, bandwidth);
+    }
+    return 0;
+}
@@ -0,0 +1,233 @@
+/**
+ * json loading benchmark: the heap a load of the json files upip still reads costs, through the
+ * streaming parser of jsonload.c against reading the whole file into a buffer and handing it to
+ * cJSON_Parse, which is how files were loaded before. glibc only, malloc is wrapped like in
+ * resolvebench.c, so build it without sanitizers:
+ *
+ *   make -C host MPY=/path/to/micropython json_bench
+ *   host/json_bench
+ *
+ * the peak columns are the most a load held at once, the tree it returns included, counted in
+ * malloc_usable_size, so they carry the rounding of the allocator and the pointer size of the host.
+ * key_peak loads one entry with __f_load_json_key
+ */
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "ramdisk.h"
+
+#define BENCH_DISK_SIZE     (1024 * 1024)
+#define BENCH_FILE_PATH     UPIP_PKGS_BASE_PATH "bench.json"
+#define BENCH_TEXT_SIZE     65536
+
+typedef struct {
+    const char *name;
+    const char *key;            //loaded on its own by __f_load_json_key, NULL to skip
+    void (*generate)(char *out, size_t len);
+} scenario_t;
+
+/**
+ * malloc accounting
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs;
+static size_t heap_live;
+static size_t heap_peak;
+
+static void account(void *old, size_t old_size, void *ptr) {
+    if (old) heap_live -= old_size;
+    if (ptr) heap_live += malloc_usable_size(ptr);
+    if (heap_live > heap_peak) heap_peak = heap_live;
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    allocs++;
+    account(NULL, 0, ptr);
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    allocs++;
+    account(NULL, 0, ptr);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *grown = __libc_realloc(ptr, size);
+    allocs++;
+    if (grown || !size) account(ptr, old_size, grown);
+    return grown;
+}
+
+void free(void *ptr) {
+    if (ptr) account(ptr, malloc_usable_size(ptr), NULL);
+    __libc_free(ptr);
+}
+
+/**
+ * files, shaped like the ones upip reads: the legacy reverse dependency tree and package list it
+ * migrates, and the metadata of a package as the metadata cache keeps it
+ */
+static size_t append(char *out, size_t len, size_t used, const char *text) {
+    size_t n = strlen(text);
+    if (used + n < len) memcpy(out + used, text, n + 1);
+    return used + n;
+}
+
+//every package depended on by two others
+static void revdeps(char *out, size_t len, int packages) {
+    char entry[96];
+    size_t used = append(out, len, 0, "{");
+    for (int i = 0; i < packages; i++) {
+        snprintf(entry, sizeof(entry), "%s\"package-%02d\":[\"package-%02d\",\"package-%02d\"]", i ? "," : "", i,
+                 (i + 1) % packages, (i + 2) % packages);
+        used = append(out, len, used, entry);
+    }
+    append(out, len, used, "}");
+}
+
+static void revdeps_40(char *out, size_t len) {
+    revdeps(out, len, 40);
+}
+
+static void revdeps_200(char *out, size_t len) {
+    revdeps(out, len, 200);
+}
+
+static void pkgs_40(char *out, size_t len) {
+    char entry[64];
+    size_t used = append(out, len, 0, "{");
+    for (int i = 0; i < 40; i++) {
+        snprintf(entry, sizeof(entry), "%s\"package-%02d\":\"1.%d.0\"", i ? "," : "", i, i % 7);
+        used = append(out, len, used, entry);
+    }
+    append(out, len, used, "}");
+}
+
+//eight files and three dependencies
+static void metadata(char *out, size_t len) {
+    char entry[160];
+    size_t used = append(out, len, 0, "{\"name\":\"package-00\",\"version\":\"1.2.0\",\"dependencies\":[");
+    for (int i = 0; i < 3; i++) {
+        snprintf(entry, sizeof(entry), "%s{\"name\":\"package-%02d\",\"version\":\"^1.0\"}", i ? "," : "", i + 1);
+        used = append(out, len, used, entry);
+    }
+    used = append(out, len, used, "],\"files\":[");
+    for (int i = 0; i < 8; i++) {
+        snprintf(entry, sizeof(entry), "%s{\"filename\":\"module_%d.py\",\"size\":%d,\"sha256\":\"%064d\"}",
+                 i ? "," : "", i, 1000 * (i + 1), i);
+        used = append(out, len, used, entry);
+    }
+    append(out, len, used, "]}");
+}
+
+static const scenario_t scenarios[] = {
+    {"revdeps-40", "package-20", revdeps_40},
+    {"revdeps-200", "package-100", revdeps_200},
+    {"pkgs-40", NULL, pkgs_40},
+    {"metadata", NULL, metadata},
+};
+
+/**
+ * loaders
+ */
+//the loader jsonload.c replaced: the whole file in one buffer, parsed in one go
+static FRESULT load_whole(FATFS *fs, const char *path, const char *key, cJSON **json) {
+    FRESULT res;
+    FIL file = {0};
+    FILINFO fno;
+    UINT br;
+    char *buf = NULL;
+    (void)key;
+
+    FTRY(f_stat(fs, path, &fno));
+    RETURN_IF_NULL(buf, malloc(fno.fsize + 1));
+    FTRY(f_open(fs, &file, path, FA_READ));
+    FTRY(f_read(&file, buf, fno.fsize, &br));
+    buf[br] = '\0';
+    *json = cJSON_Parse(buf);
+
+cleanup:
+    f_close(&file);
+    if (buf) free(buf);
+    return res;
+}
+
+static FRESULT load_streaming(FATFS *fs, const char *path, const char *key, cJSON **json) {
+    (void)key;
+    return __f_load_file_to_json(fs, path, json);
+}
+
+static FRESULT load_key(FATFS *fs, const char *path, const char *key, cJSON **json) {
+    return __f_load_json_key(fs, path, key, json);
+}
+
+typedef FRESULT (*loader_t)(FATFS *fs, const char *path, const char *key, cJSON **json);
+
+//heap peak and allocations of one load, the tree included
+static bool measure(FATFS *fs, loader_t load, const char *key, size_t *peak, unsigned long *count) {
+    cJSON *json = NULL;
+    size_t base = heap_live;
+    heap_peak = heap_live;
+    allocs = 0;
+    FRESULT res = load(fs, BENCH_FILE_PATH, key, &json);
+    *peak = heap_peak - base;
+    *count = allocs;
+    if (json) cJSON_Delete(json);
+    return res == FR_OK && json;
+}
+
+/**
+ * runner
+ */
+static void run_scenario(const scenario_t *sc, char *text) {
+    FATFS fs;
+    ramdisk_t disk;
+    FIL file;
+    UINT bw;
+    size_t whole_peak, stream_peak, key_peak = 0;
+    unsigned long whole_allocs, stream_allocs, key_allocs = 0;
+
+    sc->generate(text, BENCH_TEXT_SIZE);
+    if (!ramdisk_mount(&disk, &fs, BENCH_DISK_SIZE)) {
+        printf("%-12s cannot create the volume\n", sc->name);
+        return;
+    }
+    if (f_open(&fs, &file, BENCH_FILE_PATH, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) goto cleanup;
+    f_write(&file, text, strlen(text), &bw);
+    f_close(&file);
+
+    bool ok = measure(&fs, load_whole, NULL, &whole_peak, &whole_allocs);
+    ok = measure(&fs, load_streaming, NULL, &stream_peak, &stream_allocs) && ok;
+    if (sc->key) ok = measure(&fs, load_key, sc->key, &key_peak, &key_allocs) && ok;
+    printf("%-12s %-4s %7zu %11zu %7lu %12zu %7lu %9zu %7lu\n", sc->name, ok ? "ok" : "FAIL", strlen(text),
+           whole_peak, whole_allocs, stream_peak, stream_allocs, key_peak, key_allocs);
+
+cleanup:
+    ramdisk_unmount(&disk, &fs);
+}
+
+int main(void) {
+    char *text = malloc(BENCH_TEXT_SIZE);
+    if (!text) return 1;
+
+    printf("%-12s %-4s %7s %11s %7s %12s %7s %9s %7s\n", "scenario", "", "bytes", "whole_peak", "allocs",
+           "stream_peak", "allocs", "key_peak", "allocs");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run_scenario(&scenarios[i], text);
+    }
+    free(text);
+    return 0;
+}
@@ -0,0 +1,497 @@
+//In-process package repository: GET_VER, GET_META, RESOLVE_BATCH, GET_VERSIONS, GET_INDEX and file chunks over a simulated loopback link
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "mockrepo.h"
+
+#define MOCK_MAX_PENDING    64
+#define MOCK_NAME_BUCKETS   4096
+#define MOCK_ERROR_MESSAGE  "injected error"
+
+typedef struct {
+    char name[PKGDB_NAME_SIZE + 1];
+    char version[PKGDB_VERSION_SIZE];
+    cJSON *deps;                        //[{"name":..,"version":..}], constraints as in GET_META
+    int file_count;
+    uint32_t file_size;
+    char (*sha256)[SHA256_HEX_SIZE];
+    int next;                           //next package in the same name bucket, -1 ends the chain
+} mock_pkg_t;
+
+typedef struct {
+    uint32_t ready_at;
+    int len;
+    uint8_t *data;
+} mock_reply_t;
+
+static mock_link_t link;
+static mock_counters_t counters;
+static mock_pkg_t *pkgs;
+static int pkg_count;
+static int pkg_capacity;
+static int buckets[MOCK_NAME_BUCKETS];              //first package of every name bucket, -1 when empty
+static uint32_t now_ms;
+static uint32_t downlink_free_at;
+static mock_reply_t pending[MOCK_MAX_PENDING];    //in the order they go down the link
+static int pending_count;
+static int pending_read;                            //bytes of pending[0] already received
+
+/**
+ * registry
+ */
+static void file_name(char *out, size_t len, const mock_pkg_t *pkg, int index) {
+    snprintf(out, len, "%s_%d.py", pkg->name, index);
+}
+
+//printable, deterministic per package, version and file
+static void file_content(const mock_pkg_t *pkg, int index, uint32_t offset, uint8_t *out, uint32_t len) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz_0123456789 =()";
+    unsigned int seed = upip_hash_str(pkg->name) ^ (upip_hash_str(pkg->version) * 31u) ^ (unsigned int)index;
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t o = offset + i;
+        out[i] = (o % 64 == 63) ? '\n' : alphabet[(o / 8 * 2654435761u + seed) % (sizeof(alphabet) - 1)];
+    }
+}
+
+//the same semver module the resolver uses, so both sides agree on what a constraint means
+static int compare_versions(const char *a, const char *b) {
+    semver_t va, vb;
+    if (!semver_parse(a, &va)) memset(&va, 0, sizeof(va));
+    if (!semver_parse(b, &vb)) memset(&vb, 0, sizeof(vb));
+    return semver_compare(&va, &vb);
+}
+
+static bool matches(const char *version, const char *constraint) {
+    return semver_satisfies(version, constraint ? constraint : "*");
+}
+
+//the versions of a name are found through its bucket, registries of thousands of packages stay cheap to ask
+static int next_named(int i, const char *name) {
+    while (i >= 0 && strcmp(pkgs[i].name, name) != 0) i = pkgs[i].next;
+    return i;
+}
+
+static int first_named(const char *name) {
+    return name ? next_named(buckets[upip_hash_str(name) % MOCK_NAME_BUCKETS], name) : -1;
+}
+
+static mock_pkg_t *find_best(const char *name, const char *constraint) {
+    mock_pkg_t *best = NULL;
+    for (int i = first_named(name); i >= 0; i = next_named(pkgs[i].next, name)) {
+        if (!matches(pkgs[i].version, constraint)) continue;
+        if (!best || compare_versions(pkgs[i].version, best->version) > 0) best = &pkgs[i];
+    }
+    return best;
+}
+
+static mock_pkg_t *find_exact(const char *name, const char *version) {
+    for (int i = first_named(name); i >= 0; i = next_named(pkgs[i].next, name)) {
+        if (strcmp(pkgs[i].version, version) == 0) return &pkgs[i];
+    }
+    return NULL;
+}
+
+bool mock_repo_add(const char *name, const char *version, const char *deps, int files, uint32_t file_size) {
+    if (pkg_count == pkg_capacity) {
+        int capacity = pkg_capacity ? pkg_capacity * 2 : 16;
+        mock_pkg_t *grown = realloc(pkgs, capacity * sizeof(*pkgs));
+        if (!grown) return false;
+        pkgs = grown;
+        pkg_capacity = capacity;
+    }
+
+    mock_pkg_t *pkg = &pkgs[pkg_count];
+    memset(pkg, 0, sizeof(*pkg));
+    snprintf(pkg->name, sizeof(pkg->name), "%s", name);
+    snprintf(pkg->version, sizeof(pkg->version), "%s", version);
+    pkg->file_count = files;
+    pkg->file_size = file_size;
+    pkg->deps = cJSON_CreateArray();
+    pkg->sha256 = calloc(files > 0 ? files : 1, sizeof(*pkg->sha256));
+    if (!pkg->deps || !pkg->sha256) return false;
+
+    if (deps && *deps) {
+        char *copy = strdup(deps);
+        for (char *save = NULL, *tok = strtok_r(copy, ";", &save); tok; tok = strtok_r(NULL, ";", &save)) {
+            char *sep = strchr(tok, ':');
+            cJSON *dep = cJSON_CreateObject();
+            if (sep) *sep = '\0';
+            cJSON_AddStringToObject(dep, "name", tok);
+            cJSON_AddStringToObject(dep, "version", sep ? sep + 1 : "*");
+            cJSON_AddItemToArray(pkg->deps, dep);
+        }
+        free(copy);
+    }
+
+    for (int i = 0; i < files; i++) {
+        uint8_t buf[1024];
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256_ctx_t hash;
+        sha256_init(&hash);
+        for (uint32_t off = 0; off < file_size; off += sizeof(buf)) {
+            uint32_t n = file_size - off < sizeof(buf) ? file_size - off : sizeof(buf);
+            file_content(pkg, i, off, buf, n);
+            sha256_update(&hash, buf, n);
+        }
+        sha256_final(&hash, digest);
+        sha256_hex(digest, pkg->sha256[i]);
+    }
+    unsigned int bucket = upip_hash_str(pkg->name) % MOCK_NAME_BUCKETS;
+    pkg->next = buckets[bucket];
+    buckets[bucket] = pkg_count++;
+    return true;
+}
+
+static cJSON *metadata(const mock_pkg_t *pkg, bool named) {
+    char filename[MAX_FILE_PATH];
+    cJSON *meta = cJSON_CreateObject();
+    if (named) {
+        cJSON_AddStringToObject(meta, "name", pkg->name);
+        cJSON_AddStringToObject(meta, "version", pkg->version);
+    }
+    cJSON_AddItemToObject(meta, "dependencies", cJSON_Duplicate(pkg->deps, 1));
+
+    cJSON *files = cJSON_AddArrayToObject(meta, "files");
+    for (int i = 0; i < pkg->file_count; i++) {
+        cJSON *file = cJSON_CreateObject();
+        file_name(filename, sizeof(filename), pkg, i);
+        cJSON_AddStringToObject(file, "filename", filename);
+        cJSON_AddNumberToObject(file, "size", pkg->file_size);
+        cJSON_AddStringToObject(file, "sha256", pkg->sha256[i]);
+        cJSON_AddItemToArray(files, file);
+    }
+    return meta;
+}
+
+//every version of name, newest first
+static cJSON *versions_of(const char *name) {
+    cJSON *versions = cJSON_CreateArray();
+    const char *last = NULL;
+    for (;;) {
+        mock_pkg_t *next = NULL;
+        for (int i = first_named(name); i >= 0; i = next_named(pkgs[i].next, name)) {
+            if (last && compare_versions(pkgs[i].version, last) >= 0) continue;
+            if (!next || compare_versions(pkgs[i].version, next->version) > 0) next = &pkgs[i];
+        }
+        if (!next) return versions;
+        cJSON_AddItemToArray(versions, cJSON_CreateString(next->version));
+        last = next->version;
+    }
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(pkgs[*(const int *)a].name, pkgs[*(const int *)b].name);
+}
+
+//one GET_INDEX page, the revision changes with every package added
+static cJSON *index_page(int page, int limit) {
+    cJSON *result = cJSON_CreateObject();
+    cJSON *entries = cJSON_CreateArray();
+    int *order = malloc((pkg_count > 0 ? pkg_count : 1) * sizeof(int));
+    int names = 0;
+
+    for (int i = 0; i < pkg_count; i++) order[i] = i;
+    qsort(order, pkg_count, sizeof(int), compare_names);
+    for (int i = 0; i < pkg_count; i++) {
+        if (i > 0 && strcmp(pkgs[order[i]].name, pkgs[order[i - 1]].name) == 0) continue;
+        if (names++ / limit != page) continue;
+
+        cJSON *entry = cJSON_CreateObject();
+        cJSON *versions = versions_of(pkgs[order[i]].name);
+        cJSON *version = NULL;
+        cJSON_AddStringToObject(entry, "name", pkgs[order[i]].name);
+        cJSON *list = cJSON_AddArrayToObject(entry, "versions");
+        cJSON_ArrayForEach(version, versions) {
+            mock_pkg_t *pkg = find_exact(pkgs[order[i]].name, version->valuestring);
+            cJSON *item = cJSON_CreateObject();
+            cJSON_AddStringToObject(item, "version", pkg->version);
+            cJSON_AddItemToObject(item, "dependencies", cJSON_Duplicate(pkg->deps, 1));
+            cJSON_AddItemToArray(list, item);
+        }
+        cJSON_Delete(versions);
+        cJSON_AddItemToArray(entries, entry);
+    }
+    free(order);
+
+    cJSON_AddNumberToObject(result, "revision", pkg_count);
+    cJSON_AddNumberToObject(result, "packages", names);
+    cJSON_AddItemToObject(result, "entries", entries);
+    return result;
+}
+
+static int find_file(const mock_pkg_t *pkg, const char *filename) {
+    char name[MAX_FILE_PATH];
+    for (int i = 0; i < pkg->file_count; i++) {
+        file_name(name, sizeof(name), pkg, i);
+        if (strcmp(name, filename) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * link model
+ */
+static bool roll(double rate) {
+    return rate > 0 && (double)rand() / RAND_MAX < rate;
+}
+
+static uint32_t transfer_ms(int len) {
+    return link.bandwidth ? (uint32_t)((uint64_t)len * 1000 / link.bandwidth) : 0;
+}
+
+//queues the reply frame to request id behind the ones already on the downlink
+static void enqueue(uint16_t id, const uint8_t *payload, int len) {
+    int frame_len = TRANSPORT_HEADER_SIZE + len;
+    uint32_t start = now_ms + link.latency_ms;
+    if ((int32_t)(downlink_free_at - start) > 0) start = downlink_free_at;
+    downlink_free_at = start + transfer_ms(frame_len);
+
+    uint8_t *frame = malloc((size_t)frame_len);
+    if (!frame || pending_count == MOCK_MAX_PENDING) {
+        free(frame);
+        counters.dropped++;
+        return;
+    }
+    frame[0] = (uint8_t)id;
+    frame[1] = (uint8_t)(id >> 8);
+    for (int i = 0; i < 4; i++) frame[2 + i] = (uint8_t)((uint32_t)len >> (8 * i));
+    if (len) memcpy(frame + TRANSPORT_HEADER_SIZE, payload, (size_t)len);
+
+    pending[pending_count].ready_at = downlink_free_at;
+    pending[pending_count].len = frame_len;
+    pending[pending_count].data = frame;
+    pending_count++;
+    counters.bytes_down += frame_len;
+}
+
+static uint8_t *chunk_frame(uint32_t offset, uint32_t length, uint8_t status, int *len_out) {
+    uint8_t *frame = calloc(1, CHUNK_HEADER_SIZE + length);
+    if (!frame) return NULL;
+    for (int i = 0; i < 4; i++) {
+        frame[i] = (uint8_t)(offset >> (8 * i));
+        frame[4 + i] = (uint8_t)(length >> (8 * i));
+    }
+    frame[8] = status;
+    *len_out = CHUNK_HEADER_SIZE + (int)length;
+    return frame;
+}
+
+static uint8_t *binary_reply(cJSON *message, int *len_out) {
+    const char *method = cJSON_GetStringValue(cJSON_GetObjectItem(message, "method"));
+    uint32_t offset = (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItem(message, "offset"));
+    uint32_t length = (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItem(message, "length"));
+
+    if (method && strcmp(method, "getFileDelta") == 0) {
+        return chunk_frame(0, 0, CHUNK_STATUS_NO_DELTA, len_out);
+    }
+
+    const char *package = cJSON_GetStringValue(cJSON_GetObjectItem(message, "package"));
+    const char *version = cJSON_GetStringValue(cJSON_GetObjectItem(message, "version"));
+    const char *filename = cJSON_GetStringValue(cJSON_GetObjectItem(message, "filename"));
+    mock_pkg_t *pkg = (package && version) ? find_exact(package, version) : NULL;
+    int index = (pkg && filename) ? find_file(pkg, filename) : -1;
+
+    if (index < 0 || offset > pkg->file_size || roll(link.error_rate)) {
+        const char *message_text = index < 0 ? "no such file" : MOCK_ERROR_MESSAGE;
+        uint8_t *frame = chunk_frame(offset, (uint32_t)strlen(message_text), 1, len_out);
+        if (frame) memcpy(frame + CHUNK_HEADER_SIZE, message_text, strlen(message_text));
+        counters.errors++;
+        return frame;
+    }
+
+    if (length > pkg->file_size - offset) length = pkg->file_size - offset;
+    uint8_t *frame = chunk_frame(offset, length, CHUNK_STATUS_OK, len_out);
+    if (frame) file_content(pkg, index, offset, frame + CHUNK_HEADER_SIZE, length);
+    return frame;
+}
+
+static char *print_reply(cJSON *reply) {
+    char *text = cJSON_PrintUnformatted(reply);
+    char *copy = text ? strdup(text) : NULL;
+    cJSON_free(text);
+    cJSON_Delete(reply);
+    return copy;
+}
+
+static char *json_reply(cJSON *message) {
+    const char *method = cJSON_GetStringValue(cJSON_GetObjectItem(message, "method"));
+    if (!method) return NULL;
+
+    if (strcmp(method, "GET_VER") == 0) {
+        mock_pkg_t *pkg = find_best(cJSON_GetStringValue(cJSON_GetObjectItem(message, "package")),
+                                    cJSON_GetStringValue(cJSON_GetObjectItem(message, "constraint")));
+        return pkg ? strdup(pkg->version) : NULL;
+    }
+
+    if (strcmp(method, "GET_META") == 0) {
+        mock_pkg_t *pkg = find_best(cJSON_GetStringValue(cJSON_GetObjectItem(message, "package")),
+                                    cJSON_GetStringValue(cJSON_GetObjectItem(message, "constraint")));
+        return pkg ? print_reply(metadata(pkg, false)) : NULL;
+    }
+
+    if (strcmp(method, "RESOLVE_BATCH") == 0) {
+        cJSON *reply = cJSON_CreateObject();
+        cJSON_AddTrueToObject(reply, "success");
+        cJSON *result = cJSON_AddArrayToObject(reply, "result");
+        cJSON *item = NULL;
+        cJSON_ArrayForEach(item, cJSON_GetObjectItem(message, "packages")) {
+            mock_pkg_t *pkg = find_best(cJSON_GetStringValue(cJSON_GetObjectItem(item, "name")),
+                                        cJSON_GetStringValue(cJSON_GetObjectItem(item, "constraint")));
+            if (pkg) cJSON_AddItemToArray(result, metadata(pkg, true));
+        }
+        return print_reply(reply);
+    }
+
+    if (strcmp(method, "GET_VERSIONS") == 0) {
+        cJSON *reply = cJSON_CreateObject();
+        cJSON *versions = versions_of(cJSON_GetStringValue(cJSON_GetObjectItem(message, "package")));
+        cJSON_AddBoolToObject(reply, "success", cJSON_GetArraySize(versions) > 0);
+        cJSON_AddItemToObject(reply, "result", versions);
+        return print_reply(reply);
+    }
+
+    if (strcmp(method, "GET_INDEX") == 0) {
+        cJSON *reply = cJSON_CreateObject();
+        int limit = (int)cJSON_GetNumberValue(cJSON_GetObjectItem(message, "limit"));
+        cJSON_AddTrueToObject(reply, "success");
+        if ((int)cJSON_GetNumberValue(cJSON_GetObjectItem(message, "revision")) == pkg_count) {
+            cJSON_AddNumberToObject(cJSON_AddObjectToObject(reply, "result"), "revision", pkg_count);
+        } else {
+            cJSON_AddItemToObject(reply, "result", index_page((int)cJSON_GetNumberValue(cJSON_GetObjectItem(message, "page")),
+                                                             limit > 0 ? limit : 16));
+        }
+        return print_reply(reply);
+    }
+
+    if (strcmp(method, "getFileChunk") == 0) {
+        int len = 0;
+        cJSON *reply = cJSON_CreateObject();
+        uint8_t *frame = binary_reply(message, &len);
+        if (!frame) {
+            cJSON_Delete(reply);
+            return NULL;
+        }
+        bool ok = frame[8] == CHUNK_STATUS_OK;
+        char *data = strndup((const char *)frame + CHUNK_HEADER_SIZE, (size_t)(len - CHUNK_HEADER_SIZE));
+        free(frame);
+        cJSON_AddBoolToObject(reply, "success", ok);
+        if (ok) {
+            cJSON_AddStringToObject(cJSON_AddObjectToObject(reply, "result"), "data", data ? data : "");
+        } else {
+            cJSON_AddStringToObject(reply, "message", data ? data : "");
+        }
+        free(data);
+        return print_reply(reply);
+    }
+    return NULL;
+}
+
+/**
+ * loopback transport. a request is answered as soon as it is sent, its reply frame goes down the
+ * link after the ones queued before it and is handed out as the virtual clock reaches it
+ */
+uint32_t upip_client_millis(void) {
+    return now_ms;
+}
+
+static int loopback_send(void *ctx, const char *message, size_t len) {
+    (void)ctx;
+    counters.requests++;
+    counters.bytes_up += len;
+    if (roll(link.drop_rate)) {
+        counters.dropped++;
+        return 0;
+    }
+
+    //the requests are parsed inside a upip call, none of it stays in its arena
+    size_t mark = cjson_arena_mark();
+    cJSON *request = cJSON_ParseWithLength(message, len);
+    const char *method = cJSON_GetStringValue(cJSON_GetObjectItem(request, "method"));
+    uint16_t id = (uint16_t)cJSON_GetNumberValue(cJSON_GetObjectItem(request, "id"));
+    int reply_len = 0;
+
+    if (method && (strcmp(method, "getFileChunkBin") == 0 || strcmp(method, "getFileDelta") == 0)) {
+        uint8_t *reply = binary_reply(request, &reply_len);
+        if (reply) enqueue(id, reply, reply_len);
+        free(reply);
+    } else if (request) {
+        //no answer goes out as an empty reply
+        char *reply = json_reply(request);
+        enqueue(id, (const uint8_t *)reply, reply ? (int)strlen(reply) : 0);
+        free(reply);
+    }
+    cJSON_Delete(request);
+    cjson_arena_release(mark);
+    return 0;
+}
+
+static int loopback_receive(void *ctx, uint8_t *buf, size_t len, int timeout_ms) {
+    (void)ctx;
+    if (pending_count == 0 || (int32_t)(pending[0].ready_at - (now_ms + (uint32_t)timeout_ms)) > 0) {
+        now_ms += (uint32_t)timeout_ms;
+        return 0;
+    }
+    if ((int32_t)(pending[0].ready_at - now_ms) > 0) now_ms = pending[0].ready_at;
+
+    int n = pending[0].len - pending_read;
+    if (n > (int)len) n = (int)len;
+    memcpy(buf, pending[0].data + pending_read, (size_t)n);
+    pending_read += n;
+    if (pending_read == pending[0].len) {
+        free(pending[0].data);
+        memmove(pending, pending + 1, (size_t)(--pending_count) * sizeof(pending[0]));
+        pending_read = 0;
+    }
+    return n;
+}
+
+static const upip_transport_t loopback = {NULL, loopback_send, loopback_receive};
+
+const upip_transport_t *mock_repo_transport(void) {
+    return &loopback;
+}
+
+/**
+ * setup
+ */
+void mock_repo_init(const mock_link_t *config) {
+    mock_repo_free();
+    link = *config;
+    srand(link.seed);
+    upip_set_transport(&loopback);
+}
+
+void mock_repo_free(void) {
+    for (int i = 0; i < pkg_count; i++) {
+        cJSON_Delete(pkgs[i].deps);
+        free(pkgs[i].sha256);
+    }
+    for (int i = 0; i < pending_count; i++) {
+        free(pending[i].data);
+    }
+    free(pkgs);
+    pkgs = NULL;
+    memset(buckets, 0xff, sizeof(buckets));
+    pkg_count = pkg_capacity = pending_count = pending_read = 0;
+    now_ms = downlink_free_at = 0;
+    memset(&counters, 0, sizeof(counters));
+}
+
+uint32_t mock_repo_now(void) {
+    return now_ms;
+}
+
+void mock_repo_get_counters(mock_counters_t *out) {
+    *out = counters;
+}
+
+void mock_repo_reset_counters(void) {
+    memset(&counters, 0, sizeof(counters));
+}
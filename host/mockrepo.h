@@ -0,0 +1,45 @@
+//In-process package repository behind a loopback transport, with a simulated link
+#ifndef MOCKREPO_H_
+#define MOCKREPO_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "upip.h"
+
+/**
+ * the link runs on a virtual clock that upip_client_millis reports. every request costs latency_ms
+ * and its reply occupies the downlink for reply size / bandwidth, replies to pipelined requests queue
+ * up behind each other. dropped requests never get a reply, errors answer chunk requests with a
+ * non zero status. mock_repo_init installs the loopback transport with upip_set_transport
+ */
+typedef struct {
+    uint32_t latency_ms;        // round trip time
+    uint32_t bandwidth;         // downlink bytes per second, 0 for unlimited
+    double drop_rate;
+    double error_rate;
+    unsigned int seed;
+} mock_link_t;
+
+typedef struct {
+    unsigned long requests;     // round trips, one per request sent
+    unsigned long dropped;
+    unsigned long errors;
+    unsigned long bytes_up;
+    unsigned long bytes_down;
+} mock_counters_t;
+
+void mock_repo_init(const mock_link_t *link);
+void mock_repo_free(void);
+
+//deps lists "name:constraint" pairs separated by ';', files are file_size bytes of generated text each
+bool mock_repo_add(const char *name, const char *version, const char *deps, int files, uint32_t file_size);
+
+//the loopback backend mock_repo_init installs, for harnesses that wrap it
+const upip_transport_t *mock_repo_transport(void);
+
+uint32_t mock_repo_now(void);
+void mock_repo_get_counters(mock_counters_t *out);
+void mock_repo_reset_counters(void);
+
+#endif // MOCKREPO_H_
@@ -0,0 +1,85 @@
+//oofatfs disk driver over a block of host memory, counts sector traffic for the benchmarks
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/oofatfs/ff.h"
+#include "lib/oofatfs/diskio.h"
+
+#include "upip_conf.h"
+#include "ramdisk.h"
+
+#define RAMDISK_SECTOR_SIZE 512
+
+DRESULT disk_read(void *drv, BYTE *buff, DWORD sector, UINT count) {
+    ramdisk_t *disk = drv;
+    if (sector + count > disk->sectors) return RES_PARERR;
+    memcpy(buff, disk->image + (size_t)sector * RAMDISK_SECTOR_SIZE, (size_t)count * RAMDISK_SECTOR_SIZE);
+    disk->sectors_read += count;
+    return RES_OK;
+}
+
+DRESULT disk_write(void *drv, const BYTE *buff, DWORD sector, UINT count) {
+    ramdisk_t *disk = drv;
+    if (sector + count > disk->sectors) return RES_PARERR;
+    memcpy(disk->image + (size_t)sector * RAMDISK_SECTOR_SIZE, buff, (size_t)count * RAMDISK_SECTOR_SIZE);
+    disk->sectors_written += count;
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(void *drv, BYTE cmd, void *buff) {
+    ramdisk_t *disk = drv;
+    switch (cmd) {
+    case CTRL_SYNC:
+        disk->syncs++;
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(DWORD *)buff = disk->sectors;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD *)buff = RAMDISK_SECTOR_SIZE;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = 1;
+        return RES_OK;
+    case IOCTL_INIT:
+    case IOCTL_STATUS:
+        *(DSTATUS *)buff = 0;
+        return RES_OK;
+    default:
+        return RES_PARERR;
+    }
+}
+
+bool ramdisk_mount(ramdisk_t *disk, FATFS *fs, size_t bytes) {
+    BYTE work[FF_MAX_SS];
+    char base[MAX_FILE_PATH];
+
+    memset(disk, 0, sizeof(*disk));
+    memset(fs, 0, sizeof(*fs));
+    disk->sectors = bytes / RAMDISK_SECTOR_SIZE;
+    disk->image = calloc(disk->sectors, RAMDISK_SECTOR_SIZE);
+    if (!disk->image) return false;
+
+    fs->drv = disk;
+    if (f_mkfs(fs, FM_FAT | FM_SFD, 0, work, sizeof(work)) != FR_OK || f_mount(fs) != FR_OK) {
+        ramdisk_unmount(disk, fs);
+        return false;
+    }
+
+    //every level of UPIP_PKGS_BASE_PATH
+    strcpy(base, UPIP_PKGS_BASE_PATH);
+    for (char *p = base + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        f_mkdir(fs, base);
+        *p = '/';
+    }
+    disk->sectors_read = disk->sectors_written = disk->syncs = 0;
+    return true;
+}
+
+void ramdisk_unmount(ramdisk_t *disk, FATFS *fs) {
+    f_umount(fs);
+    free(disk->image);
+    disk->image = NULL;
+}
@@ -0,0 +1,22 @@
+//FAT volume in host memory for the benchmark harness
+#ifndef RAMDISK_H_
+#define RAMDISK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lib/oofatfs/ff.h"
+
+typedef struct {
+    unsigned char *image;
+    unsigned long sectors;
+    unsigned long sectors_read;
+    unsigned long sectors_written;
+    unsigned long syncs;
+} ramdisk_t;
+
+//formats a volume of the given size, mounts it and creates UPIP_PKGS_BASE_PATH on it
+bool ramdisk_mount(ramdisk_t *disk, FATFS *fs, size_t bytes);
+void ramdisk_unmount(ramdisk_t *disk, FATFS *fs);
+
+#endif // RAMDISK_H_
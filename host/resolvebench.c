@@ -0,0 +1,358 @@
+/**
+ * resolver scaling benchmark: resolve_ex against synthetic registries in the mock repository of
+ * mockrepo.c, deep chains, wide fan-out, stacked diamonds, conflicts that need the backtracking
+ * search and a registry of 10k packages with 8 versions each. glibc only, malloc is wrapped to
+ * count allocations, so build it without sanitizers:
+ *
+ *   make -C host MPY=/path/to/micropython resolve_bench
+ *   host/resolve_bench [--json]
+ *
+ * every scenario reports the host time spent in the resolver, with the time the stub takes to
+ * answer left out, round trips, allocations and reallocations made outside the stub, the heap
+ * peak above where the scenario started and the deepest stack the call reached. --json prints
+ * one object per scenario and line instead of the table, for tracking the numbers over time
+ */
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "mockrepo.h"
+#include "ramdisk.h"
+
+#define BENCH_DISK_SIZE     (1024 * 1024)
+#define BENCH_STACK_PAINT   (1024 * 1024)   //painted below the caller, deeper calls are not seen
+#define STACK_PATTERN       0xa5
+
+#define CHAIN_SHORT         100
+#define CHAIN_LONG          2000
+#define FANOUT_LEAVES       1000
+#define DIAMOND_LAYERS      8
+#define DIAMOND_WIDTH       16
+#define CONFLICT_PAIRS      4
+#define REGISTRY_PACKAGES   10000
+#define REGISTRY_ROOTS      64
+
+typedef struct {
+    const char *name;
+    const char *root;
+    int max_packages;           //sizes the scratch block handed to resolve_ex
+    void (*populate)(void);
+} scenario_t;
+
+/**
+ * malloc accounting, the stub's own work is left out
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting;
+static bool in_stub;
+static unsigned long allocs;
+static unsigned long reallocs;
+static size_t heap_live;
+static size_t heap_peak;
+
+static void account(void *old, size_t old_size, void *ptr) {
+    if (old) heap_live -= old_size;
+    if (ptr) heap_live += malloc_usable_size(ptr);
+    if (heap_live > heap_peak) heap_peak = heap_live;
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (counting && !in_stub) allocs++;
+    account(NULL, 0, ptr);
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    if (counting && !in_stub) allocs++;
+    account(NULL, 0, ptr);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *grown = __libc_realloc(ptr, size);
+    if (counting && !in_stub) {
+        if (ptr) reallocs++;
+        else allocs++;
+    }
+    if (grown || !size) account(ptr, old_size, grown);
+    return grown;
+}
+
+void free(void *ptr) {
+    if (ptr) account(ptr, malloc_usable_size(ptr), NULL);
+    __libc_free(ptr);
+}
+
+/**
+ * the mock's loopback, timed so the stub answering does not count as resolver time
+ */
+static const upip_transport_t *stub;
+static double stub_ns;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int timed_send(void *ctx, const char *message, size_t len) {
+    double started = now_ns();
+    in_stub = true;
+    int ret = stub->send(ctx, message, len);
+    in_stub = false;
+    stub_ns += now_ns() - started;
+    return ret;
+}
+
+static int timed_receive(void *ctx, uint8_t *buf, size_t len, int timeout_ms) {
+    double started = now_ns();
+    in_stub = true;
+    int ret = stub->receive(ctx, buf, len, timeout_ms);
+    in_stub = false;
+    stub_ns += now_ns() - started;
+    return ret;
+}
+
+static const upip_transport_t timed = {NULL, timed_send, timed_receive};
+
+/**
+ * stack depth: the area below the caller is painted before the run and scanned for the lowest
+ * byte overwritten after it. both happen in the same function called from the same frame, so
+ * the area lies at the same address each time
+ */
+static __attribute__((noinline)) size_t stack_probe(bool paint) {
+    uint8_t area[BENCH_STACK_PAINT];
+    size_t used = 0;
+
+    if (paint) {
+        memset(area, STACK_PATTERN, sizeof(area));
+    } else {
+        const volatile uint8_t *painted = area;     //left by the painting call, not this one
+        size_t i = 0;
+        while (i < sizeof(area) && painted[i] == STACK_PATTERN) i++;
+        used = sizeof(area) - i;
+    }
+    __asm__ volatile("" : : "r"(area) : "memory");
+    return used;
+}
+
+/**
+ * registries
+ */
+static unsigned int lcg;
+
+static unsigned int next_random(void) {
+    lcg = lcg * 1103515245u + 12345u;
+    return (lcg >> 8) & 0xffffff;
+}
+
+//p0 -> p1 -> .. with three versions of every link
+static void populate_chain(int length) {
+    static const char *const versions[] = {"1.0.0", "1.1.0", "1.2.3"};
+    char name[16], deps[32];
+    for (int i = 0; i < length; i++) {
+        snprintf(name, sizeof(name), "p%d", i);
+        snprintf(deps, sizeof(deps), "p%d:>=1.0.0,<2.0.0", i + 1);
+        for (int v = 0; v < 3; v++) mock_repo_add(name, versions[v], i + 1 < length ? deps : "", 1, 64);
+    }
+}
+
+static void populate_chain_short(void) {
+    populate_chain(CHAIN_SHORT);
+}
+
+static void populate_chain_long(void) {
+    populate_chain(CHAIN_LONG);
+}
+
+static void populate_fanout(void) {
+    static const char *const versions[] = {"0.9.0", "1.0.0", "1.4.1", "2.0.0"};
+    char name[16];
+    size_t len = 0, size = FANOUT_LEAVES * 16;
+    char *deps = malloc(size);
+    if (!deps) return;
+
+    deps[0] = '\0';
+    for (int i = 0; i < FANOUT_LEAVES; i++) {
+        snprintf(name, sizeof(name), "leaf%d", i);
+        for (int v = 0; v < 4; v++) mock_repo_add(name, versions[v], "", 1, 64);
+        len += (size_t)snprintf(deps + len, size - len, "%s%s:^1.0", i ? ";" : "", name);
+    }
+    mock_repo_add("root", "1.0.0", deps, 1, 64);
+    free(deps);
+}
+
+//every node of a layer needs every node of the next one, the last layer has no dependencies
+static void populate_diamond(void) {
+    char name[16], deps[DIAMOND_WIDTH * 24];
+    for (int layer = 0; layer < DIAMOND_LAYERS; layer++) {
+        size_t len = 0;
+        deps[0] = '\0';
+        for (int j = 0; layer + 1 < DIAMOND_LAYERS && j < DIAMOND_WIDTH; j++) {
+            len += (size_t)snprintf(deps + len, sizeof(deps) - len, "%sd%d_%d:~1.2", j ? ";" : "", layer + 1, j);
+        }
+        for (int i = 0; i < DIAMOND_WIDTH; i++) {
+            snprintf(name, sizeof(name), "d%d_%d", layer, i);
+            mock_repo_add(name, "1.2.0", deps, 1, 64);
+            mock_repo_add(name, "1.2.7", deps, 1, 64);
+            mock_repo_add(name, "1.3.0", deps, 1, 64);
+        }
+    }
+    size_t len = 0;
+    for (int i = 0; i < DIAMOND_WIDTH; i++) {
+        len += (size_t)snprintf(deps + len, sizeof(deps) - len, "%sd0_%d:*", i ? ";" : "", i);
+    }
+    mock_repo_add("root", "1.0.0", deps, 1, 64);
+}
+
+//the newest a<i> wants a newer c<i> than b<i> accepts, greedy fails and the search walks a<i> down
+static void populate_conflict(void) {
+    char a[16], b[16], c[16], deps[CONFLICT_PAIRS * 24] = "", dep[32];
+    for (int i = 0; i < CONFLICT_PAIRS; i++) {
+        snprintf(a, sizeof(a), "a%d", i);
+        snprintf(b, sizeof(b), "b%d", i);
+        snprintf(c, sizeof(c), "c%d", i);
+        snprintf(dep, sizeof(dep), "%s:<2.0.0", c);
+        mock_repo_add(a, "1.0.0", dep, 1, 64);
+        mock_repo_add(a, "1.1.0", dep, 1, 64);
+        snprintf(dep, sizeof(dep), "%s:>=2.0.0", c);
+        mock_repo_add(a, "2.0.0", dep, 1, 64);
+        snprintf(dep, sizeof(dep), "%s:>=1.0.0,<2.0.0", c);
+        mock_repo_add(b, "1.0.0", dep, 1, 64);
+        mock_repo_add(c, "1.0.0", "", 1, 64);
+        mock_repo_add(c, "1.5.0", "", 1, 64);
+        mock_repo_add(c, "2.0.0", "", 1, 64);
+        snprintf(deps + strlen(deps), sizeof(deps) - strlen(deps), "%s%s:*;%s:*", i ? ";" : "", a, b);
+    }
+    mock_repo_add("root", "1.0.0", deps, 1, 64);
+}
+
+/**
+ * pkg<i> depends on up to three packages with a higher index, the same ones in every version
+ * but under different constraints that all agree on 1.3.0, so the greedy pass resolves it. the
+ * root depends on REGISTRY_ROOTS packages spread over the registry
+ */
+static void populate_registry(void) {
+    static const char *const versions[] = {"0.9.0", "1.0.0", "1.1.0", "1.2.0", "1.2.5", "1.3.0", "2.0.0", "2.1.0"};
+    static const char *const constraints[] = {"^1.0", ">=1.1.0 <2", "~1.3", "1.x", ">=1.2.0,<1.4"};
+    char name[16], deps[128], root[REGISTRY_ROOTS * 24];
+    size_t len = 0;
+
+    lcg = 1;
+    for (int i = 0; i < REGISTRY_PACKAGES; i++) {
+        int targets[3], count = (int)(next_random() % 4);
+        for (int d = 0; d < count; d++) {
+            targets[d] = i + 1 + (int)(next_random() % 200);
+            if (targets[d] >= REGISTRY_PACKAGES) count = d;
+        }
+
+        snprintf(name, sizeof(name), "pkg%d", i);
+        for (int v = 0; v < 8; v++) {
+            size_t n = 0;
+            deps[0] = '\0';
+            for (int d = 0; d < count; d++) {
+                const char *constraint = constraints[(i + v + d) % 5];
+                n += (size_t)snprintf(deps + n, sizeof(deps) - n, "%spkg%d:%s", d ? ";" : "", targets[d], constraint);
+            }
+            mock_repo_add(name, versions[v], deps, 1, 64);
+        }
+    }
+    for (int r = 0; r < REGISTRY_ROOTS; r++) {
+        len += (size_t)snprintf(root + len, sizeof(root) - len, "%spkg%d:^1.0", r ? ";" : "", r * (REGISTRY_PACKAGES / REGISTRY_ROOTS));
+    }
+    mock_repo_add("root", "1.0.0", root, 1, 64);
+}
+
+static const scenario_t scenarios[] = {
+    {"chain-100",       "p0",   CHAIN_SHORT,                    populate_chain_short},
+    {"chain-2000",      "p0",   CHAIN_LONG,                     populate_chain_long},
+    {"fanout-1000",     "root", FANOUT_LEAVES + 1,              populate_fanout},
+    {"diamond-8x16",    "root", DIAMOND_LAYERS * DIAMOND_WIDTH + 1, populate_diamond},
+    {"conflict-4",      "root", CONFLICT_PAIRS * 3 + 1,         populate_conflict},
+    {"registry-10k",    "root", REGISTRY_PACKAGES + 1,          populate_registry},
+};
+
+/**
+ * runner
+ */
+static bool json_output;
+
+static void run_scenario(const scenario_t *sc) {
+    FATFS fs;
+    ramdisk_t disk;
+    mock_link_t link = {0, 0, 0.0, 0.0, 1};
+    mock_counters_t net;
+    size_t scratch_size = UPIP_RESOLVE_SCRATCH_SIZE(sc->max_packages);
+    void *scratch = NULL;
+    int packages = 0;
+
+    mock_repo_init(&link);
+    stub = mock_repo_transport();
+    upip_set_transport(&timed);
+    sc->populate();
+    if (!ramdisk_mount(&disk, &fs, BENCH_DISK_SIZE)) {
+        printf("%-14s cannot create the volume\n", sc->name);
+        mock_repo_free();
+        return;
+    }
+    if (!(scratch = malloc(scratch_size))) goto cleanup;
+    upip_meta_cache_clear();
+    mock_repo_reset_counters();
+
+    stub_ns = 0;
+    allocs = reallocs = 0;
+    heap_peak = heap_live;
+    size_t heap_base = heap_live;
+    stack_probe(true);
+    counting = true;
+
+    double started = now_ns();
+    cJSON *order = resolve_ex(&fs, sc->root, "*", scratch, scratch_size);
+    double resolver_ms = (now_ns() - started - stub_ns) / 1e6;
+
+    counting = false;
+    size_t stack = stack_probe(false);
+    mock_repo_get_counters(&net);
+    if (order) packages = cJSON_GetArraySize(order);
+    cJSON_Delete(order);
+
+    if (json_output) {
+        printf("{\"scenario\":\"%s\",\"ok\":%s,\"packages\":%d,\"resolve_ms\":%.3f,\"stub_ms\":%.3f,\"rtts\":%lu,"
+               "\"allocs\":%lu,\"reallocs\":%lu,\"heap_peak\":%zu,\"stack\":%zu}\n",
+               sc->name, order ? "true" : "false", packages, resolver_ms, stub_ns / 1e6, net.requests, allocs, reallocs,
+               heap_peak - heap_base, stack);
+    } else {
+        printf("%-14s %-4s %8d %10.2f %9.2f %6lu %9lu %8lu %10zu %8zu\n", sc->name, order ? "ok" : "FAIL", packages,
+               resolver_ms, stub_ns / 1e6, net.requests, allocs, reallocs, heap_peak - heap_base, stack);
+    }
+
+cleanup:
+    free(scratch);
+    ramdisk_unmount(&disk, &fs);
+    mock_repo_free();
+}
+
+int main(int argc, char **argv) {
+    json_output = argc > 1 && strcmp(argv[1], "--json") == 0;
+
+    if (!json_output) {
+        printf("%-14s %-4s %8s %10s %9s %6s %9s %8s %10s %8s\n", "scenario", "", "packages", "resolve_ms", "stub_ms",
+               "rtts", "allocs", "reallocs", "heap_peak", "stack");
+    }
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run_scenario(&scenarios[i]);
+    }
+    return 0;
+}
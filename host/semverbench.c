@@ -0,0 +1,201 @@
+/**
+ * constraint matching microbenchmark: the sscanf/strtok matcher semver.c replaced against
+ * semver_satisfies and against ranges compiled once, over every version x constraint pair.
+ * constraints the old matcher understood are also checked to give the same answer.
+ *
+ *   make -C host MPY=/path/to/micropython semver_bench
+ *   host/semver_bench [rounds]
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "upip.h"
+#include "upip_internal.h"
+
+#define VERSION_COUNT   64
+
+/**
+ * the matcher resolver.c used before semver.c, kept as it was
+ */
+typedef struct {
+    int major;
+    int minor;
+    int patch;
+} legacy_semver_t;
+
+static int parse_version(const char *version_str, legacy_semver_t *out) {
+    if (!version_str || strcmp(version_str, "*") == 0) {
+        out->major = out->minor = out->patch = 0;
+        return 1; // valid wildcard
+    }
+
+    return sscanf(version_str, "%d.%d.%d", &out->major, &out->minor, &out->patch) == 3;
+}
+
+static int compare_versions(const legacy_semver_t *a, const legacy_semver_t *b) {
+    if (a->major != b->major) return a->major - b->major;
+    if (a->minor != b->minor) return a->minor - b->minor;
+    return a->patch - b->patch;
+}
+
+static int semver_parser(const char *version_str, const char *constraint) {
+    if (!constraint || !version_str) return 0;
+    if (strcmp(constraint, "*") == 0) return 1;
+
+    legacy_semver_t version, target;
+    if (!parse_version(version_str, &version)) return 0;
+
+    const char *op = constraint;
+    const char *ver = NULL;
+
+    if (strncmp(op, ">=", 2) == 0) {
+        ver = op + 2;
+        if (!parse_version(ver, &target)) return 0;
+        return compare_versions(&version, &target) >= 0;
+    } else if (strncmp(op, "<=", 2) == 0) {
+        ver = op + 2;
+        if (!parse_version(ver, &target)) return 0;
+        return compare_versions(&version, &target) <= 0;
+    } else if (strncmp(op, "==", 2) == 0) {
+        ver = op + 2;
+        if (strcmp(ver, "*") == 0) return 1;
+        if (!parse_version(ver, &target)) return 0;
+        return compare_versions(&version, &target) == 0;
+    } else if (op[0] == '>' && isdigit(op[1])) {
+        ver = op + 1;
+        if (!parse_version(ver, &target)) return 0;
+        return compare_versions(&version, &target) > 0;
+    } else if (op[0] == '<' && isdigit(op[1])) {
+        ver = op + 1;
+        if (!parse_version(ver, &target)) return 0;
+        return compare_versions(&version, &target) < 0;
+    }
+
+    return 0; // invalid constraint
+}
+
+static int satisfies_constraint(const char *version_str, const char *constraint_str) {
+    if (!constraint_str || !version_str) return 0;
+
+    char constraint_copy[64];
+    strncpy(constraint_copy, constraint_str, sizeof(constraint_copy) - 1);
+    constraint_copy[sizeof(constraint_copy) - 1] = '\0';
+
+    char *token = strtok(constraint_copy, ",");
+    while (token) {
+        while (isspace((unsigned char)*token)) token++; // trim left
+
+        if (!semver_parser(version_str, token)) {
+            return 0; // one failure is enough
+        }
+
+        token = strtok(NULL, ",");
+    }
+
+    return 1; // all constraints passed
+}
+
+/**
+ * corpus
+ */
+typedef struct {
+    const char *constraint;
+    bool legacy;            //the old matcher understands it, the answers must agree
+} constraint_case_t;
+
+static const constraint_case_t constraints[] = {
+    {"*", true},
+    {">=1.2.0", true},
+    {">=1.0.0,<2.0.0", true},
+    {"==1.4.2", true},
+    {">0.9.9, <=3.1.0", true},
+    {"<1.0.0", true},
+    {">=0.5.0,<=0.5.7,==0.5.3", true},
+    {"^1.2.3", false},
+    {"~1.4", false},
+    {"^0.2.1 || ^1.0 || >=3.2.0", false},
+    {">=1.0.0-rc.1 <2", false},
+    {"1.x", false},
+};
+#define CONSTRAINT_COUNT    ((int)(sizeof(constraints) / sizeof(constraints[0])))
+
+static char versions[VERSION_COUNT][PKGDB_VERSION_SIZE];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    semver_t parsed[VERSION_COUNT];
+    semver_range_t ranges[CONSTRAINT_COUNT];
+    int mismatches = 0;
+    volatile int sink = 0;
+
+    for (int i = 0; i < VERSION_COUNT; i++) {
+        snprintf(versions[i], sizeof(versions[i]), "%d.%d.%d", i / 16, (i / 4) % 4 * 2, i % 4 * 3);
+        if (!semver_parse(versions[i], &parsed[i])) return 1;
+    }
+    for (int c = 0; c < CONSTRAINT_COUNT; c++) {
+        if (!semver_range_compile(constraints[c].constraint, &ranges[c])) {
+            fprintf(stderr, "%s does not compile\n", constraints[c].constraint);
+            return 1;
+        }
+        if (!constraints[c].legacy) continue;
+        for (int i = 0; i < VERSION_COUNT; i++) {
+            bool old = satisfies_constraint(versions[i], constraints[c].constraint);
+            if (old == semver_range_contains(&ranges[c], &parsed[i])) continue;
+            fprintf(stderr, "%s %s: legacy %d, compiled %d\n", versions[i], constraints[c].constraint, old, !old);
+            mismatches++;
+        }
+    }
+
+    double pairs = (double)rounds * VERSION_COUNT * CONSTRAINT_COUNT;
+    double started = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int c = 0; c < CONSTRAINT_COUNT; c++) {
+            for (int i = 0; i < VERSION_COUNT; i++) sink += satisfies_constraint(versions[i], constraints[c].constraint);
+        }
+    }
+    double legacy_ns = (now_ns() - started) / pairs;
+
+    started = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int c = 0; c < CONSTRAINT_COUNT; c++) {
+            for (int i = 0; i < VERSION_COUNT; i++) sink += semver_satisfies(versions[i], constraints[c].constraint);
+        }
+    }
+    double satisfies_ns = (now_ns() - started) / pairs;
+
+    started = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int c = 0; c < CONSTRAINT_COUNT; c++) {
+            for (int i = 0; i < VERSION_COUNT; i++) sink += semver_range_contains(&ranges[c], &parsed[i]);
+        }
+    }
+    double compiled_ns = (now_ns() - started) / pairs;
+
+    double intersections = (double)rounds * CONSTRAINT_COUNT * CONSTRAINT_COUNT;
+    semver_range_t joined;
+    started = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int a = 0; a < CONSTRAINT_COUNT; a++) {
+            for (int b = 0; b < CONSTRAINT_COUNT; b++) sink += semver_range_intersect(&ranges[a], &ranges[b], &joined) && joined.count;
+        }
+    }
+    double intersect_ns = (now_ns() - started) / intersections;
+
+    printf("%-28s %10s\n", "matcher", "ns/check");
+    printf("%-28s %10.1f\n", "legacy sscanf/strtok", legacy_ns);
+    printf("%-28s %10.1f\n", "semver_satisfies", satisfies_ns);
+    printf("%-28s %10.1f\n", "compiled range", compiled_ns);
+    printf("%-28s %10.1f\n", "range intersection", intersect_ns);
+    printf("legacy disagreements: %d\n", mismatches);
+    (void)sink;
+    return mismatches ? 1 : 0;
+}
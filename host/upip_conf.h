@@ -0,0 +1,14 @@
+//Host build configuration, same layout as the device one
+#ifndef UPIP_CONF_H_
+#define UPIP_CONF_H_
+
+#define CHUNK_SIZE                      8192  // 8 KB per chunk
+#define MAX_FILE_PATH                   64
+#define UPIP_PKGS_BASE_PATH             "/flash/upip_pkgs/"
+#define REV_DEPS_TREE_FILE_PATH         "/flash/upip_pkgs/revdeptree.json"
+#define INSTALLED_PKGS_DB_PATH          "/flash/upip_pkgs/pkgs.json"
+#define FLASH_FS_ROOT_FS_PATH           "/flash"
+
+static const char *TAG __attribute__((unused)) = "upip";
+
+#endif // UPIP_CONF_H_
@@ -0,0 +1,362 @@
+//Repository index: every version and dependency list of the repository in one sorted file, resolve reads it instead of the server
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+#define INDEX_MAGIC             "UPIX"
+#define INDEX_FORMAT            1
+#define INDEX_TMP_PATH          INDEX_FILE_PATH ".tmp"
+
+/**
+ * file layout: header (index_header_t), one directory entry per package sorted by name, then the
+ * package records. header and entries are stored as they are in memory, like pkgs.db. a record is
+ * a little endian u16 version count followed by every version newest first as
+ *   str version, u8 dependency count, (str name, str constraint) per dependency
+ * where str is a u8 length and the bytes without terminator
+ */
+typedef struct {
+    char name[PKGDB_NAME_SIZE];
+    uint32_t offset;    //of the record, from the start of the file
+    uint32_t length;
+} index_entry_t;
+
+static FRESULT read_header(FIL *file, index_header_t *hdr) {
+    FRESULT res;
+    UINT br;
+    FTRY(f_lseek(file, 0));
+    FTRY(f_read(file, hdr, sizeof(*hdr), &br));
+    if (br != sizeof(*hdr) || memcmp(hdr->magic, INDEX_MAGIC, 4) != 0 ||
+        hdr->format != INDEX_FORMAT || hdr->entry_size != sizeof(index_entry_t)) {
+        res = FR_NO_FILESYSTEM;
+    }
+cleanup:
+    return res;
+}
+
+static FSIZE_t entry_offset(uint32_t i) {
+    return sizeof(index_header_t) + (FSIZE_t)i * sizeof(index_entry_t);
+}
+
+static FRESULT read_entry(FIL *file, uint32_t i, index_entry_t *entry) {
+    FRESULT res;
+    UINT br;
+    FTRY(f_lseek(file, entry_offset(i)));
+    FTRY(f_read(file, entry, sizeof(*entry), &br));
+    if (br != sizeof(*entry)) res = FR_INT_ERR;
+cleanup:
+    return res;
+}
+
+/**
+ * reading. records go through the buffer of the index handle, a lookup costs one entry read per
+ * step of the binary search plus the record itself
+ */
+typedef struct {
+    index_t *index;
+    uint32_t left;      //record bytes not yet taken into the buffer
+    UINT len;
+    UINT pos;
+} record_reader_t;
+
+static bool take(record_reader_t *r, void *out, size_t n) {
+    uint8_t *dst = out;
+    while (n > 0) {
+        if (r->pos == r->len) {
+            UINT want = r->left < sizeof(r->index->buf) ? r->left : sizeof(r->index->buf);
+            if (want == 0 || f_read(&r->index->file, r->index->buf, want, &r->len) != FR_OK || r->len != want) return false;
+            r->left -= want;
+            r->pos = 0;
+        }
+        UINT chunk = r->len - r->pos < n ? r->len - r->pos : (UINT)n;
+        memcpy(dst, r->index->buf + r->pos, chunk);
+        r->pos += chunk;
+        dst += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+static bool take_str(record_reader_t *r, char *out) {
+    uint8_t len;
+    if (!take(r, &len, 1) || !take(r, out, len)) return false;
+    out[len] = '\0';
+    return true;
+}
+
+FRESULT index_open(FATFS *fs, index_t *index) {
+    FRESULT res;
+    memset(index, 0, sizeof(*index));
+    FTRY(f_open(fs, &index->file, INDEX_FILE_PATH, FA_READ));
+    index->open = true;
+    res = read_header(&index->file, &index->hdr);
+    if (res != FR_OK) index_close(index);
+cleanup:
+    return res;
+}
+
+void index_close(index_t *index) {
+    if (index->open) f_close(&index->file);
+    index->open = false;
+}
+
+FRESULT index_lookup(index_t *index, const char *name, cJSON **versions, cJSON **deps_of) {
+    FRESULT res = FR_NO_FILE;
+    index_entry_t entry;
+    uint32_t lo = 0, hi = index->hdr.packages;
+    *versions = *deps_of = NULL;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        FTRY(read_entry(&index->file, mid, &entry));
+        int cmp = strncmp(entry.name, name, PKGDB_NAME_SIZE);
+        if (cmp == 0) break;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo >= hi) return FR_NO_FILE;
+
+    record_reader_t r = {index, entry.length, 0, 0};
+    char version[256], dep_name[256], constraint[256];
+    uint8_t count[2], dep_count;
+    FTRY(f_lseek(&index->file, entry.offset));
+
+    res = FR_INT_ERR;
+    *versions = cJSON_CreateArray();
+    *deps_of = cJSON_CreateObject();
+    if (!take(&r, count, 2)) goto cleanup;
+    for (int v = count[0] | (count[1] << 8); v > 0; v--) {
+        if (!take_str(&r, version) || !take(&r, &dep_count, 1)) goto cleanup;
+        cJSON *deps = cJSON_CreateArray();
+        cJSON_AddItemToArray(*versions, cJSON_CreateString(version));
+        cJSON_AddItemToObject(*deps_of, version, deps);
+        for (; dep_count > 0; dep_count--) {
+            if (!take_str(&r, dep_name) || !take_str(&r, constraint)) goto cleanup;
+            cJSON *dep = cJSON_CreateObject();
+            cJSON_AddStringToObject(dep, "name", dep_name);
+            cJSON_AddStringToObject(dep, "version", constraint);
+            cJSON_AddItemToArray(deps, dep);
+        }
+    }
+    res = FR_OK;
+
+cleanup:
+    if (res != FR_OK) {
+        cJSON_Delete(*versions);
+        cJSON_Delete(*deps_of);
+        *versions = *deps_of = NULL;
+    }
+    return res;
+}
+
+/**
+ * refresh. the index comes in pages of at most UPIP_INDEX_PAGE_PACKAGES packages:
+ *   request:  {"method":"GET_INDEX","revision":<revision held, 0 for none>,"page":n,"limit":..}
+ *   response: {"success":true,"result":{"revision":..,"packages":<total>,"entries":[
+ *                 {"name":..,"versions":[{"version":..,"dependencies":[{"name":..,"version":..}]},..]},..]}}
+ * entries are sorted by name across pages and versions are newest first. a reply carrying the
+ * revision already held ends the refresh without entries. the new index is built in a temporary
+ * file and renamed over the old one once complete, a revision change between pages aborts it
+ */
+typedef struct {
+    FIL file;
+    uint8_t buf[UPIP_INDEX_READ_BUF];
+    UINT len;
+    FSIZE_t offset;     //where the buffer goes
+    bool failed;
+} record_writer_t;
+
+static void flush(record_writer_t *w) {
+    UINT bw;
+    if (w->len == 0 || w->failed) return;
+    if (f_lseek(&w->file, w->offset) != FR_OK || f_write(&w->file, w->buf, w->len, &bw) != FR_OK || bw != w->len) {
+        w->failed = true;
+    }
+    w->offset += w->len;
+    w->len = 0;
+}
+
+static void put(record_writer_t *w, const void *data, size_t n) {
+    const uint8_t *src = data;
+    while (n > 0 && !w->failed) {
+        if (w->len == sizeof(w->buf)) flush(w);
+        UINT chunk = sizeof(w->buf) - w->len < n ? sizeof(w->buf) - w->len : (UINT)n;
+        memcpy(w->buf + w->len, src, chunk);
+        w->len += chunk;
+        src += chunk;
+        n -= chunk;
+    }
+}
+
+static bool put_str(record_writer_t *w, const char *str) {
+    size_t len = str ? strlen(str) : 256;
+    if (len > 255) return false;
+    uint8_t len8 = (uint8_t)len;
+    put(w, &len8, 1);
+    put(w, str, len);
+    return true;
+}
+
+static bool put_record(record_writer_t *w, cJSON *versions) {
+    int count = cJSON_GetArraySize(versions);
+    uint8_t count16[2] = {(uint8_t)count, (uint8_t)(count >> 8)};
+    if (count > UINT16_MAX) return false;
+    put(w, count16, 2);
+
+    cJSON *version = NULL;
+    cJSON_ArrayForEach(version, versions) {
+        cJSON *deps = cJSON_GetObjectItem(version, "dependencies");
+        int dep_count = cJSON_GetArraySize(deps);
+        uint8_t count8 = (uint8_t)dep_count;
+        if (dep_count > UINT8_MAX || !put_str(w, cJSON_GetStringValue(cJSON_GetObjectItem(version, "version")))) return false;
+        put(w, &count8, 1);
+
+        cJSON *dep = NULL;
+        cJSON_ArrayForEach(dep, deps) {
+            if (!put_str(w, cJSON_GetStringValue(cJSON_GetObjectItem(dep, "name"))) ||
+                !put_str(w, cJSON_GetStringValue(cJSON_GetObjectItem(dep, "version")))) return false;
+        }
+    }
+    return !w->failed;
+}
+
+static cJSON *repo_get_index_page(uint32_t revision, int page) {
+    cJSON *result = NULL;
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "method", "GET_INDEX");
+    cJSON_AddNumberToObject(root, "revision", revision);
+    cJSON_AddNumberToObject(root, "page", page);
+    cJSON_AddNumberToObject(root, "limit", UPIP_INDEX_PAGE_PACKAGES);
+
+    uint32_t started = stats_phase_begin(UPIP_PHASE_RESOLVE);
+    char *response = transport_request(root, LONG_TIMEOUT);
+    cJSON *response_json = cJSON_Parse(response);
+
+    cJSON_Delete(root);
+    if(response) free(response);
+
+    if (response_json && cJSON_IsTrue(cJSON_GetObjectItem(response_json, "success"))) {
+        result = cJSON_DetachItemFromObject(response_json, "result");
+    } else if (response_json) {
+        fprintf(stderr, "Server error: %s\n", cJSON_GetStringValue(cJSON_GetObjectItem(response_json, "message")));
+    }
+
+    cJSON_Delete(response_json);
+    if (result && !cJSON_IsNumber(cJSON_GetObjectItem(result, "revision"))) {
+        cJSON_Delete(result);
+        result = NULL;
+    }
+    stats_phase_end(UPIP_PHASE_RESOLVE, started, result != NULL);
+    return result;
+}
+
+uint32_t upip_index_revision(FATFS *fs) {
+    FIL file;
+    index_header_t hdr;
+    uint32_t revision = 0;
+
+    mutex_take();
+    if (f_open(fs, &file, INDEX_FILE_PATH, FA_READ) == FR_OK) {
+        revision = read_header(&file, &hdr) == FR_OK ? hdr.revision : 0;
+        f_close(&file);
+    }
+    mutex_give();
+    return revision;
+}
+
+bool upip_index_refresh(FATFS *fs) {
+    bool ret = false;
+    bool file_open = false;
+    cJSON *page = NULL;
+    record_writer_t *w = NULL;
+    index_header_t hdr = {{0}, INDEX_FORMAT, sizeof(index_entry_t), 0, 0};
+    index_entry_t entry;
+    uint32_t held = 0;
+    uint32_t received = 0;
+    uint32_t written = 0;      //received less the entries pkgs.db could not record anyway
+    UINT bw;
+    FRESULT res;
+
+    mutex_take();
+    cjson_arena_enter();
+    held = upip_index_revision(fs);
+    RETURN_IF_NULL(page, repo_get_index_page(held, 0));
+    hdr.revision = (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItem(page, "revision"));
+    if (held != 0 && hdr.revision == held) {
+        ret = true;
+        goto cleanup;
+    }
+    hdr.packages = (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItem(page, "packages"));
+
+    RETURN_IF_NULL(w, calloc(1, sizeof(*w)));
+    FTRY(f_open(fs, &w->file, INDEX_TMP_PATH, FA_WRITE | FA_CREATE_ALWAYS));
+    file_open = true;
+    FTRY(f_write(&w->file, &hdr, sizeof(hdr), &bw)); //zeroed magic until the file is complete
+    w->offset = entry_offset(hdr.packages);
+
+    for (int n = 1; received < hdr.packages; n++) {
+        cJSON *item = NULL;
+        cJSON_ArrayForEach(item, cJSON_GetObjectItem(page, "entries")) {
+            const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(item, "name"));
+            if (!name || received == hdr.packages ||
+                (written > 0 && strncmp(entry.name, name, PKGDB_NAME_SIZE) >= 0)) {
+                fprintf(stderr, "Index entry %u is out of order or malformed\n", (unsigned)received);
+                goto cleanup;
+            }
+            received++;
+            if (strlen(name) >= PKGDB_NAME_SIZE) {
+                //such a package could not be installed, a resolve needing it fails as without an index
+                fprintf(stderr, "Index entry %s skipped: name too long\n", name);
+                continue;
+            }
+
+            memset(&entry, 0, sizeof(entry));
+            strncpy(entry.name, name, sizeof(entry.name) - 1);
+            entry.offset = (uint32_t)(w->offset + w->len);
+            if (!put_record(w, cJSON_GetObjectItem(item, "versions"))) goto cleanup;
+            entry.length = (uint32_t)(w->offset + w->len) - entry.offset;
+
+            flush(w);
+            if (w->failed) goto cleanup;
+            FTRY(f_lseek(&w->file, entry_offset(written)));
+            FTRY(f_write(&w->file, &entry, sizeof(entry), &bw));
+            written++;
+        }
+        if (received == hdr.packages) break;
+
+        cJSON_Delete(page);
+        RETURN_IF_NULL(page, repo_get_index_page(held, n));
+        if ((uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItem(page, "revision")) != hdr.revision ||
+            cJSON_GetArraySize(cJSON_GetObjectItem(page, "entries")) == 0) {
+            fprintf(stderr, "Index changed or ended early during refresh\n");
+            goto cleanup;
+        }
+    }
+
+    hdr.packages = written; //directory entries of skipped packages stay unused
+    memcpy(hdr.magic, INDEX_MAGIC, 4);
+    FTRY(f_lseek(&w->file, 0));
+    FTRY(f_write(&w->file, &hdr, sizeof(hdr), &bw));
+    file_open = false;
+    FTRY(f_close(&w->file));
+    res = f_unlink(fs, INDEX_FILE_PATH);
+    if (res != FR_OK && res != FR_NO_FILE) goto cleanup;
+    FTRY(f_rename(fs, INDEX_TMP_PATH, INDEX_FILE_PATH));
+    ret = true;
+
+cleanup:
+    if (file_open) f_close(&w->file);
+    if (!ret) f_unlink(fs, INDEX_TMP_PATH);
+    if (w) free(w);
+    if (page) cJSON_Delete(page);
+    cjson_arena_leave();
+    mutex_give();
+    return ret;
+}
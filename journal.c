@@ -0,0 +1,202 @@
+//Write-ahead journal: each change to the installed database or reverse dependency tree is one appended line
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+/**
+ * record format, one per line:  "<op> <name> [<arg>]\n"
+ * a transaction ends with        "C <record count>\n"
+ * records after the last valid commit line are ignored and cut off on recovery
+ */
+#define JOURNAL_LINE_SIZE       (2 * PKGDB_NAME_SIZE + 8)
+
+typedef struct {
+    FIL *file;
+    char buf[128];
+    UINT len;
+    UINT pos;
+    FSIZE_t offset;     //file offset of the next unread byte
+} line_reader_t;
+
+static FRESULT reader_init(line_reader_t *r, FIL *file, FSIZE_t offset) {
+    r->file = file;
+    r->len = r->pos = 0;
+    r->offset = offset;
+    return f_lseek(file, offset);
+}
+
+//returns the line length without '\n', 0 at end of file or on a torn or overlong line
+static size_t read_line(line_reader_t *r, char *line, size_t size) {
+    size_t n = 0;
+    while (1) {
+        if (r->pos == r->len) {
+            if (f_read(r->file, r->buf, sizeof(r->buf), &r->len) != FR_OK || r->len == 0) return 0;
+            r->pos = 0;
+        }
+        char c = r->buf[r->pos++];
+        r->offset++;
+        if (c == '\n') {
+            line[n] = '\0';
+            return n;
+        }
+        if (n + 1 >= size) return 0;
+        line[n++] = c;
+    }
+}
+
+//splits "<op> <a> [<b>]" in place
+static bool parse_record(char *line, char *op, char **a, char **b) {
+    if (line[0] == '\0' || line[1] != ' ') return false;
+    *op = line[0];
+    *a = line + 2;
+    *b = strchr(*a, ' ');
+    if (*b) *(*b)++ = '\0';
+    return **a != '\0';
+}
+
+/**
+ * walks the committed transactions starting at start. *end_out is set to the offset just past
+ * the last valid commit line. apply (if given) sees every record up to that point, in order
+ */
+static FRESULT replay_range(FIL *file, FSIZE_t start, FSIZE_t *end_out, journal_apply_fn apply, void *arg) {
+    FRESULT res;
+    line_reader_t reader;
+    char line[JOURNAL_LINE_SIZE];
+    char op, *a, *b;
+    FSIZE_t committed = start;
+    int records = 0;
+
+    //pass 1: find the last complete transaction
+    FTRY(reader_init(&reader, file, start));
+    while (read_line(&reader, line, sizeof(line)) > 0) {
+        if (!parse_record(line, &op, &a, &b)) break;
+        if (op != JOURNAL_COMMIT) {
+            records++;
+            continue;
+        }
+        if (atoi(a) != records) break;
+        committed = reader.offset;
+        records = 0;
+    }
+
+    //pass 2: apply it
+    if (apply && committed > start) {
+        FTRY(reader_init(&reader, file, start));
+        while (reader.offset < committed && read_line(&reader, line, sizeof(line)) > 0) {
+            if (parse_record(line, &op, &a, &b) && op != JOURNAL_COMMIT) apply(op, a, b, arg);
+        }
+    }
+
+    if (end_out) *end_out = committed;
+cleanup:
+    return res;
+}
+
+/**
+ * internal apis
+ */
+FRESULT journal_begin(FATFS *fs, journal_t *j) {
+    FRESULT res;
+    memset(j, 0, sizeof(*j));
+    FTRY(f_open(fs, &j->file, JOURNAL_FILE_PATH, FA_READ | FA_WRITE | FA_OPEN_ALWAYS));
+    j->open = true;
+    j->start = f_size(&j->file);
+    FTRY(f_lseek(&j->file, j->start));
+cleanup:
+    return res;
+}
+
+FRESULT journal_append(journal_t *j, char op, const char *a, const char *b) {
+    FRESULT res;
+    char line[JOURNAL_LINE_SIZE];
+    UINT bw;
+
+    int len = b ? snprintf(line, sizeof(line), "%c %s %s\n", op, a, b) : snprintf(line, sizeof(line), "%c %s\n", op, a);
+    if (len <= 0 || len >= (int)sizeof(line)) return FR_INVALID_NAME;
+
+    FTRY(f_write(&j->file, line, len, &bw));
+    if (bw != (UINT)len) res = FR_DENIED;
+    j->records++;
+cleanup:
+    return res;
+}
+
+FRESULT journal_commit(journal_t *j, journal_apply_fn apply, void *arg) {
+    FRESULT res;
+    char line[16];
+    UINT bw;
+
+    int len = snprintf(line, sizeof(line), "%c %d\n", JOURNAL_COMMIT, j->records);
+    FTRY(f_write(&j->file, line, len, &bw));
+    if (bw != (UINT)len) {
+        res = FR_DENIED;
+        goto cleanup;
+    }
+    FTRY(f_sync(&j->file)); //the transaction is durable from here on
+
+    //re-read what was just committed so that commit and recovery apply through the same path
+    FTRY(replay_range(&j->file, j->start, NULL, apply, arg));
+
+cleanup:
+    f_close(&j->file);
+    j->open = false;
+    return res;
+}
+
+void journal_abort(journal_t *j) {
+    if (!j->open) return;
+    if (f_lseek(&j->file, j->start) == FR_OK) f_truncate(&j->file);
+    f_close(&j->file);
+    j->open = false;
+}
+
+FRESULT journal_replay(FATFS *fs, journal_apply_fn apply, void *arg) {
+    FRESULT res;
+    FIL file = {0};
+
+    res = f_open(fs, &file, JOURNAL_FILE_PATH, FA_READ);
+    if (res == FR_NO_FILE) return FR_OK;
+    if (res != FR_OK) return res;
+
+    res = replay_range(&file, 0, NULL, apply, arg);
+    f_close(&file);
+    return res;
+}
+
+FRESULT journal_recover(FATFS *fs, journal_apply_fn apply, void *arg) {
+    FRESULT res;
+    FIL file = {0};
+    FSIZE_t committed = 0;
+
+    res = f_open(fs, &file, JOURNAL_FILE_PATH, FA_READ | FA_WRITE);
+    if (res == FR_NO_FILE) return FR_OK;
+    if (res != FR_OK) return res;
+
+    FTRY(replay_range(&file, 0, &committed, apply, arg));
+    if (f_size(&file) > committed) {
+        //drop the tail of a transaction that never committed
+        FTRY(f_lseek(&file, committed));
+        FTRY(f_truncate(&file));
+        FTRY(f_sync(&file));
+    }
+cleanup:
+    f_close(&file);
+    return res;
+}
+
+FSIZE_t journal_size(FATFS *fs) {
+    FILINFO fno;
+    return f_stat(fs, JOURNAL_FILE_PATH, &fno) == FR_OK ? fno.fsize : 0;
+}
+
+FRESULT journal_reset(FATFS *fs) {
+    FRESULT res = f_unlink(fs, JOURNAL_FILE_PATH);
+    return res == FR_NO_FILE ? FR_OK : res;
+}
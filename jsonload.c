@@ -0,0 +1,285 @@
+//Streaming JSON loading: files are parsed through a small fixed buffer instead of being read whole
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+#define JSON_MAX_DEPTH      16
+#define JSON_MAX_NUMBER     32
+
+typedef struct {
+    FIL file;
+    char buf[UPIP_JSON_READ_BUF];
+    UINT pos;
+    UINT len;
+    FRESULT res;
+    bool eof;
+    char *str;          //the string being read, grows to the longest one in the file
+    size_t str_len;
+    size_t str_cap;
+} json_reader_t;
+
+static int next(json_reader_t *r) {
+    if (r->pos == r->len) {
+        if (r->eof || r->res != FR_OK) return -1;
+        r->res = f_read(&r->file, r->buf, sizeof(r->buf), &r->len);
+        r->pos = 0;
+        if (r->res != FR_OK || r->len == 0) {
+            r->eof = true;
+            r->len = 0;
+            return -1;
+        }
+    }
+    return (unsigned char)r->buf[r->pos++];
+}
+
+static int peek(json_reader_t *r) {
+    int c = next(r);
+    if (c >= 0) r->pos--;
+    return c;
+}
+
+static int skip_ws(json_reader_t *r) {
+    int c;
+    while ((c = peek(r)) == ' ' || c == '\t' || c == '\n' || c == '\r') r->pos++;
+    return c;
+}
+
+static bool str_push(json_reader_t *r, char c) {
+    if (r->str_len + 1 >= r->str_cap) {
+        size_t cap = r->str_cap ? r->str_cap * 2 : 32;
+        char *str = realloc(r->str, cap);
+        if (!str) return false;
+        r->str = str;
+        r->str_cap = cap;
+    }
+    r->str[r->str_len++] = c;
+    r->str[r->str_len] = '\0';
+    return true;
+}
+
+static int read_hex4(json_reader_t *r) {
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = next(r);
+        if (c >= '0' && c <= '9') v = (v << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f') v = (v << 4) | (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v = (v << 4) | (c - 'A' + 10);
+        else return -1;
+    }
+    return v;
+}
+
+static bool push_utf8(json_reader_t *r, unsigned long cp) {
+    if (cp < 0x80) return str_push(r, (char)cp);
+    if (cp < 0x800) return str_push(r, (char)(0xc0 | (cp >> 6))) && str_push(r, (char)(0x80 | (cp & 0x3f)));
+    if (cp < 0x10000) {
+        return str_push(r, (char)(0xe0 | (cp >> 12))) && str_push(r, (char)(0x80 | ((cp >> 6) & 0x3f))) &&
+               str_push(r, (char)(0x80 | (cp & 0x3f)));
+    }
+    return str_push(r, (char)(0xf0 | (cp >> 18))) && str_push(r, (char)(0x80 | ((cp >> 12) & 0x3f))) &&
+           str_push(r, (char)(0x80 | ((cp >> 6) & 0x3f))) && str_push(r, (char)(0x80 | (cp & 0x3f)));
+}
+
+//reads the rest of a string whose opening quote was consumed into r->str
+static bool read_string(json_reader_t *r) {
+    r->str_len = 0;
+    if (!str_push(r, '\0')) return false; //r->str must exist for empty strings too
+    r->str_len = 0;
+
+    while (1) {
+        int c = next(r);
+        if (c < 0) return false;
+        if (c == '"') return true;
+        if (c != '\\') {
+            if (!str_push(r, (char)c)) return false;
+            continue;
+        }
+
+        c = next(r);
+        switch (c) {
+        case '"': case '\\': case '/': if (!str_push(r, (char)c)) return false; break;
+        case 'b': if (!str_push(r, '\b')) return false; break;
+        case 'f': if (!str_push(r, '\f')) return false; break;
+        case 'n': if (!str_push(r, '\n')) return false; break;
+        case 'r': if (!str_push(r, '\r')) return false; break;
+        case 't': if (!str_push(r, '\t')) return false; break;
+        case 'u': {
+            long cp = read_hex4(r);
+            if (cp < 0) return false;
+            if (cp >= 0xd800 && cp <= 0xdbff) {
+                //surrogate pair
+                if (next(r) != '\\' || next(r) != 'u') return false;
+                long low = read_hex4(r);
+                if (low < 0xdc00 || low > 0xdfff) return false;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            }
+            if (!push_utf8(r, (unsigned long)cp)) return false;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+static bool read_literal(json_reader_t *r, const char *rest) {
+    for (; *rest; rest++) {
+        if (next(r) != *rest) return false;
+    }
+    return true;
+}
+
+//parses one value, into *out when out is set and skipped without allocating otherwise
+static bool parse_value(json_reader_t *r, int depth, cJSON **out) {
+    cJSON *item = NULL;
+    int c = skip_ws(r);
+    if (depth > JSON_MAX_DEPTH || c < 0) return false;
+    r->pos++;
+
+    switch (c) {
+    case '{':
+    case '[': {
+        bool object = c == '{';
+        if (out && !(item = object ? cJSON_CreateObject() : cJSON_CreateArray())) return false;
+        if (skip_ws(r) == (object ? '}' : ']')) {
+            r->pos++;
+            break;
+        }
+
+        while (1) {
+            char *key = NULL;
+            cJSON *child = NULL;
+            if (object) {
+                if (skip_ws(r) != '"') goto fail;
+                r->pos++;
+                if (!read_string(r)) goto fail;
+                if (out) {
+                    //handed to the child as is, cJSON_Delete frees it
+                    if (!(key = cJSON_malloc(r->str_len + 1))) goto fail;
+                    memcpy(key, r->str, r->str_len + 1);
+                }
+                if (skip_ws(r) != ':') {
+                    if (key) cJSON_free(key);
+                    goto fail;
+                }
+                r->pos++;
+            }
+            if (!parse_value(r, depth + 1, out ? &child : NULL)) {
+                if (key) cJSON_free(key);
+                goto fail;
+            }
+            if (out) {
+                child->string = key;
+                cJSON_AddItemToArray(item, child);
+            }
+
+            c = skip_ws(r);
+            r->pos++;
+            if (c == ',') continue;
+            if (c == (object ? '}' : ']')) break;
+            goto fail;
+        }
+        break;
+    }
+    case '"':
+        if (!read_string(r)) return false;
+        if (out && !(item = cJSON_CreateString(r->str))) return false;
+        break;
+    case 't':
+        if (!read_literal(r, "rue")) return false;
+        if (out && !(item = cJSON_CreateTrue())) return false;
+        break;
+    case 'f':
+        if (!read_literal(r, "alse")) return false;
+        if (out && !(item = cJSON_CreateFalse())) return false;
+        break;
+    case 'n':
+        if (!read_literal(r, "ull")) return false;
+        if (out && !(item = cJSON_CreateNull())) return false;
+        break;
+    default: {
+        char number[JSON_MAX_NUMBER];
+        size_t len = 0;
+        if (c != '-' && (c < '0' || c > '9')) return false;
+        number[len++] = (char)c;
+        while ((c = peek(r)) >= 0 && (strchr("0123456789+-.eE", c) != NULL)) {
+            if (len + 1 >= sizeof(number)) return false;
+            number[len++] = (char)c;
+            r->pos++;
+        }
+        number[len] = '\0';
+        char *end = NULL;
+        double value = strtod(number, &end);
+        if (*end != '\0') return false;
+        if (out && !(item = cJSON_CreateNumber(value))) return false;
+        break;
+    }
+    }
+
+    if (out) *out = item;
+    return true;
+
+fail:
+    if (item) cJSON_Delete(item);
+    return false;
+}
+
+static FRESULT reader_open(json_reader_t *r, FATFS *fs, const char *fpath) {
+    memset(r, 0, sizeof(*r));
+    return f_open(fs, &r->file, fpath, FA_READ);
+}
+
+static FRESULT reader_close(json_reader_t *r) {
+    f_close(&r->file);
+    if (r->str) free(r->str);
+    return r->res;
+}
+
+FRESULT __f_load_file_to_json(FATFS *fs, const char *fpath, cJSON **json) {
+    json_reader_t r;
+    FRESULT res;
+
+    *json = NULL;
+    if ((res = reader_open(&r, fs, fpath)) != FR_OK) return res;
+    if (!parse_value(&r, 0, json)) *json = NULL;
+    return reader_close(&r);
+}
+
+FRESULT __f_load_json_key(FATFS *fs, const char *fpath, const char *key, cJSON **json) {
+    json_reader_t r;
+    FRESULT res;
+
+    *json = NULL;
+    if ((res = reader_open(&r, fs, fpath)) != FR_OK) return res;
+    if (skip_ws(&r) != '{') goto cleanup;
+    r.pos++;
+    if (skip_ws(&r) == '}') goto cleanup;
+
+    while (1) {
+        if (skip_ws(&r) != '"') break;
+        r.pos++;
+        if (!read_string(&r)) break;
+        bool match = strcmp(r.str, key) == 0;
+
+        if (skip_ws(&r) != ':') break;
+        r.pos++;
+        if (match) {
+            if (!parse_value(&r, 1, json)) *json = NULL;
+            break;
+        }
+        if (!parse_value(&r, 1, NULL)) break;
+
+        int c = skip_ws(&r);
+        r.pos++;
+        if (c != ',') break;
+    }
+
+cleanup:
+    return reader_close(&r);
+}
@@ -0,0 +1,75 @@
+//Streaming LZSS decoder for compressed package files, heatshrink bitstream with a bounded window
+#include <stdint.h>
+#include <string.h>
+
+#include "upip.h"
+#include "upip_internal.h"
+
+enum { LZSS_TAG, LZSS_LITERAL, LZSS_DISTANCE, LZSS_COUNT };
+
+static void flush(lzss_t *d) {
+    if (d->failed || d->head == d->flushed) return;
+    if (!d->write(d->window + d->flushed, d->head - d->flushed, d->arg)) d->failed = true;
+    d->flushed = d->head;
+}
+
+static void emit(lzss_t *d, uint8_t byte) {
+    d->window[d->head++] = byte;
+    if (d->head == (1u << d->window_bits)) {
+        //the oldest bytes are about to be overwritten, hand them out first
+        flush(d);
+        d->head = d->flushed = 0;
+    }
+}
+
+static int take_bits(lzss_t *d, uint8_t count) {
+    if (d->acc_bits < count) return -1;
+    d->acc_bits -= count;
+    return (int)((d->acc >> d->acc_bits) & ((1u << count) - 1));
+}
+
+bool lzss_init(lzss_t *d, uint8_t window_bits, uint8_t lookahead_bits, patch_write_fn write, void *arg) {
+    if (window_bits < 4 || window_bits > UPIP_LZSS_WINDOW_BITS) return false;
+    if (lookahead_bits < 3 || lookahead_bits >= window_bits) return false;
+
+    memset(d, 0, sizeof(*d));
+    d->window_bits = window_bits;
+    d->lookahead_bits = lookahead_bits;
+    d->write = write;
+    d->arg = arg;
+    return true;
+}
+
+bool lzss_feed(lzss_t *d, const uint8_t *data, size_t len) {
+    uint16_t mask = (uint16_t)((1u << d->window_bits) - 1);
+
+    for (size_t i = 0; i < len && !d->failed; i++) {
+        d->acc = (d->acc << 8) | data[i];
+        d->acc_bits += 8;
+
+        while (!d->failed) {
+            int v;
+            if (d->state == LZSS_TAG) {
+                if ((v = take_bits(d, 1)) < 0) break;
+                d->state = v ? LZSS_LITERAL : LZSS_DISTANCE;
+            } else if (d->state == LZSS_LITERAL) {
+                if ((v = take_bits(d, 8)) < 0) break;
+                emit(d, (uint8_t)v);
+                d->state = LZSS_TAG;
+            } else if (d->state == LZSS_DISTANCE) {
+                if ((v = take_bits(d, d->window_bits)) < 0) break;
+                d->distance = (uint16_t)(v + 1);
+                d->state = LZSS_COUNT;
+            } else {
+                if ((v = take_bits(d, d->lookahead_bits)) < 0) break;
+                for (int n = v + 1; n > 0; n--) {
+                    emit(d, d->window[(uint16_t)(d->head - d->distance) & mask]);
+                }
+                d->state = LZSS_TAG;
+            }
+        }
+    }
+
+    flush(d);
+    return !d->failed;
+}
@@ -0,0 +1,220 @@
+//Metadata cache: bounded LRU in RAM in front of GET_META, installed entries kept on the FAT volume
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+typedef struct {
+    char key[META_CACHE_KEY_SIZE];  //name@version
+    cJSON *meta;
+    unsigned long last_used;
+} meta_cache_entry_t;
+
+static meta_cache_entry_t cache[UPIP_META_CACHE_ENTRIES];
+static unsigned long cache_clock;
+static upip_meta_cache_stats_t cache_stats;
+static const cJSON *lock_packages;     //borrowed from the install that pinned them
+
+static const cJSON *locked_entry(const char *package, const char *version) {
+    const cJSON *entry = NULL;
+    cJSON_ArrayForEach(entry, lock_packages) {
+        if (strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(entry, "name")), package) == 0 &&
+            strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(entry, "version")), version) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+//returns 0 if name@version does not fit in a key, such entries bypass the cache
+static int make_key(char *key, const char *package, const char *version) {
+    int len = snprintf(key, META_CACHE_KEY_SIZE, "%s@%s", package, version);
+    return len > 0 && len < META_CACHE_KEY_SIZE;
+}
+
+static void make_path(char *path, size_t len, const char *key) {
+    snprintf(path, len, "%s/%s.json", META_CACHE_DIR_PATH, key);
+}
+
+static meta_cache_entry_t *lookup(const char *key) {
+    for (int i = 0; i < UPIP_META_CACHE_ENTRIES; i++) {
+        if (cache[i].meta && strcmp(cache[i].key, key) == 0) {
+            cache[i].last_used = ++cache_clock;
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+//takes ownership of meta and returns the cached tree, evicts the least recently used entry when full
+static cJSON *insert(const char *key, cJSON *meta) {
+    meta_cache_entry_t *slot = lookup(key);
+    if (slot) {
+        cJSON_Delete(slot->meta);
+    } else {
+        slot = &cache[0];
+        for (int i = 0; i < UPIP_META_CACHE_ENTRIES; i++) {
+            if (!cache[i].meta) {
+                slot = &cache[i];
+                break;
+            }
+            if (cache[i].last_used < slot->last_used) slot = &cache[i];
+        }
+        if (slot->meta) {
+            cJSON_Delete(slot->meta);
+            cache_stats.evictions++;
+        }
+        strcpy(slot->key, key);
+    }
+    slot->meta = cjson_arena_export(meta); //entries outlive the call
+    slot->last_used = ++cache_clock;
+    return slot->meta;
+}
+
+cJSON *meta_cache_get(FATFS *fs, const char *package, const char *version) {
+    char key[META_CACHE_KEY_SIZE];
+    cJSON *meta = NULL;
+
+    const cJSON *locked = locked_entry(package, version);
+    if (locked) {
+        cache_stats.hits++;
+        return cJSON_Duplicate(locked, 1);
+    }
+
+    if (!make_key(key, package, version)) {
+        cache_stats.misses++;
+        return repo_get_metadata(package, version);
+    }
+
+    meta_cache_entry_t *entry = lookup(key);
+    if (entry) {
+        cache_stats.hits++;
+        return cJSON_Duplicate(entry->meta, 1);
+    }
+
+#if UPIP_META_CACHE_PERSIST
+    char path[128];
+    make_path(path, sizeof(path), key);
+    if (fs && __f_load_file_to_json(fs, path, &meta) == FR_OK && meta) {
+        cache_stats.disk_hits++;
+        meta = insert(key, meta);
+        return cJSON_Duplicate(meta, 1);
+    }
+#endif
+
+    cache_stats.misses++;
+    meta = repo_get_metadata(package, version);
+    if (!meta) return NULL;
+
+    meta = insert(key, meta);
+    return cJSON_Duplicate(meta, 1);
+}
+
+//RAM only, without touching the recency of the entry
+bool meta_cache_has(const char *package, const char *version) {
+    char key[META_CACHE_KEY_SIZE];
+    if (locked_entry(package, version)) return true;
+    if (!make_key(key, package, version)) return false;
+    for (int i = 0; i < UPIP_META_CACHE_ENTRIES; i++) {
+        if (cache[i].meta && strcmp(cache[i].key, key) == 0) return true;
+    }
+    return false;
+}
+
+//RAM or FAT volume but never the server, NULL when neither holds the entry
+cJSON *meta_cache_peek(FATFS *fs, const char *package, const char *version) {
+    char key[META_CACHE_KEY_SIZE];
+    const cJSON *locked = locked_entry(package, version);
+    if (locked) return cJSON_Duplicate(locked, 1);
+    if (!make_key(key, package, version)) return NULL;
+
+    meta_cache_entry_t *entry = lookup(key);
+    if (entry) return cJSON_Duplicate(entry->meta, 1);
+
+#if UPIP_META_CACHE_PERSIST
+    char path[128];
+    cJSON *meta = NULL;
+    make_path(path, sizeof(path), key);
+    if (fs && __f_load_file_to_json(fs, path, &meta) == FR_OK && meta) return meta;
+#else
+    (void)fs;
+#endif
+    return NULL;
+}
+
+void meta_cache_put(const char *package, const char *version, const cJSON *meta) {
+    char key[META_CACHE_KEY_SIZE];
+    if (!meta || !make_key(key, package, version)) return;
+    insert(key, cJSON_Duplicate(meta, 1));
+}
+
+FRESULT meta_cache_persist(FATFS *fs, const char *package, const char *version) {
+#if UPIP_META_CACHE_PERSIST
+    char key[META_CACHE_KEY_SIZE];
+    char path[128];
+    if (!make_key(key, package, version)) return FR_INVALID_NAME;
+
+    cJSON *meta = meta_cache_get(fs, package, version);
+    if (!meta) return FR_NO_FILE;
+
+    FRESULT res = f_mkdir(fs, META_CACHE_DIR_PATH);
+    if (res == FR_OK || res == FR_EXIST) {
+        make_path(path, sizeof(path), key);
+        res = __f_save_json_to_file(fs, path, &meta);
+    }
+    cJSON_Delete(meta);
+    return res;
+#else
+    (void)fs; (void)package; (void)version;
+    return FR_OK;
+#endif
+}
+
+//entries in the form RESOLVE_BATCH returns them, NULL ends it. the caller keeps them alive until then
+void meta_cache_use_lock(const cJSON *packages) {
+    lock_packages = packages;
+}
+
+void meta_cache_forget(FATFS *fs, const char *package, const char *version) {
+    char key[META_CACHE_KEY_SIZE];
+    if (!make_key(key, package, version)) return;
+
+#if UPIP_META_CACHE_PERSIST
+    char path[128];
+    make_path(path, sizeof(path), key);
+    f_unlink(fs, path);
+#else
+    (void)fs;
+#endif
+}
+
+/**
+ * public apis
+ */
+void upip_meta_cache_get_stats(upip_meta_cache_stats_t *out) {
+    if (!out) return;
+    *out = cache_stats;
+    out->entries = 0;
+    for (int i = 0; i < UPIP_META_CACHE_ENTRIES; i++) {
+        if (cache[i].meta) out->entries++;
+    }
+}
+
+void upip_meta_cache_reset_stats(void) {
+    memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
+void upip_meta_cache_clear(void) {
+    mutex_take();
+    for (int i = 0; i < UPIP_META_CACHE_ENTRIES; i++) {
+        if (cache[i].meta) cJSON_Delete(cache[i].meta);
+        cache[i].meta = NULL;
+    }
+    mutex_give();
+}
@@ -0,0 +1,551 @@
+//Installed package database: fixed size records in an on-disk hash table, one record read per probe
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+#include "lib/oofatfs/ff.h"
+
+#define PKGDB_MAGIC             "UPDB"
+#define PKGDB_FORMAT            1
+#define PKGDB_TMP_PATH          INSTALLED_PKGS_BIN_DB_PATH ".tmp"
+
+enum { SLOT_EMPTY = 0, SLOT_USED = 1, SLOT_DELETED = 2 };
+
+typedef struct {
+    char magic[4];      //written last when building a file, a zeroed magic marks an incomplete file
+    uint16_t format;
+    uint16_t record_size;
+    uint32_t slots;     //power of two
+    uint32_t used;      //used and deleted records, drives the rehash
+    uint32_t generation; //bumped by every write, a session compares it to spot changes made elsewhere
+} pkgdb_header_t;
+
+typedef struct {
+    char state;
+    char name[PKGDB_NAME_SIZE];
+    char version[PKGDB_VERSION_SIZE];
+} pkgdb_record_t;
+
+static FRESULT seek_record(FIL *file, uint32_t slot) {
+    return f_lseek(file, sizeof(pkgdb_header_t) + (FSIZE_t)slot * sizeof(pkgdb_record_t));
+}
+
+static FRESULT read_record(FIL *file, uint32_t slot, pkgdb_record_t *rec) {
+    FRESULT res;
+    UINT br;
+    FTRY(seek_record(file, slot));
+    FTRY(f_read(file, rec, sizeof(*rec), &br));
+    if (br != sizeof(*rec)) res = FR_INT_ERR;
+cleanup:
+    return res;
+}
+
+static FRESULT write_record(FIL *file, uint32_t slot, const pkgdb_record_t *rec) {
+    FRESULT res;
+    UINT bw;
+    FTRY(seek_record(file, slot));
+    FTRY(f_write(file, rec, sizeof(*rec), &bw));
+    if (bw != sizeof(*rec)) res = FR_DENIED;
+cleanup:
+    return res;
+}
+
+static FRESULT write_header(FIL *file, const pkgdb_header_t *hdr) {
+    FRESULT res;
+    UINT bw;
+    FTRY(f_lseek(file, 0));
+    FTRY(f_write(file, hdr, sizeof(*hdr), &bw));
+    if (bw != sizeof(*hdr)) res = FR_DENIED;
+cleanup:
+    return res;
+}
+
+static FRESULT read_header(FIL *file, pkgdb_header_t *hdr) {
+    FRESULT res;
+    UINT br;
+    FTRY(f_lseek(file, 0));
+    FTRY(f_read(file, hdr, sizeof(*hdr), &br));
+    if (br != sizeof(*hdr) || memcmp(hdr->magic, PKGDB_MAGIC, 4) != 0 ||
+        hdr->format != PKGDB_FORMAT || hdr->record_size != sizeof(pkgdb_record_t) ||
+        hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) != 0) {
+        res = FR_NO_FILESYSTEM;
+    }
+cleanup:
+    return res;
+}
+
+/**
+ * linear probing from the hash of name. on a hit *found is set and *slot_out is the record,
+ * otherwise *slot_out is where name would be inserted (first deleted slot seen, else the empty one)
+ * and rec->state tells which of the two it is
+ */
+static FRESULT find_slot(FIL *file, const pkgdb_header_t *hdr, const char *name, uint32_t *slot_out, pkgdb_record_t *rec, bool *found) {
+    FRESULT res = FR_OK;
+    uint32_t mask = hdr->slots - 1;
+    uint32_t slot = upip_hash_str(name) & mask;
+    uint32_t insert_at = UINT32_MAX;
+    char insert_state = SLOT_EMPTY;
+    *found = false;
+
+    for (uint32_t probes = 0; probes < hdr->slots; probes++, slot = (slot + 1) & mask) {
+        FTRY(read_record(file, slot, rec));
+        if (rec->state == SLOT_EMPTY) {
+            if (insert_at == UINT32_MAX) insert_at = slot;
+            break;
+        }
+        if (rec->state == SLOT_DELETED) {
+            if (insert_at == UINT32_MAX) {
+                insert_at = slot;
+                insert_state = SLOT_DELETED;
+            }
+            continue;
+        }
+        if (strncmp(rec->name, name, PKGDB_NAME_SIZE) == 0) {
+            *found = true;
+            insert_at = slot;
+            break;
+        }
+    }
+
+    *slot_out = insert_at;
+    if (!*found) rec->state = insert_state;
+    if (insert_at == UINT32_MAX) res = FR_DENIED; //table full, callers grow before that happens
+cleanup:
+    return res;
+}
+
+static bool fill_record(pkgdb_record_t *rec, const char *name, const char *version) {
+    if (strlen(name) >= PKGDB_NAME_SIZE || strlen(version) >= PKGDB_VERSION_SIZE) return false;
+    memset(rec, 0, sizeof(*rec));
+    rec->state = SLOT_USED;
+    strcpy(rec->name, name);
+    strcpy(rec->version, version);
+    return true;
+}
+
+//insert into a file that is being built, no duplicates or deleted slots there
+static FRESULT build_insert(FIL *file, pkgdb_header_t *hdr, const pkgdb_record_t *rec) {
+    FRESULT res;
+    pkgdb_record_t probe;
+    uint32_t slot;
+    bool found;
+    FTRY(find_slot(file, hdr, rec->name, &slot, &probe, &found));
+    FTRY(write_record(file, slot, rec));
+    if (!found) hdr->used++;
+cleanup:
+    return res;
+}
+
+static uint32_t slots_for(uint32_t count) {
+    uint32_t slots = UPIP_PKGDB_MIN_SLOTS;
+    while (slots * 3 < (count + 1) * 4) slots *= 2; //keep the load factor under 3/4
+    return slots;
+}
+
+/**
+ * builds a new database at PKGDB_TMP_PATH holding every used record of src (an open pkgs.db) or
+ * of json_src (the legacy pkgs.json object). only one record is held in RAM. deleted records
+ * are dropped on the way and the generation goes on from src. a json_src entry that does not fit
+ * a record fails the build with FR_INVALID_NAME, a package is never left out
+ */
+static FRESULT rebuild(FATFS *fs, FIL *src, const pkgdb_header_t *src_hdr, const cJSON *json_src, uint32_t slots) {
+    FRESULT res;
+    FIL file = {0};
+    pkgdb_header_t hdr = {{0}, PKGDB_FORMAT, sizeof(pkgdb_record_t), slots, 0, src_hdr ? src_hdr->generation + 1 : 0};
+    pkgdb_record_t rec = {0};
+    bool opened = false;
+
+    FTRY(f_open(fs, &file, PKGDB_TMP_PATH, FA_READ | FA_WRITE | FA_CREATE_ALWAYS));
+    opened = true;
+    FTRY(write_header(&file, &hdr));
+    for (uint32_t i = 0; i < slots; i++) {
+        FTRY(write_record(&file, i, &rec));
+    }
+
+    if (src) {
+        for (uint32_t i = 0; i < src_hdr->slots; i++) {
+            FTRY(read_record(src, i, &rec));
+            if (rec.state != SLOT_USED) continue;
+            FTRY(build_insert(&file, &hdr, &rec));
+        }
+    }
+
+    const cJSON *item = NULL;
+    cJSON_ArrayForEach(item, json_src) {
+        if (!cJSON_IsString(item)) continue;
+        if (!fill_record(&rec, item->string, item->valuestring)) {
+            fprintf(stderr, "Cannot migrate %s@%s: name or version too long, pkgs.json is kept\n", item->string, item->valuestring);
+            res = FR_INVALID_NAME;
+            goto cleanup;
+        }
+        FTRY(build_insert(&file, &hdr, &rec));
+    }
+
+    memcpy(hdr.magic, PKGDB_MAGIC, 4);
+    FTRY(write_header(&file, &hdr));
+    FTRY(f_sync(&file));
+
+cleanup:
+    if (opened) f_close(&file);
+    return res;
+}
+
+//replaces pkgs.db with a completed rebuild, pkgs.db must not be open
+static FRESULT swap_in(FATFS *fs) {
+    FRESULT res = f_unlink(fs, INSTALLED_PKGS_BIN_DB_PATH);
+    if (res != FR_OK && res != FR_NO_FILE) return res;
+    return f_rename(fs, PKGDB_TMP_PATH, INSTALLED_PKGS_BIN_DB_PATH);
+}
+
+/**
+ * makes sure pkgs.db exists: finishes an interrupted swap, or migrates pkgs.json once,
+ * or creates an empty database
+ */
+static FRESULT ensure_db(FATFS *fs) {
+    FRESULT res;
+    FILINFO fno;
+    FIL tmp = {0};
+    pkgdb_header_t hdr;
+    cJSON *legacy = NULL;
+
+    if (f_stat(fs, INSTALLED_PKGS_BIN_DB_PATH, &fno) == FR_OK) return FR_OK;
+
+    //a complete tmp file means we lost power between unlink and rename
+    if (f_open(fs, &tmp, PKGDB_TMP_PATH, FA_READ) == FR_OK) {
+        res = read_header(&tmp, &hdr);
+        f_close(&tmp);
+        if (res == FR_OK) return swap_in(fs);
+    }
+
+    if (__f_load_file_to_json(fs, INSTALLED_PKGS_DB_PATH, &legacy) == FR_OK && legacy) {
+        //pkgs.json goes only once every package it lists is in pkgs.db
+        res = rebuild(fs, NULL, NULL, legacy, slots_for(cJSON_GetArraySize(legacy)));
+        if (res != FR_OK) {
+            f_unlink(fs, PKGDB_TMP_PATH);
+            goto cleanup;
+        }
+        FTRY(swap_in(fs));
+        f_unlink(fs, INSTALLED_PKGS_DB_PATH);
+    } else {
+        FTRY(rebuild(fs, NULL, NULL, NULL, UPIP_PKGDB_MIN_SLOTS));
+        FTRY(swap_in(fs));
+    }
+
+cleanup:
+    if(legacy) cJSON_Delete(legacy);
+    return res;
+}
+
+static FRESULT open_db(FATFS *fs, FIL *file, pkgdb_header_t *hdr, BYTE mode) {
+    FRESULT res;
+    FTRY(ensure_db(fs));
+    FTRY(f_open(fs, file, INSTALLED_PKGS_BIN_DB_PATH, mode));
+    res = read_header(file, hdr);
+    if (res != FR_OK) f_close(file);
+cleanup:
+    return res;
+}
+
+static FRESULT disk_lookup(FATFS *fs, const char *name, char *version_out, size_t len) {
+    FRESULT res;
+    FIL file = {0};
+    pkgdb_header_t hdr;
+    pkgdb_record_t rec;
+    uint32_t slot;
+    bool found = false;
+
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_NO_FILE;
+    FTRY(open_db(fs, &file, &hdr, FA_READ));
+    res = find_slot(&file, &hdr, name, &slot, &rec, &found);
+    f_close(&file);
+    if (res == FR_DENIED) res = FR_OK; //full table without a hit
+    if (res != FR_OK) goto cleanup;
+
+    if (!found) {
+        res = FR_NO_FILE;
+    } else if (version_out && len > 0) {
+        rec.version[PKGDB_VERSION_SIZE - 1] = '\0';
+        snprintf(version_out, len, "%s", rec.version);
+    }
+cleanup:
+    return res;
+}
+
+static FRESULT disk_set(FATFS *fs, const char *name, const char *version) {
+    FRESULT res;
+    FIL file = {0};
+    pkgdb_header_t hdr;
+    pkgdb_record_t rec, probe;
+    uint32_t slot;
+    bool found, opened = false;
+
+    if (!fill_record(&rec, name, version)) return FR_INVALID_NAME;
+
+    FTRY(open_db(fs, &file, &hdr, FA_READ | FA_WRITE));
+    opened = true;
+    FTRY(find_slot(&file, &hdr, name, &slot, &probe, &found));
+
+    if (!found && probe.state == SLOT_EMPTY && (hdr.used + 1) * 4 > hdr.slots * 3) {
+        FTRY(rebuild(fs, &file, &hdr, NULL, slots_for(hdr.used + 1)));
+        f_close(&file);
+        opened = false;
+        FTRY(swap_in(fs));
+        FTRY(open_db(fs, &file, &hdr, FA_READ | FA_WRITE));
+        opened = true;
+        FTRY(find_slot(&file, &hdr, name, &slot, &probe, &found));
+    }
+
+    FTRY(write_record(&file, slot, &rec));
+    if (!found && probe.state == SLOT_EMPTY) hdr.used++;
+    hdr.generation++;
+    FTRY(write_header(&file, &hdr));
+    FTRY(f_sync(&file));
+
+cleanup:
+    if (opened) f_close(&file);
+    return res;
+}
+
+static FRESULT disk_remove(FATFS *fs, const char *name) {
+    FRESULT res;
+    FIL file = {0};
+    pkgdb_header_t hdr;
+    pkgdb_record_t rec;
+    uint32_t slot;
+    bool found = false, opened = false;
+
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_OK;
+    FTRY(open_db(fs, &file, &hdr, FA_READ | FA_WRITE));
+    opened = true;
+    res = find_slot(&file, &hdr, name, &slot, &rec, &found);
+    if (!found) {
+        res = FR_OK;
+        goto cleanup;
+    }
+
+    rec.state = SLOT_DELETED;
+    FTRY(write_record(&file, slot, &rec));
+    hdr.generation++;
+    FTRY(write_header(&file, &hdr));
+    FTRY(f_sync(&file));
+
+cleanup:
+    if (opened) f_close(&file);
+    return res;
+}
+
+/**
+ * resident mode: the records of one volume held in RAM for a session, keyed by name. a removal
+ * keeps its entry as SLOT_DELETED until it is written back, so entries are never taken out
+ */
+typedef struct {
+    pkgdb_record_t rec;
+    bool dirty;         //not written back to pkgs.db yet
+} resident_entry_t;
+
+typedef struct {
+    resident_entry_t *entries;
+    uint32_t mask;      //slot count - 1, the slot count is a power of two
+    uint32_t used;
+    uint32_t dirty;
+} resident_table_t;
+
+static struct {
+    FATFS *fs;          //NULL while detached
+    resident_table_t table;
+    uint32_t generation; //of pkgs.db when it was read or last written, anything else is a change made elsewhere
+} resident;
+
+static resident_entry_t *table_slot(const resident_table_t *t, const char *name) {
+    uint32_t i = upip_hash_str(name) & t->mask;
+    while (t->entries[i].rec.state != SLOT_EMPTY && strncmp(t->entries[i].rec.name, name, PKGDB_NAME_SIZE) != 0) {
+        i = (i + 1) & t->mask;
+    }
+    return &t->entries[i];
+}
+
+static FRESULT table_init(resident_table_t *t, uint32_t slots) {
+    memset(t, 0, sizeof(*t));
+    t->entries = calloc(slots, sizeof(resident_entry_t));
+    if (!t->entries) return FR_NOT_ENOUGH_CORE;
+    t->mask = slots - 1;
+    return FR_OK;
+}
+
+static void table_free(resident_table_t *t) {
+    if (t->entries) free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+static FRESULT table_grow(resident_table_t *t) {
+    resident_table_t grown;
+    if (table_init(&grown, (t->mask + 1) * 2) != FR_OK) return FR_NOT_ENOUGH_CORE;
+    for (uint32_t i = 0; i <= t->mask; i++) {
+        if (t->entries[i].rec.state != SLOT_EMPTY) *table_slot(&grown, t->entries[i].rec.name) = t->entries[i];
+    }
+    grown.used = t->used;
+    grown.dirty = t->dirty;
+    table_free(t);
+    *t = grown;
+    return FR_OK;
+}
+
+//inserts or replaces the entry of rec->name, the table doubles at 3/4 load like the file does
+static FRESULT table_put(resident_table_t *t, const pkgdb_record_t *rec, bool dirty) {
+    resident_entry_t *entry = table_slot(t, rec->name);
+    if (entry->rec.state == SLOT_EMPTY) {
+        if ((t->used + 1) * 4 > (t->mask + 1) * 3) {
+            if (table_grow(t) != FR_OK) return FR_NOT_ENOUGH_CORE;
+            entry = table_slot(t, rec->name);
+        }
+        t->used++;
+    }
+    if (entry->dirty != dirty) {
+        if (dirty) t->dirty++;
+        else t->dirty--;
+    }
+    entry->rec = *rec;
+    entry->dirty = dirty;
+    return FR_OK;
+}
+
+//reads every record of pkgs.db into a new table, the changes not written back yet are laid over it
+static FRESULT resident_load(FATFS *fs) {
+    FRESULT res;
+    FIL file = {0};
+    pkgdb_header_t hdr;
+    pkgdb_record_t rec;
+    resident_table_t loaded = {0};
+    bool opened = false;
+
+    FTRY(open_db(fs, &file, &hdr, FA_READ));
+    opened = true;
+    FTRY(table_init(&loaded, slots_for(hdr.used + resident.table.dirty)));
+    for (uint32_t i = 0; i < hdr.slots; i++) {
+        FTRY(read_record(&file, i, &rec));
+        if (rec.state != SLOT_USED) continue;
+        rec.name[PKGDB_NAME_SIZE - 1] = '\0';
+        rec.version[PKGDB_VERSION_SIZE - 1] = '\0';
+        FTRY(table_put(&loaded, &rec, false));
+    }
+    for (uint32_t i = 0; resident.table.entries && i <= resident.table.mask; i++) {
+        if (resident.table.entries[i].dirty) FTRY(table_put(&loaded, &resident.table.entries[i].rec, true));
+    }
+
+    resident.generation = hdr.generation;
+    table_free(&resident.table);
+    resident.table = loaded;
+    loaded.entries = NULL;
+
+cleanup:
+    if (opened) f_close(&file);
+    table_free(&loaded);
+    return res;
+}
+
+static FRESULT read_generation(FATFS *fs, uint32_t *generation) {
+    FRESULT res;
+    FIL file = {0};
+    pkgdb_header_t hdr;
+    FTRY(f_open(fs, &file, INSTALLED_PKGS_BIN_DB_PATH, FA_READ));
+    res = read_header(&file, &hdr);
+    f_close(&file);
+    if (res == FR_OK) *generation = hdr.generation;
+cleanup:
+    return res;
+}
+
+//reloads after a change from outside the session, one header read when there is none
+static FRESULT resident_refresh(void) {
+    uint32_t generation;
+    if (read_generation(resident.fs, &generation) == FR_OK && generation == resident.generation) return FR_OK;
+    return resident_load(resident.fs);
+}
+
+static bool resident_on(FATFS *fs) {
+    return resident.fs && resident.fs == fs;
+}
+
+/**
+ * internal apis
+ */
+FRESULT pkgdb_lookup(FATFS *fs, const char *name, char *version_out, size_t len) {
+    FRESULT res;
+    if (!resident_on(fs)) return disk_lookup(fs, name, version_out, len);
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_NO_FILE;
+
+    FTRY(resident_refresh());
+    resident_entry_t *entry = table_slot(&resident.table, name);
+    if (entry->rec.state != SLOT_USED) {
+        res = FR_NO_FILE;
+    } else if (version_out && len > 0) {
+        snprintf(version_out, len, "%s", entry->rec.version);
+    }
+cleanup:
+    return res;
+}
+
+FRESULT pkgdb_set(FATFS *fs, const char *name, const char *version) {
+    FRESULT res;
+    pkgdb_record_t rec;
+    if (!resident_on(fs)) return disk_set(fs, name, version);
+    if (!fill_record(&rec, name, version)) return FR_INVALID_NAME;
+
+    FTRY(resident_refresh());
+    res = table_put(&resident.table, &rec, true);
+cleanup:
+    return res;
+}
+
+FRESULT pkgdb_remove(FATFS *fs, const char *name) {
+    FRESULT res;
+    if (!resident_on(fs)) return disk_remove(fs, name);
+    if (strlen(name) >= PKGDB_NAME_SIZE) return FR_OK;
+
+    FTRY(resident_refresh());
+    resident_entry_t *entry = table_slot(&resident.table, name);
+    if (entry->rec.state == SLOT_USED) {
+        pkgdb_record_t rec = entry->rec;
+        rec.state = SLOT_DELETED;
+        res = table_put(&resident.table, &rec, true);
+    }
+cleanup:
+    return res;
+}
+
+FRESULT pkgdb_attach(FATFS *fs) {
+    if (resident.fs) return FR_LOCKED;
+    FRESULT res = resident_load(fs);
+    if (res == FR_OK) resident.fs = fs;
+    return res;
+}
+
+FRESULT pkgdb_sync(FATFS *fs) {
+    FRESULT res = FR_OK;
+    if (!resident_on(fs) || resident.table.dirty == 0) return FR_OK;
+
+    //picked up first, the generation taken below would hide it
+    FTRY(resident_refresh());
+    for (uint32_t i = 0; i <= resident.table.mask; i++) {
+        resident_entry_t *entry = &resident.table.entries[i];
+        if (!entry->dirty) continue;
+        res = entry->rec.state == SLOT_USED ? disk_set(fs, entry->rec.name, entry->rec.version) : disk_remove(fs, entry->rec.name);
+        if (res != FR_OK) goto cleanup;
+        entry->dirty = false;
+        resident.table.dirty--;
+    }
+    FTRY(read_generation(fs, &resident.generation));
+cleanup:
+    return res;
+}
+
+void pkgdb_detach(void) {
+    table_free(&resident.table);
+    memset(&resident, 0, sizeof(resident));
+}
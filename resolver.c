@@ -1,27 +1,41 @@
-//Greedy + Version Preference Resolver
+//Greedy + Version Preference Resolver, with a backtracking search behind it for conflicts
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <string.h>
 #include "cJSON.h"
 
 #include "upip.h"
+#include "upip_internal.h"
 
-//semver struct internal data structure
+#define RESOLVE_CONFLICT    -2  //the greedy choice ran into a version conflict, the backtracking search may find one
+#define RESOLVE_SLICES_IN_FLIGHT    4   //RESOLVE_BATCH requests of one level on the link at once
+#define JOINED_CONSTRAINT_SIZE  (UPIP_SEMVER_MAX_INTERVALS * (2 * PKGDB_VERSION_SIZE + 8))  //a formatted range
+
+//resolvedmap struct internal data structure. open addressing hash table (linear probing)
+//whose strings live in a bump arena, slots and arena share one block that is either
+//supplied by the caller or allocated once and released in free_resolved
 typedef struct {
-    int major;
-    int minor;
-    int patch;
-} semver_t;
+    const char *name;   //NULL marks an empty slot
+    const char *version;
+    cJSON *deps;        //dependency list reported by the server, NULL for installed packages
+    unsigned char emitted;
+} resolved_entry_t;
 
-//resolvedmap struct internal data structure
 typedef struct {
-    char **names;
-    char **versions;
+    resolved_entry_t *slots;
+    unsigned int mask;  //slot count - 1, the slot count is a power of two
     int count;
+    int capacity;       //max entries, keeps the load factor at or below 1/2
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+    void *heap;         //block to release, NULL when the caller supplied it
+    const char *upgrade;    //package resolved as if it was not installed, NULL for a plain resolve
 } ResolvedMap;
 
+#if !UPIP_BATCHED_RESOLVE
 static char *repo_resolve_version(const char *package, const char *constraint){
 
     cJSON *root = cJSON_CreateObject();
@@ -29,19 +43,24 @@ static char *repo_resolve_version(const char *package, const char *constraint){
     cJSON_AddStringToObject(root, "package", package);
     cJSON_AddStringToObject(root, "constraint", constraint);
 
-    char *response = upip_client_request_await_response(root, MEDIUM_TIMEOUT);
+    uint32_t started = stats_phase_begin(UPIP_PHASE_RESOLVE);
+    char *response = transport_request(root, MEDIUM_TIMEOUT);
+    stats_phase_end(UPIP_PHASE_RESOLVE, started, response != NULL);
     cJSON_Delete(root);
     return response;
 }
+#endif
 
-static cJSON *repo_get_metadata(const char *package, const char *version){
+cJSON *repo_get_metadata(const char *package, const char *version){
     cJSON *root = cJSON_CreateObject();
     cJSON_AddStringToObject(root, "method", "GET_META");
     cJSON_AddStringToObject(root, "package", package);
     cJSON_AddStringToObject(root, "constraint", version);
 
-    char *response = upip_client_request_await_response(root, MEDIUM_TIMEOUT);
+    uint32_t started = stats_phase_begin(UPIP_PHASE_METADATA);
+    char *response = transport_request(root, MEDIUM_TIMEOUT);
     cJSON *response_json = cJSON_Parse(response);
+    stats_phase_end(UPIP_PHASE_METADATA, started, response_json != NULL);
     
     cJSON_Delete(root);
     if(response) free(response);
@@ -50,118 +69,162 @@ static cJSON *repo_get_metadata(const char *package, const char *version){
 }
 
 
-static int parse_version(const char *version_str, semver_t *out) {
-    if (!version_str || strcmp(version_str, "*") == 0) {
-        out->major = out->minor = out->patch = 0;
-        return 1; // valid wildcard
-    }
-
-    return sscanf(version_str, "%d.%d.%d", &out->major, &out->minor, &out->patch) == 3;
-}
+/**
+ * RESOLVE_BATCH takes every pending (name, constraint) pair of one level of the
+ * dependency tree and answers them in a single round trip:
+ *   request:  {"method":"RESOLVE_BATCH","packages":[{"name":..,"constraint":..},..]}
+ *   response: {"success":true,"result":[{"name":..,"version":..,"dependencies":[..],..},..]}
+ * each result entry carries the same fields as a GET_META reply plus name and version.
+ * repo_send_batch takes packages over and returns the request id, -1 when it could not be sent.
+ * repo_batch_result waits for the reply, the returned result array must be freed by the caller
+ */
+static int repo_send_batch(cJSON *packages){
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "method", "RESOLVE_BATCH");
+    cJSON_AddItemToObject(root, "packages", packages);
 
-static int compare_versions(const semver_t *a, const semver_t *b) {
-    if (a->major != b->major) return a->major - b->major;
-    if (a->minor != b->minor) return a->minor - b->minor;
-    return a->patch - b->patch;
+    int id = transport_send(root, NULL, 0);
+    cJSON_Delete(root);
+    return id;
 }
 
-static int semver_parser(const char *version_str, const char *constraint) {
-    if (!constraint || !version_str) return 0;
-    if (strcmp(constraint, "*") == 0) return 1;
-
-    semver_t version, target;
-    if (!parse_version(version_str, &version)) return 0;
+static cJSON *repo_batch_result(int id){
+    cJSON *result = NULL;
+    char *response = NULL;
 
-    const char *op = constraint;
-    const char *ver = NULL;
+    uint32_t started = stats_phase_begin(UPIP_PHASE_RESOLVE);
+    if (id > 0 && transport_wait(id, MEDIUM_TIMEOUT, (uint8_t **)&response) <= 0 && response) {
+        free(response); //empty
+        response = NULL;
+    }
+    cJSON *response_json = cJSON_Parse(response);
+    if(response) free(response);
 
-    if (strncmp(op, ">=", 2) == 0) {
-        ver = op + 2;
-        if (!parse_version(ver, &target)) return 0;
-        return compare_versions(&version, &target) >= 0;
-    } else if (strncmp(op, "<=", 2) == 0) {
-        ver = op + 2;
-        if (!parse_version(ver, &target)) return 0;
-        return compare_versions(&version, &target) <= 0;
-    } else if (strncmp(op, "==", 2) == 0) {
-        ver = op + 2;
-        if (strcmp(ver, "*") == 0) return 1;
-        if (!parse_version(ver, &target)) return 0;
-        return compare_versions(&version, &target) == 0;
-    } else if (op[0] == '>' && isdigit(op[1])) {
-        ver = op + 1;
-        if (!parse_version(ver, &target)) return 0;
-        return compare_versions(&version, &target) > 0;
-    } else if (op[0] == '<' && isdigit(op[1])) {
-        ver = op + 1;
-        if (!parse_version(ver, &target)) return 0;
-        return compare_versions(&version, &target) < 0;
+    if (response_json && cJSON_IsTrue(cJSON_GetObjectItem(response_json, "success"))) {
+        result = cJSON_DetachItemFromObject(response_json, "result");
+    } else if (response_json) {
+        fprintf(stderr, "Server error: %s\n", cJSON_GetStringValue(cJSON_GetObjectItem(response_json, "message")));
     }
 
-    return 0; // invalid constraint
+    cJSON_Delete(response_json);
+    if (result && !cJSON_IsArray(result)) {
+        cJSON_Delete(result);
+        result = NULL;
+    }
+    stats_phase_end(UPIP_PHASE_RESOLVE, started, result != NULL);
+    return result;
 }
 
-static int satisfies_constraint(const char *version_str, const char *constraint_str) {
-    if (!constraint_str || !version_str) return 0;
+//the block is split the way UPIP_RESOLVE_SCRATCH_SIZE sizes it, slots first and the rest to the
+//string arena, so a block sized for n packages holds n. buf must be pointer aligned
+static int init_resolved(ResolvedMap *map, void *buf, size_t size) {
+    memset(map, 0, sizeof(*map));
+    if (!buf) {
+        buf = map->heap = malloc(size);
+        if (!buf) return -1;
+    }
 
-    char constraint_copy[64];
-    strncpy(constraint_copy, constraint_str, sizeof(constraint_copy) - 1);
-    constraint_copy[sizeof(constraint_copy) - 1] = '\0';
+    size_t slot_bytes = size / UPIP_RESOLVE_SCRATCH_SIZE(1) * (4 * 4 * sizeof(void *));
+    unsigned int slot_count = 1;
+    while (slot_count * 2 * sizeof(resolved_entry_t) <= slot_bytes) slot_count *= 2;
+    if (slot_count < 2) {
+        free(map->heap);
+        map->heap = NULL;
+        return -1;
+    }
 
-    char *token = strtok(constraint_copy, ",");
-    while (token) {
-        while (isspace((unsigned char)*token)) token++; // trim left
+    map->slots = buf;
+    map->mask = slot_count - 1;
+    map->capacity = slot_count / 2;
+    map->arena = (char *)buf + slot_count * sizeof(resolved_entry_t);
+    map->arena_size = size - slot_count * sizeof(resolved_entry_t);
+    memset(map->slots, 0, slot_count * sizeof(resolved_entry_t));
+    return 0;
+}
 
-        if (!semver_parser(version_str, token)) {
-            return 0; // one failure is enough
-        }
+//a map on the heap is sized by UPIP_RESOLVE_MAX_PACKAGES, one in scratch by the caller
+static void report_out_of_space(const ResolvedMap *map, const char *name) {
+    if (map->heap) fprintf(stderr, "Resolver out of space at %s, raise UPIP_RESOLVE_MAX_PACKAGES\n", name);
+    else fprintf(stderr, "Resolver out of space at %s: scratch too small (see UPIP_RESOLVE_SCRATCH_SIZE)\n", name);
+}
 
-        token = strtok(NULL, ",");
-    }
+static const char *arena_strdup(ResolvedMap *map, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (map->arena_used + len > map->arena_size) return NULL;
 
-    return 1; // all constraints passed
+    char *dst = map->arena + map->arena_used;
+    memcpy(dst, str, len);
+    map->arena_used += len;
+    return dst;
 }
 
-
+//returns the slot of name or -1
 static int is_resolved(ResolvedMap *map, const char *name) {
-    for (int i = 0; i < map->count; i++) {
-        if (strcmp(map->names[i], name) == 0) return i;
+    unsigned int i = upip_hash_str(name) & map->mask;
+    while (map->slots[i].name) {
+        if (strcmp(map->slots[i].name, name) == 0) return (int)i;
+        i = (i + 1) & map->mask;
     }
     return -1;
 }
 
-static void add_resolved(ResolvedMap *map, const char *name, const char *version) {
-    map->names = realloc(map->names, sizeof(char *) * (map->count + 1));
-    map->versions = realloc(map->versions, sizeof(char *) * (map->count + 1));
-    map->names[map->count] = strdup(name);
-    map->versions[map->count] = strdup(version);
+//takes ownership of deps, returns the new slot or -1 when the map or its arena is full
+static int add_resolved(ResolvedMap *map, const char *name, const char *version, cJSON *deps) {
+    size_t arena_mark = map->arena_used;
+    const char *name_copy = NULL;
+    const char *version_copy = NULL;
+
+    if (map->count < map->capacity) {
+        name_copy = arena_strdup(map, name);
+        version_copy = arena_strdup(map, version);
+    }
+    if (!name_copy || !version_copy) {
+        report_out_of_space(map, name);
+        map->arena_used = arena_mark;
+        if (deps) cJSON_Delete(deps);
+        return -1;
+    }
+
+    unsigned int i = upip_hash_str(name) & map->mask;
+    while (map->slots[i].name) i = (i + 1) & map->mask;
+
+    map->slots[i].name = name_copy;
+    map->slots[i].version = version_copy;
+    map->slots[i].deps = deps;
+    map->slots[i].emitted = 0;
     map->count++;
+    return (int)i;
+}
+
+static char *installed_version_of(FATFS *fs, ResolvedMap *map, const char *name) {
+    if (map->upgrade && (strcmp(map->upgrade, name) == 0 || strcmp(map->upgrade, RESOLVE_NOTHING_INSTALLED) == 0)) return NULL;
+    return get_installed_version(fs, name);
 }
 
 static void free_resolved(ResolvedMap *map) {
-    for (int i = 0; i < map->count; i++) {
-        free(map->names[i]);
-        free(map->versions[i]);
+    if (map->slots) {
+        for (unsigned int i = 0; i <= map->mask; i++) {
+            if (map->slots[i].name && map->slots[i].deps) cJSON_Delete(map->slots[i].deps);
+        }
     }
-    free(map->names);
-    free(map->versions);
+    if (map->heap) free(map->heap);
+    memset(map, 0, sizeof(*map));
 }
 
 
+#if !UPIP_BATCHED_RESOLVE
 // recursive resolver
-static int resolve_recursive(const char *name, const char *constraint, ResolvedMap *resolved, cJSON *install_order) {
+static int resolve_recursive(FATFS *fs, const char *name, const char *constraint, ResolvedMap *resolved, cJSON *install_order) {
     // 🔍 First check if it's already installed
-    if (is_installed(name)) {
-        const char *installed_version = get_installed_version(name);
-        if (!installed_version) {
-            fprintf(stderr, "Installed package %s has no recorded version.\n", name);
-            return -1;
-        }
-
-        if (satisfies_constraint(installed_version, constraint)) {
+    char *installed_version = installed_version_of(fs, resolved, name);
+    if (installed_version) {
+        if (semver_satisfies(installed_version, constraint)) {
             // Already installed and satisfies constraint
             if (is_resolved(resolved, name) < 0) {
-                add_resolved(resolved, name, installed_version);
+                if (add_resolved(resolved, name, installed_version, NULL) < 0) {
+                    free(installed_version);
+                    return -1;
+                }
 
                 // Append to install order (to ensure deps come first)
                 cJSON *pkg = cJSON_CreateObject();
@@ -169,13 +232,25 @@ static int resolve_recursive(const char *name, const char *constraint, ResolvedM
                 cJSON_AddStringToObject(pkg, "version", installed_version);
                 cJSON_AddItemToArray(install_order, pkg);
             }
+            free(installed_version);
             return 0;
         } else {
             fprintf(stderr, "Installed version %s of %s does not satisfy constraint %s\n", installed_version, name, constraint);
-            return -1;
+            free(installed_version);
+            return RESOLVE_CONFLICT;
         }
     }
 
+    //required before, by another package or another entry of the same request
+    int existing = is_resolved(resolved, name);
+    if (existing >= 0) {
+        if (!semver_satisfies(resolved->slots[existing].version, constraint)) {
+            fprintf(stderr, "Conflict: %s already resolved to %s, can't satisfy %s\n", name, resolved->slots[existing].version, constraint);
+            return RESOLVE_CONFLICT;
+        }
+        return 0;
+    }
+
     // Otherwise resolve from server
     char *version = repo_resolve_version(name, constraint);
     if (!version) {
@@ -183,18 +258,7 @@ static int resolve_recursive(const char *name, const char *constraint, ResolvedM
         return -1;
     }
 
-    int existing = is_resolved(resolved, name);
-    if (existing >= 0) {
-        if (strcmp(resolved->versions[existing], version) != 0) {
-            fprintf(stderr, "Conflict: %s already resolved to %s, can't use %s\n", name, resolved->versions[existing], version);
-            free(version);
-            return -1;
-        }
-        free(version);
-        return 0;
-    }
-
-    cJSON *meta = repo_get_metadata(name, version);
+    cJSON *meta = meta_cache_get(fs, name, version);
     if (!meta) {
         fprintf(stderr, "Metadata fetch failed for %s@%s\n", name, version);
         free(version);
@@ -208,16 +272,21 @@ static int resolve_recursive(const char *name, const char *constraint, ResolvedM
         cJSON_ArrayForEach(dep, deps) { //this construct does not look c-like?
             const char *dep_name = cJSON_GetObjectItem(dep, "name")->valuestring;
             const char *dep_constraint = cJSON_GetObjectItem(dep, "version")->valuestring;
-            if (resolve_recursive(dep_name, dep_constraint, resolved, install_order) != 0) {
+            int rc = resolve_recursive(fs, dep_name, dep_constraint, resolved, install_order);
+            if (rc != 0) {
                 cJSON_Delete(meta);
                 free(version);
-                return -1;
+                return rc;
             }
         }
     }
 
     // Mark this package as resolved
-    add_resolved(resolved, name, version);
+    if (add_resolved(resolved, name, version, NULL) < 0) {
+        cJSON_Delete(meta);
+        free(version);
+        return -1;
+    }
 
     // Append to install order
     cJSON *pkg = cJSON_CreateObject();
@@ -229,19 +298,931 @@ static int resolve_recursive(const char *name, const char *constraint, ResolvedM
     free(version);
     return 0;
 }
+#endif
+
+
+/**
+ * the same request with every constraint pinned to one version, for the metadata of packages that
+ * are about to be downloaded. packages is a list of {name, version} and is not taken over.
+ * repo_send_metadata_request only sends it, so that chunks keep arriving while it is answered, and
+ * repo_metadata_result puts the reply into the metadata cache
+ */
+int repo_send_metadata_request(cJSON *packages) {
+    char pin[META_CACHE_KEY_SIZE];
+    cJSON *request = cJSON_CreateArray();
+    cJSON *pkg = NULL;
+    cJSON_ArrayForEach(pkg, packages) {
+        int len = snprintf(pin, sizeof(pin), "==%s", cJSON_GetObjectItem(pkg, "version")->valuestring);
+        if (len < 0 || len >= (int)sizeof(pin)) continue;
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", cJSON_GetObjectItem(pkg, "name")->valuestring);
+        cJSON_AddStringToObject(item, "constraint", pin);
+        cJSON_AddItemToArray(request, item);
+    }
+    return repo_send_batch(request);
+}
+
+bool repo_metadata_result(int id) {
+    cJSON *result = repo_batch_result(id);
+    if (!result) return false;
+    cJSON *entry = NULL;
+    cJSON_ArrayForEach(entry, result) {
+        const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(entry, "name"));
+        const char *version = cJSON_GetStringValue(cJSON_GetObjectItem(entry, "version"));
+        if (name && version) meta_cache_put(name, version, entry);
+    }
+    cJSON_Delete(result);
+    return true;
+}
+
+bool repo_prefetch_metadata(cJSON *packages) {
+    return repo_metadata_result(repo_send_metadata_request(packages));
+}
+
+/**
+ * batched resolver. walks the dependency graph breadth first, sending every unresolved
+ * package of one level in a single RESOLVE_BATCH request (split in MAX_RESOLVE_BATCH sized slices,
+ * up to RESOLVE_SLICES_IN_FLIGHT of them are sent before the first reply is read).
+ * duplicate names within a level are merged by joining their constraints so that the server
+ * picks one version satisfying all of them. packages seen again on a deeper level must be
+ * satisfied by the version already chosen.
+ */
+//joins the constraints two requirers put on name, RESOLVE_CONFLICT when they exclude each other
+static int join_constraints(const char *name, const char *a, const char *b, char *out, size_t len) {
+    semver_range_t ra, rb, joined;
+    if (semver_range_compile(a, &ra) && semver_range_compile(b, &rb) && semver_range_intersect(&ra, &rb, &joined)) {
+        if (joined.count == 0) {
+            fprintf(stderr, "Conflict: constraints %s and %s on %s exclude each other\n", a, b, name);
+            return RESOLVE_CONFLICT;
+        }
+        if (semver_range_format(&joined, out, len)) return 0;
+    }
+    //left to the server to reject
+    snprintf(out, len, "%s,%s", a, b);
+    return 0;
+}
+
+static int add_pending(cJSON *level, const char *name, const char *constraint) {
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, level) {
+        cJSON *pending_constraint = cJSON_GetObjectItem(item, "constraint");
+        if (strcmp(cJSON_GetObjectItem(item, "name")->valuestring, name) != 0) continue;
+        if (strcmp(pending_constraint->valuestring, constraint) != 0) {
+            size_t len = strlen(pending_constraint->valuestring) + strlen(constraint) + 2 + JOINED_CONSTRAINT_SIZE;
+            char *joined = malloc(len);
+            if (!joined) return -1;
+            int rc = join_constraints(name, pending_constraint->valuestring, constraint, joined, len);
+            if (rc == 0) cJSON_ReplaceItemInObject(item, "constraint", cJSON_CreateString(joined));
+            free(joined);
+            return rc;
+        }
+        return 0;
+    }
+
+    item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", name);
+    cJSON_AddStringToObject(item, "constraint", constraint);
+    cJSON_AddItemToArray(level, item);
+    return 0;
+}
+
+//takes in the reply to one slice, count is the number of packages it asked for
+static int resolve_slice(int id, int count, ResolvedMap *resolved, cJSON *next_level) {
+    cJSON *result = repo_batch_result(id);
+    if (!result) {
+        fprintf(stderr, "Batch resolve of %d packages failed\n", count);
+        return -1;
+    }
+
+    cJSON *entry = NULL;
+    cJSON_ArrayForEach(entry, result) {
+        const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(entry, "name"));
+        const char *version = cJSON_GetStringValue(cJSON_GetObjectItem(entry, "version"));
+        if (!name || !version) continue;
+        if (is_resolved(resolved, name) >= 0) continue;
+
+        //the downloader asks for the same metadata right after resolve
+        meta_cache_put(name, version, entry);
+
+        cJSON *deps = cJSON_DetachItemFromObject(entry, "dependencies");
+        if (deps && !cJSON_IsArray(deps)) {
+            cJSON_Delete(deps);
+            deps = NULL;
+        }
+
+        cJSON *dep = NULL;
+        cJSON_ArrayForEach(dep, deps) {
+            const char *dep_name = cJSON_GetObjectItem(dep, "name")->valuestring;
+            const char *dep_constraint = cJSON_GetObjectItem(dep, "version")->valuestring;
+            int rc = add_pending(next_level, dep_name, dep_constraint);
+            if (rc != 0) {
+                cJSON_Delete(deps);
+                cJSON_Delete(result);
+                return rc;
+            }
+        }
+        if (add_resolved(resolved, name, version, deps ? deps : cJSON_CreateArray()) < 0) {
+            cJSON_Delete(result);
+            return -1;
+        }
+    }
+
+    cJSON_Delete(result);
+    return 0;
+}
+
+typedef struct {
+    int ids[RESOLVE_SLICES_IN_FLIGHT];
+    int counts[RESOLVE_SLICES_IN_FLIGHT];
+    int n;
+} slices_in_flight_t;
+
+//slice is owned by the request from here on
+static void send_slice(slices_in_flight_t *flight, cJSON *slice) {
+    flight->counts[flight->n] = cJSON_GetArraySize(slice);
+    flight->ids[flight->n++] = repo_send_batch(slice);
+}
+
+//takes in the replies in the order the slices were sent, the rest is dropped after a failure
+static int collect_slices(slices_in_flight_t *flight, ResolvedMap *resolved, cJSON *next_level) {
+    int ret = 0;
+    for (int i = 0; i < flight->n; i++) {
+        if (ret == 0) ret = resolve_slice(flight->ids[i], flight->counts[i], resolved, next_level);
+        else transport_cancel(flight->ids[i]);
+    }
+    flight->n = 0;
+    return ret;
+}
+
+static int resolve_batched(FATFS *fs, cJSON *requests, ResolvedMap *resolved) {
+    int ret = -1;
+    slices_in_flight_t flight = {0};
+    cJSON *level = cJSON_CreateArray();
+    cJSON *next_level = NULL;
+    cJSON *slice = NULL;
+    cJSON *request = NULL;
+    cJSON_ArrayForEach(request, requests) {
+        add_pending(level, cJSON_GetObjectItem(request, "name")->valuestring, cJSON_GetObjectItem(request, "version")->valuestring);
+    }
+
+    while (cJSON_GetArraySize(level) > 0) {
+        next_level = cJSON_CreateArray();
+        slice = cJSON_CreateArray();
+
+        cJSON *item = NULL;
+        cJSON_ArrayForEach(item, level) {
+            const char *pkg_name = cJSON_GetObjectItem(item, "name")->valuestring;
+            const char *pkg_constraint = cJSON_GetObjectItem(item, "constraint")->valuestring;
+
+            int existing = is_resolved(resolved, pkg_name);
+            if (existing >= 0) {
+                if (!semver_satisfies(resolved->slots[existing].version, pkg_constraint)) {
+                    fprintf(stderr, "Conflict: %s already resolved to %s, can't satisfy %s\n", pkg_name, resolved->slots[existing].version, pkg_constraint);
+                    ret = RESOLVE_CONFLICT;
+                    goto cleanup;
+                }
+                continue;
+            }
+
+            char *installed_version = installed_version_of(fs, resolved, pkg_name);
+            if (installed_version) {
+                if (!semver_satisfies(installed_version, pkg_constraint)) {
+                    fprintf(stderr, "Installed version %s of %s does not satisfy constraint %s\n", installed_version, pkg_name, pkg_constraint);
+                    free(installed_version);
+                    ret = RESOLVE_CONFLICT;
+                    goto cleanup;
+                }
+                int added = add_resolved(resolved, pkg_name, installed_version, NULL);
+                free(installed_version);
+                if (added < 0) goto cleanup;
+                continue;
+            }
+
+            cJSON_AddItemToArray(slice, cJSON_Duplicate(item, 1));
+            if (cJSON_GetArraySize(slice) == MAX_RESOLVE_BATCH) {
+                send_slice(&flight, slice);
+                slice = cJSON_CreateArray();
+                if (flight.n == RESOLVE_SLICES_IN_FLIGHT) {
+                    int rc = collect_slices(&flight, resolved, next_level);
+                    if (rc != 0) {
+                        ret = rc;
+                        goto cleanup;
+                    }
+                }
+            }
+        }
+
+        if (cJSON_GetArraySize(slice) > 0) {
+            send_slice(&flight, slice);
+            slice = NULL;
+        }
+        int rc = collect_slices(&flight, resolved, next_level);
+        if (rc != 0) {
+            ret = rc;
+            goto cleanup;
+        }
+
+        //everything requested on this level must have come back, a miss may be constraints joined by add_pending
+        cJSON_ArrayForEach(item, level) {
+            const char *pkg_name = cJSON_GetObjectItem(item, "name")->valuestring;
+            if (is_resolved(resolved, pkg_name) < 0) {
+                fprintf(stderr, "No version found for %s matching %s\n", pkg_name, cJSON_GetObjectItem(item, "constraint")->valuestring);
+                ret = RESOLVE_CONFLICT;
+                goto cleanup;
+            }
+        }
+
+        if (slice) cJSON_Delete(slice);
+        slice = NULL;
+        cJSON_Delete(level);
+        level = next_level;
+        next_level = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    for (int i = 0; i < flight.n; i++) transport_cancel(flight.ids[i]);
+    if(slice) cJSON_Delete(slice);
+    if(next_level) cJSON_Delete(next_level);
+    if(level) cJSON_Delete(level);
+    return ret;
+}
+
+//depth first post order over the resolved graph, gives the same order the recursive resolver does
+static int emit_install_order(ResolvedMap *resolved, int idx, cJSON *install_order) {
+    resolved_entry_t *entry = &resolved->slots[idx];
+    if (entry->emitted) return 0;
+    entry->emitted = 1;
+
+    cJSON *dep = NULL;
+    cJSON_ArrayForEach(dep, entry->deps) {
+        int dep_idx = is_resolved(resolved, cJSON_GetObjectItem(dep, "name")->valuestring);
+        if (dep_idx < 0 || emit_install_order(resolved, dep_idx, install_order) != 0) {
+            return -1;
+        }
+    }
+
+    cJSON *pkg = cJSON_CreateObject();
+    cJSON_AddStringToObject(pkg, "name", entry->name);
+    cJSON_AddStringToObject(pkg, "version", entry->version);
+    cJSON_AddItemToArray(install_order, pkg);
+    return 0;
+}
+
+
+/**
+ * backtracking resolver, runs when the greedy pass above ends in a conflict. it works from the
+ * candidate list of every package instead of the one version the server prefers:
+ *   request:  {"method":"GET_VERSIONS","package":..}
+ *   response: {"success":true,"result":["1.2.0","1.1.0",..]}   newest first
+ * packages are assigned one at a time, each to its newest candidate that satisfies the packages
+ * already assigned. when none is left, the packages that ruled its candidates out (its conflict
+ * set) are learned as an incompatible combination and the search jumps back to the most recent
+ * of them, decisions in between that had no part in the conflict are dropped rather than retried.
+ * installed packages only offer their installed version and are not descended into, like above.
+ * GET_VERSIONS and GET_META requests beyond two per package count against UPIP_RESOLVE_MAX_FETCHES.
+ * the search holds as many packages as the resolved map it fills, see UPIP_RESOLVE_SCRATCH_SIZE. with
+ * a repository index held (index.c) candidates and dependencies are read from it and the search is
+ * all there is
+ */
+#if UPIP_BACKTRACKING_RESOLVE
+#define BT_CALLER       INT_MAX     //the requests resolve was called with, not a package
+#define BT_MIN_PACKAGES 32          //packages room is made for at first, it doubles up to what the resolved map holds
+
+typedef struct {
+    const char *name;       //borrowed from the caller or from a dependency list of another package
+    cJSON *versions;        //candidates newest first, NULL until fetched
+    cJSON *deps_of;         //version -> dependency list of every candidate fetched so far
+    int next;               //candidate to try next
+    int level;              //position on the trail, -1 while unassigned
+    const char *version;
+    semver_t parsed;        //version, parsed once when it is assigned
+    cJSON *deps;            //dependency list of version, borrowed from deps_of
+    semver_range_t *ranges; //constraints of deps compiled in list order, owned
+} bt_package_t;
+
+typedef struct {
+    int count;
+    int pkg[UPIP_NOGOOD_MAX_SIZE];
+    const char *version[UPIP_NOGOOD_MAX_SIZE];
+} bt_nogood_t;
+
+typedef struct {
+    FATFS *fs;
+    ResolvedMap *resolved;
+    index_t *index;             //candidates come from the repository index instead of the server, NULL for none
+    bt_package_t caller;        //holds the requests as its dependency list, never assigned
+    bt_package_t *pkgs;
+    int count;
+    int allocated;              //room in pkgs and trail, grows up to max_packages
+    int max_packages;           //what the resolved map holds, sized by the scratch resolve was given
+    int *trail;                 //assigned packages in assignment order
+    int depth;
+    /**
+     * conflict sets are bitsets over packages, set_words words each. conflicts holds the set of
+     * every package in pkgs order (packages whose versions ruled out its candidates), why is one
+     * more for the set being worked on. both are laid out again whenever pkgs grows
+     */
+    uint32_t *conflicts;
+    uint32_t *why;
+    int set_words;
+    bt_nogood_t nogoods[UPIP_RESOLVE_MAX_NOGOODS];
+    int nogood_count;
+    int nogood_next;
+    int fetches;
+} backtrack_t;
+
+static void set_add(uint32_t *set, int i) {
+    set[i / 32] |= 1u << (i % 32);
+}
+
+static bool set_has(const uint32_t *set, int i) {
+    return set[i / 32] & (1u << (i % 32));
+}
+
+static void set_merge(backtrack_t *bt, uint32_t *into, const uint32_t *set) {
+    for (int w = 0; w < bt->set_words; w++) into[w] |= set[w];
+}
+
+static void set_clear(backtrack_t *bt, uint32_t *set) {
+    memset(set, 0, bt->set_words * sizeof(uint32_t));
+}
+
+static uint32_t *bt_conflict(backtrack_t *bt, int idx) {
+    return bt->conflicts + (size_t)idx * bt->set_words;
+}
+
+//doubles the room for packages, the conflict sets are widened to cover it
+static int bt_grow(backtrack_t *bt) {
+    int allocated = bt->allocated ? bt->allocated * 2 : BT_MIN_PACKAGES;
+    if (allocated > bt->max_packages) allocated = bt->max_packages;
+    int words = (allocated + 31) / 32;
+
+    bt_package_t *pkgs = realloc(bt->pkgs, allocated * sizeof(*pkgs));
+    if (pkgs) bt->pkgs = pkgs;
+    int *trail = realloc(bt->trail, allocated * sizeof(*trail));
+    if (trail) bt->trail = trail;
+    uint32_t *why = realloc(bt->why, words * sizeof(*why));
+    if (why) bt->why = why;
+    uint32_t *conflicts = calloc((size_t)allocated * words, sizeof(*conflicts));
+    if (!pkgs || !trail || !why || !conflicts) {
+        free(conflicts);
+        return -1;
+    }
+
+    for (int i = 0; i < bt->count; i++) {
+        memcpy(conflicts + (size_t)i * words, bt_conflict(bt, i), bt->set_words * sizeof(uint32_t));
+    }
+    free(bt->conflicts);
+    bt->conflicts = conflicts;
+    bt->set_words = words;
+    bt->allocated = allocated;
+    return 0;
+}
+
+static cJSON *repo_get_versions(const char *package) {
+    cJSON *result = NULL;
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "method", "GET_VERSIONS");
+    cJSON_AddStringToObject(root, "package", package);
+
+    uint32_t started = stats_phase_begin(UPIP_PHASE_RESOLVE);
+    char *response = transport_request(root, MEDIUM_TIMEOUT);
+    cJSON *response_json = cJSON_Parse(response);
+
+    cJSON_Delete(root);
+    if(response) free(response);
+
+    if (response_json && cJSON_IsTrue(cJSON_GetObjectItem(response_json, "success"))) {
+        result = cJSON_DetachItemFromObject(response_json, "result");
+    } else if (response_json) {
+        fprintf(stderr, "Server error: %s\n", cJSON_GetStringValue(cJSON_GetObjectItem(response_json, "message")));
+    }
+
+    cJSON_Delete(response_json);
+    if (result && !cJSON_IsArray(result)) {
+        cJSON_Delete(result);
+        result = NULL;
+    }
+    stats_phase_end(UPIP_PHASE_RESOLVE, started, result != NULL);
+    return result;
+}
 
+static bool bt_fetch_allowed(backtrack_t *bt, const char *name) {
+    //two per package met, its candidate list and one GET_META, are what any plan costs, the budget bounds the rest
+    if (bt->fetches >= UPIP_RESOLVE_MAX_FETCHES + 2 * bt->count) {
+        fprintf(stderr, "Giving up on %s after %d fetches, raise UPIP_RESOLVE_MAX_FETCHES\n", name, bt->fetches);
+        return false;
+    }
+    bt->fetches++;
+    return true;
+}
+
+//packages are few, a linear scan is cheaper than keeping a second hash table in sync
+static int bt_find(backtrack_t *bt, const char *name) {
+    for (int i = 0; i < bt->count; i++) {
+        if (strcmp(bt->pkgs[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int bt_add(backtrack_t *bt, const char *name) {
+    if (bt->count == bt->max_packages) {
+        report_out_of_space(bt->resolved, name);
+        return -1;
+    }
+    if (bt->count == bt->allocated && bt_grow(bt) != 0) {
+        fprintf(stderr, "Out of memory for the backtracking resolver at %s\n", name);
+        return -1;
+    }
+    bt_package_t *pkg = &bt->pkgs[bt->count];
+    memset(pkg, 0, sizeof(*pkg));
+    pkg->name = name;
+    pkg->level = -1;
+    return bt->count++;
+}
+
+//compiled constraints of a dependency list, one that does not compile is one nothing satisfies
+static semver_range_t *bt_compile(cJSON *deps) {
+    int count = cJSON_GetArraySize(deps);
+    semver_range_t *ranges = calloc(count > 0 ? count : 1, sizeof(*ranges));
+    if (!ranges) return NULL;
+
+    int i = 0;
+    cJSON *dep = NULL;
+    cJSON_ArrayForEach(dep, deps) {
+        const char *constraint = cJSON_GetObjectItem(dep, "version")->valuestring;
+        if (!semver_range_compile(constraint, &ranges[i])) {
+            fprintf(stderr, "Can't compile constraint %s on %s\n", constraint, cJSON_GetObjectItem(dep, "name")->valuestring);
+            ranges[i].count = 0;
+        }
+        i++;
+    }
+    return ranges;
+}
+
+static const semver_range_t *bt_range_on(const bt_package_t *from, const char *name) {
+    int i = 0;
+    cJSON *dep = NULL;
+    cJSON_ArrayForEach(dep, from->deps) {
+        if (strcmp(cJSON_GetObjectItem(dep, "name")->valuestring, name) == 0) return &from->ranges[i];
+        i++;
+    }
+    return NULL;
+}
+
+static int bt_fetch_candidates(backtrack_t *bt, bt_package_t *pkg) {
+    pkg->deps_of = cJSON_CreateObject();
+
+    char *installed_version = installed_version_of(bt->fs, bt->resolved, pkg->name);
+    if (installed_version) {
+        pkg->versions = cJSON_CreateArray();
+        cJSON_AddItemToArray(pkg->versions, cJSON_CreateString(installed_version));
+        cJSON_AddItemToObject(pkg->deps_of, installed_version, cJSON_CreateArray());
+        free(installed_version);
+        return 0;
+    }
+
+#if UPIP_OFFLINE_INDEX
+    if (bt->index) {
+        cJSON_Delete(pkg->deps_of);
+        FRESULT res = index_lookup(bt->index, pkg->name, &pkg->versions, &pkg->deps_of);
+        if (res == FR_NO_FILE) {
+            fprintf(stderr, "%s is not in repository index revision %u\n", pkg->name, (unsigned)bt->index->hdr.revision);
+        } else if (res != FR_OK) {
+            fprintf(stderr, "Repository index read failed at %s (%d)\n", pkg->name, res);
+        }
+        return res == FR_OK ? 0 : -1;
+    }
+#endif
+
+    if (!bt_fetch_allowed(bt, pkg->name)) return -1;
+    pkg->versions = repo_get_versions(pkg->name);
+    if (!pkg->versions) {
+        fprintf(stderr, "No candidate versions for %s\n", pkg->name);
+        return -1;
+    }
+    return 0;
+}
+
+static cJSON *bt_candidate_deps(backtrack_t *bt, bt_package_t *pkg, const char *version) {
+    cJSON *deps = cJSON_GetObjectItemCaseSensitive(pkg->deps_of, version);
+    if (deps || bt->index) return deps;
+
+    if (!bt_fetch_allowed(bt, pkg->name)) return NULL;
+    cJSON *meta = meta_cache_get(bt->fs, pkg->name, version);
+    if (!meta) {
+        fprintf(stderr, "Metadata fetch failed for %s@%s\n", pkg->name, version);
+        return NULL;
+    }
+    deps = cJSON_DetachItemFromObject(meta, "dependencies");
+    cJSON_Delete(meta);
+    if (!cJSON_IsArray(deps)) {
+        cJSON_Delete(deps);
+        deps = cJSON_CreateArray();
+    }
+    cJSON_AddItemToObject(pkg->deps_of, version, deps);
+    return deps;
+}
+
+//the first assigned package whose dependency on idx excludes version, -1 if none does
+static int bt_excluded_by(backtrack_t *bt, int idx, const semver_t *version) {
+    const semver_range_t *range = bt_range_on(&bt->caller, bt->pkgs[idx].name);
+    if (range && !semver_range_contains(range, version)) return BT_CALLER;
+    for (int i = 0; i < bt->depth; i++) {
+        range = bt_range_on(&bt->pkgs[bt->trail[i]], bt->pkgs[idx].name);
+        if (range && !semver_range_contains(range, version)) return bt->trail[i];
+    }
+    return -1;
+}
+
+/**
+ * true when the constraints of the assigned packages on idx intersect to nothing, then no candidate
+ * needs to be fetched. the packages that emptied the intersection go into the conflict set of idx
+ */
+static bool bt_unsatisfiable(backtrack_t *bt, int idx) {
+    bt_package_t *pkg = &bt->pkgs[idx];
+    uint32_t *why = bt->why;
+    semver_range_t allowed;
+    const semver_range_t *requested = bt_range_on(&bt->caller, pkg->name);
+    if (requested) allowed = *requested;
+    else if (!semver_range_compile("*", &allowed)) return false;
+
+    set_clear(bt, why);
+    for (int i = 0; i < bt->depth; i++) {
+        const semver_range_t *range = bt_range_on(&bt->pkgs[bt->trail[i]], pkg->name);
+        if (!range) continue;
+        if (!semver_range_intersect(&allowed, range, &allowed)) return false;
+        set_add(why, bt->trail[i]);
+        if (allowed.count > 0) continue;
+
+        set_merge(bt, bt_conflict(bt, idx), why);
+        return true;
+    }
+    return false;
+}
+
+//an assigned package whose version the dependencies of the candidate exclude, -1 if none
+static int bt_disagrees_with(backtrack_t *bt, cJSON *deps, const semver_range_t *ranges) {
+    int i = 0;
+    cJSON *dep = NULL;
+    cJSON_ArrayForEach(dep, deps) {
+        int other = bt_find(bt, cJSON_GetObjectItem(dep, "name")->valuestring);
+        if (other >= 0 && bt->pkgs[other].level >= 0 && !semver_range_contains(&ranges[i], &bt->pkgs[other].parsed)) return other;
+        i++;
+    }
+    return -1;
+}
+
+//true if idx@version completes a learned combination, the rest of it goes into why
+static bool bt_nogood_hit(backtrack_t *bt, int idx, const char *version, uint32_t *why) {
+    for (int n = 0; n < bt->nogood_count; n++) {
+        const bt_nogood_t *nogood = &bt->nogoods[n];
+        bool hit = false;
+        for (int i = 0; i < nogood->count; i++) {
+            if (nogood->pkg[i] == idx && strcmp(nogood->version[i], version) == 0) hit = true;
+        }
+        for (int i = 0; hit && i < nogood->count; i++) {
+            const bt_package_t *pkg = &bt->pkgs[nogood->pkg[i]];
+            if (nogood->pkg[i] == idx) continue;
+            hit = pkg->level >= 0 && strcmp(pkg->version, nogood->version[i]) == 0;
+        }
+        if (!hit) continue;
+        for (int i = 0; i < nogood->count; i++) {
+            if (nogood->pkg[i] != idx) set_add(why, nogood->pkg[i]);
+        }
+        return true;
+    }
+    return false;
+}
+
+static void bt_learn(backtrack_t *bt, const uint32_t *set) {
+    bt_nogood_t nogood = {0};
+    for (int i = 0; i < bt->count; i++) {
+        if (!set_has(set, i)) continue;
+        if (nogood.count == UPIP_NOGOOD_MAX_SIZE) return;
+        nogood.pkg[nogood.count] = i;
+        nogood.version[nogood.count] = bt->pkgs[i].version;
+        nogood.count++;
+    }
+    if (nogood.count == 0) return;
+
+    bt->nogoods[bt->nogood_next] = nogood;
+    bt->nogood_next = (bt->nogood_next + 1) % UPIP_RESOLVE_MAX_NOGOODS;
+    if (bt->nogood_count < UPIP_RESOLVE_MAX_NOGOODS) bt->nogood_count++;
+}
+
+//1 when a candidate was assigned, 0 when none is left, -1 on error
+static int bt_assign(backtrack_t *bt, int idx) {
+    bt_package_t *pkg = &bt->pkgs[idx];
+    uint32_t *conflict = bt_conflict(bt, idx);
+    if (pkg->next == 0 && bt_unsatisfiable(bt, idx)) return 0;
+    if (!pkg->versions && bt_fetch_candidates(bt, pkg) != 0) return -1;
+
+    int count = cJSON_GetArraySize(pkg->versions);
+    while (pkg->next < count) {
+        semver_t parsed;
+        const char *version = cJSON_GetStringValue(cJSON_GetArrayItem(pkg->versions, pkg->next++));
+        if (!version) continue;
+        if (!semver_parse(version, &parsed)) {
+            fprintf(stderr, "Skipping %s@%s: not a version, or a prerelease tag longer than SEMVER_PRE_SIZE allows\n", pkg->name, version);
+            continue;
+        }
+
+        int culprit = bt_excluded_by(bt, idx, &parsed);
+        if (culprit >= 0) {
+            if (culprit != BT_CALLER) set_add(conflict, culprit);
+            continue;
+        }
+        if (bt_nogood_hit(bt, idx, version, conflict)) continue;
+
+        cJSON *deps = bt_candidate_deps(bt, pkg, version);
+        if (!deps) return -1;
+        semver_range_t *ranges = bt_compile(deps);
+        if (!ranges) return -1;
+        culprit = bt_disagrees_with(bt, deps, ranges);
+        if (culprit >= 0) {
+            free(ranges);
+            set_add(conflict, culprit);
+            continue;
+        }
+
+        pkg->version = version;
+        pkg->parsed = parsed;
+        pkg->deps = deps;
+        pkg->ranges = ranges;
+        pkg->level = bt->depth;
+        bt->trail[bt->depth++] = idx;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * idx ran out of candidates. its conflict set plus the package that requires it make a combination
+ * that can't be completed, the most recent member is unassigned together with everything after it
+ * and inherits the rest of the set as the reason its current version failed. returns the member to
+ * retry, -1 when the set is empty and nothing can be changed
+ */
+static int bt_backjump(backtrack_t *bt, int idx) {
+    bt_package_t *pkg = &bt->pkgs[idx];
+    uint32_t *why = bt->why;
+    memcpy(why, bt_conflict(bt, idx), bt->set_words * sizeof(uint32_t));
+    for (int i = 0; i < bt->depth; i++) {
+        if (bt_range_on(&bt->pkgs[bt->trail[i]], pkg->name)) {
+            set_add(why, bt->trail[i]);
+            break;
+        }
+    }
+
+    int target = -1;
+    for (int i = 0; i < bt->count; i++) {
+        if (set_has(why, i) && (target < 0 || bt->pkgs[i].level > bt->pkgs[target].level)) target = i;
+    }
+    pkg->next = 0;
+    set_clear(bt, bt_conflict(bt, idx));
+    if (target < 0) {
+        fprintf(stderr, "No version of %s satisfies every constraint on it\n", pkg->name);
+        return -1;
+    }
+
+    bt_learn(bt, why);
+    int level = bt->pkgs[target].level;
+    while (bt->depth > level) {
+        int undone_idx = bt->trail[--bt->depth];
+        bt_package_t *undone = &bt->pkgs[undone_idx];
+        undone->level = -1;
+        undone->version = NULL;
+        undone->deps = NULL;
+        free(undone->ranges);
+        undone->ranges = NULL;
+        if (undone_idx == target) continue;
+        undone->next = 0;
+        set_clear(bt, bt_conflict(bt, undone_idx));
+    }
+    uint32_t *conflict = bt_conflict(bt, target);
+    set_merge(bt, conflict, why);
+    conflict[target / 32] &= ~(1u << (target % 32));
+    return target;
+}
+
+//first unassigned request or dependency of the assigned packages in trail order, -1 when every one is assigned
+static int bt_next_unassigned(backtrack_t *bt, int *idx) {
+    for (int i = -1; i < bt->depth; i++) {
+        cJSON *dep = NULL;
+        cJSON *deps = i < 0 ? bt->caller.deps : bt->pkgs[bt->trail[i]].deps;
+        cJSON_ArrayForEach(dep, deps) {
+            const char *name = cJSON_GetObjectItem(dep, "name")->valuestring;
+            *idx = bt_find(bt, name);
+            if (*idx < 0 && (*idx = bt_add(bt, name)) < 0) return -1;
+            if (bt->pkgs[*idx].level < 0) return 0;
+        }
+    }
+    *idx = -1;
+    return 0;
+}
+
+static int resolve_backtracking(FATFS *fs, cJSON *requests, ResolvedMap *resolved, index_t *index) {
+    int ret = -1;
+    int idx;
+    backtrack_t *bt = calloc(1, sizeof(*bt));
+    if (!bt) return -1;
+    bt->fs = fs;
+    bt->resolved = resolved;
+    bt->max_packages = resolved->capacity;
+    bt->index = index;
+    bt->caller.deps = requests;
+    if (!(bt->caller.ranges = bt_compile(requests))) goto cleanup;
+
+    if (bt_next_unassigned(bt, &idx) != 0) goto cleanup;
+    while (idx >= 0) {
+        int rc = bt_assign(bt, idx);
+        if (rc < 0) goto cleanup;
+        if (rc == 0) {
+            idx = bt_backjump(bt, idx);
+            if (idx < 0) goto cleanup;
+            continue;
+        }
+        if (bt_next_unassigned(bt, &idx) != 0) goto cleanup;
+    }
+
+    for (int i = 0; i < bt->depth; i++) {
+        bt_package_t *pkg = &bt->pkgs[bt->trail[i]];
+        if (add_resolved(resolved, pkg->name, pkg->version, cJSON_Duplicate(pkg->deps, 1)) < 0) goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    for (int i = 0; i < bt->count; i++) {
+        cJSON_Delete(bt->pkgs[i].versions);
+        cJSON_Delete(bt->pkgs[i].deps_of);
+        free(bt->pkgs[i].ranges);
+    }
+    free(bt->caller.ranges);
+    free(bt->pkgs);
+    free(bt->trail);
+    free(bt->conflicts);
+    free(bt->why);
+    free(bt);
+    return ret;
+}
+#endif
+
+//every requested package followed by its dependencies, each package once
+static int emit_requests(ResolvedMap *resolved, cJSON *requests, cJSON *install_order) {
+    cJSON *request = NULL;
+    cJSON_ArrayForEach(request, requests) {
+        int idx = is_resolved(resolved, cJSON_GetObjectItem(request, "name")->valuestring);
+        if (idx < 0 || emit_install_order(resolved, idx, install_order) != 0) return -1;
+    }
+    return 0;
+}
+
+//greedy pass, and the backtracking search over server candidates when it ends in a conflict
+static int resolve_online(FATFS *fs, cJSON *requests, ResolvedMap *resolved, cJSON *install_order, void *scratch, size_t scratch_size) {
+#if UPIP_BATCHED_RESOLVE
+    int rc = resolve_batched(fs, requests, resolved);
+    if (rc == 0) rc = emit_requests(resolved, requests, install_order);
+#else
+    int rc = 0;
+    cJSON *request = NULL;
+    cJSON_ArrayForEach(request, requests) {
+        const char *name = cJSON_GetObjectItem(request, "name")->valuestring;
+        rc = resolve_recursive(fs, name, cJSON_GetObjectItem(request, "version")->valuestring, resolved, install_order);
+        if (rc != 0) break;
+    }
+#endif
+#if UPIP_BACKTRACKING_RESOLVE
+    if (rc == RESOLVE_CONFLICT) {
+        fprintf(stderr, "Retrying with the backtracking resolver\n");
+        const char *upgrade = resolved->upgrade;
+        free_resolved(resolved);
+        while (cJSON_GetArraySize(install_order) > 0) cJSON_DeleteItemFromArray(install_order, 0);
+        if (init_resolved(resolved, scratch, scratch_size) != 0) return -1;
+        resolved->upgrade = upgrade;
+        rc = resolve_backtracking(fs, requests, resolved, NULL);
+        if (rc == 0) rc = emit_requests(resolved, requests, install_order);
+    }
+#else
+    (void)scratch;
+    (void)scratch_size;
+#endif
+    return rc;
+}
+
+//pkgs.db records names and versions up to a fixed size, a plan it cannot record fails before any download
+static int check_plan_fits(cJSON *install_order) {
+    cJSON *pkg = NULL;
+    cJSON_ArrayForEach(pkg, install_order) {
+        const char *name = cJSON_GetObjectItem(pkg, "name")->valuestring;
+        const char *version = cJSON_GetObjectItem(pkg, "version")->valuestring;
+        if (strlen(name) >= PKGDB_NAME_SIZE || strlen(version) >= PKGDB_VERSION_SIZE) {
+            fprintf(stderr, "Cannot install %s@%s: name or version too long for the package database\n", name, version);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * requests in the form of a dependency list, a package named twice is requested once with both
+ * constraints joined. "*" stands in for a NULL constraint
+ */
+static cJSON *build_requests(const upip_requirement_t *packages, size_t count) {
+    cJSON *requests = cJSON_CreateArray();
+    for (size_t i = 0; requests && i < count; i++) {
+        const char *constraint = packages[i].constraint ? packages[i].constraint : "*";
+        cJSON *request = NULL;
+        cJSON_ArrayForEach(request, requests) {
+            if (strcmp(cJSON_GetObjectItem(request, "name")->valuestring, packages[i].name) == 0) break;
+        }
+        if (!request) {
+            request = cJSON_CreateObject();
+            cJSON_AddStringToObject(request, "name", packages[i].name);
+            cJSON_AddStringToObject(request, "version", constraint);
+            cJSON_AddItemToArray(requests, request);
+            continue;
+        }
+
+        const char *requested = cJSON_GetObjectItem(request, "version")->valuestring;
+        size_t len = strlen(requested) + strlen(constraint) + 2 + JOINED_CONSTRAINT_SIZE;
+        char *joined = malloc(len);
+        if (joined && join_constraints(packages[i].name, requested, constraint, joined, len) == 0) {
+            cJSON_ReplaceItemInObject(request, "version", cJSON_CreateString(joined));
+        } else {
+            cJSON_Delete(requests);
+            requests = NULL;
+        }
+        if (joined) free(joined);
+    }
+    return requests;
+}
+
+cJSON *resolve_requirements(FATFS *fs, const upip_requirement_t *packages, size_t count, void *scratch, size_t scratch_size, const char *upgrade) {
+    ResolvedMap resolved;
+    int rc = -1;
+    bool offline = false;
+    cJSON *requests = build_requests(packages, count);
+    if (!requests) return NULL;
+    if (!scratch) scratch_size = UPIP_RESOLVE_SCRATCH_SIZE(UPIP_RESOLVE_MAX_PACKAGES);
+    if (init_resolved(&resolved, scratch, scratch_size) != 0) {
+        cJSON_Delete(requests);
+        return NULL;
+    }
+    resolved.upgrade = upgrade;
 
-cJSON *resolve(char *package, const char *constraint) {
-    ResolvedMap resolved = {0};
     cJSON *install_order = cJSON_CreateArray();
-    //* means install latest
-    if (resolve_recursive(package, constraint, &resolved, install_order) != 0) {
-        cJSON_Delete(install_order);
+#if UPIP_BACKTRACKING_RESOLVE && UPIP_OFFLINE_INDEX
+    //with an index held nothing is asked from the server
+    index_t *index = malloc(sizeof(*index));
+    if (index && index_open(fs, index) == FR_OK) {
+        offline = true;
+        rc = resolve_backtracking(fs, requests, &resolved, index);
+        if (rc == 0) rc = emit_requests(&resolved, requests, install_order);
+        index_close(index);
+    }
+    if (index) free(index);
+    if (offline && rc != 0) {
+        //a stale index or a search it cannot finish must not fail what the server resolves
+        fprintf(stderr, "Resolving from the repository index failed, asking the server\n");
+        offline = false;
         free_resolved(&resolved);
-        return NULL;
+        while (cJSON_GetArraySize(install_order) > 0) cJSON_DeleteItemFromArray(install_order, 0);
+        if (init_resolved(&resolved, scratch, scratch_size) != 0) {
+            cJSON_Delete(install_order);
+            cJSON_Delete(requests);
+            return NULL;
+        }
+        resolved.upgrade = upgrade;
     }
+#endif
+    if (!offline) rc = resolve_online(fs, requests, &resolved, install_order, scratch, scratch_size);
+    if (rc == 0) rc = check_plan_fits(install_order);
 
     free_resolved(&resolved);
+    cJSON_Delete(requests);
+    if (rc != 0) {
+        cJSON_Delete(install_order);
+        return NULL;
+    }
     return install_order;
 }
 
+cJSON *resolve_internal(FATFS *fs, const char *package, const char *constraint, void *scratch, size_t scratch_size, const char *upgrade) {
+    upip_requirement_t request = {package, constraint};
+    return resolve_requirements(fs, &request, 1, scratch, scratch_size, upgrade);
+}
+
+cJSON *resolve_ex(FATFS *fs, const char *package, const char *constraint, void *scratch, size_t scratch_size) {
+    mutex_take();
+    cjson_arena_enter();
+    cJSON *install_order = resolve_internal(fs, package, constraint, scratch, scratch_size, NULL);
+    install_order = cjson_arena_export(install_order); //handed to the caller
+    cjson_arena_leave();
+    mutex_give();
+    return install_order;
+}
+
+cJSON *resolve(FATFS *fs, const char *package, const char *constraint) {
+    return resolve_ex(fs, package, constraint, NULL, 0);
+}
@@ -0,0 +1,359 @@
+//Semver constraints compiled into interval sets, versions are tested against them without parsing
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "upip.h"
+#include "upip_internal.h"
+
+#define BOUND_INCLUSIVE     0x01
+#define BOUND_OPEN          0x02    //no bound, -inf or +inf
+#define BOUND_PRE           0x04    //written with a prerelease, lets prereleases of that version in
+
+//the shortest version with a prerelease is "0.0.0-" followed by it
+#if SEMVER_PRE_SIZE < PKGDB_VERSION_SIZE - 6
+#error "SEMVER_PRE_SIZE is too small for the versions pkgs.db holds"
+#endif
+
+/**
+ * versions
+ */
+static const char *parse_number(const char *s, uint32_t *out) {
+    uint32_t n = 0;
+    if (!isdigit((unsigned char)*s)) return NULL;
+    while (isdigit((unsigned char)*s)) {
+        if (n > (UINT32_MAX - 9) / 10) return NULL;
+        n = n * 10 + (uint32_t)(*s++ - '0');
+    }
+    *out = n;
+    return s;
+}
+
+/**
+ * reads MAJOR[.MINOR[.PATCH]][-PRE][+BUILD] up to the first character that can't belong to it.
+ * *parts is how many of the three numbers were given, 0 for "*" or "x", which stand for any
+ */
+static const char *parse_partial(const char *s, semver_t *out, int *parts) {
+    memset(out, 0, sizeof(*out));
+    *parts = 0;
+    if (*s == 'v') s++;
+    if (*s == '*' || *s == 'x' || *s == 'X') return s + 1;
+
+    uint32_t *fields[3] = {&out->major, &out->minor, &out->patch};
+    while (*parts < 3) {
+        if (*s == '*' || *s == 'x' || *s == 'X') {
+            s++;
+            break;
+        }
+        if (!(s = parse_number(s, fields[*parts]))) return NULL;
+        (*parts)++;
+        if (*s != '.' || *parts == 3) break;
+        s++;
+    }
+
+    if (*s == '-' && *parts == 3) {
+        size_t len = 0;
+        s++;
+        while (isalnum((unsigned char)s[len]) || s[len] == '.' || s[len] == '-') len++;
+        if (len == 0 || len >= sizeof(out->pre)) return NULL;
+        memcpy(out->pre, s, len);
+        out->pre[len] = '\0';
+        s += len;
+    }
+    if (*s == '+') {
+        s++;
+        while (isalnum((unsigned char)*s) || *s == '.' || *s == '-') s++;
+    }
+    return s;
+}
+
+bool semver_parse(const char *str, semver_t *out) {
+    int parts;
+    if (!str) return false;
+    const char *end = parse_partial(str, out, &parts);
+    return end && *end == '\0' && parts == 3;
+}
+
+//dot separated identifiers, numeric ones compare as numbers and sort before alphanumeric ones
+static int compare_pre(const char *a, const char *b) {
+    if (!*a || !*b) return (*a == '\0') - (*b == '\0'); //no prerelease sorts after any
+    while (*a || *b) {
+        if (!*a || !*b) return *a ? 1 : -1;
+        size_t la = strcspn(a, "."), lb = strcspn(b, ".");
+        bool na = strspn(a, "0123456789") >= la, nb = strspn(b, "0123456789") >= lb;
+        int cmp;
+        if (na && nb) {
+            cmp = la != lb ? (la < lb ? -1 : 1) : strncmp(a, b, la);
+        } else if (na != nb) {
+            cmp = na ? -1 : 1;
+        } else {
+            cmp = strncmp(a, b, la < lb ? la : lb);
+            if (cmp == 0 && la != lb) cmp = la < lb ? -1 : 1;
+        }
+        if (cmp) return cmp < 0 ? -1 : 1;
+        a += la + (a[la] == '.');
+        b += lb + (b[lb] == '.');
+    }
+    return 0;
+}
+
+static int compare_triple(const semver_t *a, const semver_t *b) {
+    if (a->major != b->major) return a->major < b->major ? -1 : 1;
+    if (a->minor != b->minor) return a->minor < b->minor ? -1 : 1;
+    if (a->patch != b->patch) return a->patch < b->patch ? -1 : 1;
+    return 0;
+}
+
+int semver_compare(const semver_t *a, const semver_t *b) {
+    int cmp = compare_triple(a, b);
+    return cmp ? cmp : compare_pre(a->pre, b->pre);
+}
+
+/**
+ * intervals. lower bounds order -inf first and an inclusive bound before an exclusive one on the
+ * same version, upper bounds order +inf last and an exclusive bound before an inclusive one
+ */
+static int compare_lo(const semver_bound_t *a, const semver_bound_t *b) {
+    if ((a->flags & BOUND_OPEN) || (b->flags & BOUND_OPEN)) return (b->flags & BOUND_OPEN) - (a->flags & BOUND_OPEN);
+    int cmp = semver_compare(&a->version, &b->version);
+    if (cmp) return cmp;
+    return (b->flags & BOUND_INCLUSIVE) - (a->flags & BOUND_INCLUSIVE);
+}
+
+static int compare_hi(const semver_bound_t *a, const semver_bound_t *b) {
+    if ((a->flags & BOUND_OPEN) || (b->flags & BOUND_OPEN)) return (a->flags & BOUND_OPEN) - (b->flags & BOUND_OPEN);
+    int cmp = semver_compare(&a->version, &b->version);
+    if (cmp) return cmp;
+    return (a->flags & BOUND_INCLUSIVE) - (b->flags & BOUND_INCLUSIVE);
+}
+
+static bool interval_empty(const semver_interval_t *iv) {
+    if ((iv->lo.flags & BOUND_OPEN) || (iv->hi.flags & BOUND_OPEN)) return false;
+    int cmp = semver_compare(&iv->lo.version, &iv->hi.version);
+    return cmp > 0 || (cmp == 0 && !(iv->lo.flags & iv->hi.flags & BOUND_INCLUSIVE));
+}
+
+//true when b starts before a ends, or right where it ends, so the two can be one interval
+static bool touches(const semver_interval_t *a, const semver_interval_t *b) {
+    if ((a->hi.flags & BOUND_OPEN) || (b->lo.flags & BOUND_OPEN)) return true;
+    int cmp = semver_compare(&b->lo.version, &a->hi.version);
+    return cmp < 0 || (cmp == 0 && ((a->hi.flags | b->lo.flags) & BOUND_INCLUSIVE));
+}
+
+//adds iv to the sorted, disjoint set in range, merging whatever it overlaps
+static bool range_add(semver_range_t *range, const semver_interval_t *iv) {
+    semver_interval_t merged = *iv;
+    semver_range_t out = {0};
+    bool placed = false;
+    if (interval_empty(iv)) return true;
+
+    for (int i = 0; i <= range->count; i++) {
+        const semver_interval_t *cur = i < range->count ? &range->intervals[i] : NULL;
+        if (cur && (touches(cur, &merged) && touches(&merged, cur))) {
+            if (compare_lo(&cur->lo, &merged.lo) < 0) merged.lo = cur->lo;
+            if (compare_hi(&cur->hi, &merged.hi) > 0) merged.hi = cur->hi;
+            continue;
+        }
+        if (!placed && (!cur || compare_lo(&merged.lo, &cur->lo) < 0)) {
+            if (out.count == UPIP_SEMVER_MAX_INTERVALS) return false;
+            out.intervals[out.count++] = merged;
+            placed = true;
+        }
+        if (cur) {
+            if (out.count == UPIP_SEMVER_MAX_INTERVALS) return false;
+            out.intervals[out.count++] = *cur;
+        }
+    }
+    *range = out;
+    return true;
+}
+
+static void set_bound(semver_bound_t *bound, const semver_t *version, uint8_t flags) {
+    bound->version = *version;
+    bound->flags = flags;
+}
+
+/**
+ * constraints. a partial version p stands for [floor(p), ceil(p)), e.g. 1.2 for [1.2.0, 1.3.0)
+ */
+static const char *parse_comparator(const char *s, semver_interval_t *iv) {
+    enum { OP_EQ, OP_GE, OP_GT, OP_LE, OP_LT, OP_CARET, OP_TILDE } op = OP_EQ;
+    semver_t floor, ceil;
+    int parts;
+
+    if (strncmp(s, ">=", 2) == 0) { op = OP_GE; s += 2; }
+    else if (strncmp(s, "<=", 2) == 0) { op = OP_LE; s += 2; }
+    else if (strncmp(s, "==", 2) == 0) { s += 2; }
+    else if (*s == '=') { s++; }
+    else if (*s == '>') { op = OP_GT; s++; }
+    else if (*s == '<') { op = OP_LT; s++; }
+    else if (*s == '^') { op = OP_CARET; s++; }
+    else if (*s == '~') { op = OP_TILDE; s++; }
+    while (*s == ' ') s++;
+
+    if (!(s = parse_partial(s, &floor, &parts))) return NULL;
+    uint8_t pre = floor.pre[0] ? BOUND_PRE : 0;
+
+    //the exclusive upper end of a partial version, none for "*"
+    memset(&ceil, 0, sizeof(ceil));
+    if (parts == 1 || (op == OP_CARET && floor.major > 0) || (op == OP_TILDE && parts == 1)) {
+        ceil.major = floor.major + 1;
+    } else if (parts == 2 || op == OP_TILDE || (op == OP_CARET && floor.minor > 0)) {
+        ceil.major = floor.major;
+        ceil.minor = floor.minor + 1;
+    } else if (op == OP_CARET && parts == 3) {
+        ceil.minor = floor.minor;
+        ceil.patch = floor.patch + 1;
+    }
+    bool exact = parts == 3 && op != OP_CARET && op != OP_TILDE;
+    uint8_t ceil_flags = parts == 0 ? BOUND_OPEN : 0;
+
+    set_bound(&iv->lo, &floor, BOUND_OPEN);
+    set_bound(&iv->hi, &floor, BOUND_OPEN);
+    switch (op) {
+    case OP_EQ:
+    case OP_CARET:
+    case OP_TILDE:
+        if (parts > 0) set_bound(&iv->lo, &floor, BOUND_INCLUSIVE | pre);
+        if (exact) set_bound(&iv->hi, &floor, BOUND_INCLUSIVE | pre);
+        else set_bound(&iv->hi, &ceil, ceil_flags);
+        break;
+    case OP_GE:
+        set_bound(&iv->lo, &floor, BOUND_INCLUSIVE | pre);
+        break;
+    case OP_GT:
+        if (exact) set_bound(&iv->lo, &floor, pre);
+        else set_bound(&iv->lo, &ceil, BOUND_INCLUSIVE | ceil_flags);
+        break;
+    case OP_LE:
+        if (exact) set_bound(&iv->hi, &floor, BOUND_INCLUSIVE | pre);
+        else set_bound(&iv->hi, &ceil, ceil_flags);
+        break;
+    case OP_LT:
+        set_bound(&iv->hi, &floor, pre);
+        break;
+    }
+    return s;
+}
+
+static void intersect_interval(const semver_interval_t *a, const semver_interval_t *b, semver_interval_t *out) {
+    out->lo = compare_lo(&a->lo, &b->lo) >= 0 ? a->lo : b->lo;
+    out->hi = compare_hi(&a->hi, &b->hi) <= 0 ? a->hi : b->hi;
+}
+
+/**
+ * comparators separated by ',' or spaces must all hold, alternatives separated by "||" are joined.
+ * an empty constraint is "*"
+ */
+bool semver_range_compile(const char *constraint, semver_range_t *out) {
+    const char *s = constraint ? constraint : "*";
+    semver_interval_t alt, iv;
+
+    memset(out, 0, sizeof(*out));
+    while (1) {
+        bool any = false;
+        set_bound(&alt.lo, &(semver_t){0}, BOUND_OPEN);
+        set_bound(&alt.hi, &(semver_t){0}, BOUND_OPEN);
+
+        while (1) {
+            while (*s == ' ' || *s == ',') s++;
+            if (*s == '\0' || *s == '|') break;
+            if (!(s = parse_comparator(s, &iv))) return false;
+            if (*s != '\0' && *s != ' ' && *s != ',' && *s != '|') return false;
+            intersect_interval(&alt, &iv, &alt);
+            any = true;
+        }
+        if (!any && *s == '|') return false;
+        if (!range_add(out, &alt)) return false;
+
+        if (*s == '\0') return true;
+        if (strncmp(s, "||", 2) != 0) return false;
+        s += 2;
+    }
+}
+
+bool semver_range_intersect(const semver_range_t *a, const semver_range_t *b, semver_range_t *out) {
+    semver_range_t result = {0};
+    semver_interval_t iv;
+    for (int i = 0; i < a->count; i++) {
+        for (int j = 0; j < b->count; j++) {
+            intersect_interval(&a->intervals[i], &b->intervals[j], &iv);
+            if (!range_add(&result, &iv)) return false;
+        }
+    }
+    *out = result;
+    return true;
+}
+
+static bool admits_pre(const semver_bound_t *bound, const semver_t *version) {
+    return (bound->flags & (BOUND_OPEN | BOUND_PRE)) == BOUND_PRE && compare_triple(&bound->version, version) == 0;
+}
+
+bool semver_range_contains(const semver_range_t *range, const semver_t *version) {
+    for (int i = 0; i < range->count; i++) {
+        const semver_interval_t *iv = &range->intervals[i];
+        if (!(iv->lo.flags & BOUND_OPEN)) {
+            int cmp = semver_compare(version, &iv->lo.version);
+            if (cmp < 0 || (cmp == 0 && !(iv->lo.flags & BOUND_INCLUSIVE))) continue;
+        }
+        if (!(iv->hi.flags & BOUND_OPEN)) {
+            int cmp = semver_compare(version, &iv->hi.version);
+            if (cmp > 0 || (cmp == 0 && !(iv->hi.flags & BOUND_INCLUSIVE))) continue;
+        }
+        //like npm, a prerelease needs a bound that names a prerelease of the same version
+        if (version->pre[0] && !admits_pre(&iv->lo, version) && !admits_pre(&iv->hi, version)) continue;
+        return true;
+    }
+    return false;
+}
+
+bool semver_satisfies(const char *version, const char *constraint) {
+    semver_t v;
+    semver_range_t range;
+    if (!constraint || !semver_parse(version, &v) || !semver_range_compile(constraint, &range)) return false;
+    return semver_range_contains(&range, &v);
+}
+
+//appends op and v, or op alone when v is NULL, false once buf is full
+static bool append(char *buf, size_t len, size_t *used, const char *op, const semver_t *v) {
+    int n;
+    if (v) {
+        n = snprintf(buf + *used, len - *used, "%s%u.%u.%u%s%s", op, (unsigned)v->major, (unsigned)v->minor,
+                     (unsigned)v->patch, v->pre[0] ? "-" : "", v->pre);
+    } else {
+        n = snprintf(buf + *used, len - *used, "%s", op);
+    }
+    if (n < 0 || (size_t)n >= len - *used) return false;
+    *used += n;
+    return true;
+}
+
+/**
+ * writes range back as a constraint that compiles to the same range, so a joined constraint can be
+ * sent to the server. false when it does not fit in len
+ */
+bool semver_range_format(const semver_range_t *range, char *buf, size_t len) {
+    size_t used = 0;
+    if (len == 0) return false;
+    buf[0] = '\0';
+    if (range->count == 0) return append(buf, len, &used, "<0.0.0", NULL);
+
+    for (int i = 0; i < range->count; i++) {
+        const semver_bound_t *lo = &range->intervals[i].lo, *hi = &range->intervals[i].hi;
+        bool ok = i == 0 || append(buf, len, &used, "||", NULL);
+
+        if ((lo->flags & BOUND_OPEN) && (hi->flags & BOUND_OPEN)) {
+            ok = ok && append(buf, len, &used, "*", NULL);
+        } else if (!((lo->flags | hi->flags) & BOUND_OPEN) && (lo->flags & hi->flags & BOUND_INCLUSIVE)
+                   && semver_compare(&lo->version, &hi->version) == 0) {
+            ok = ok && append(buf, len, &used, "==", &lo->version);
+        } else {
+            if (!(lo->flags & BOUND_OPEN)) ok = ok && append(buf, len, &used, (lo->flags & BOUND_INCLUSIVE) ? ">=" : ">", &lo->version);
+            if (!(lo->flags & BOUND_OPEN) && !(hi->flags & BOUND_OPEN)) ok = ok && append(buf, len, &used, ",", NULL);
+            if (!(hi->flags & BOUND_OPEN)) ok = ok && append(buf, len, &used, (hi->flags & BOUND_INCLUSIVE) ? "<=" : "<", &hi->version);
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+//Per-phase latency, traffic and heap counters with optional begin/end hooks for telemetry
+#include <string.h>
+
+#include "upip.h"
+#include "upip_internal.h"
+
+static upip_stats_t stats;
+static upip_phase_hook_t phase_hook;
+static void *phase_hook_arg;
+
+void upip_stats_get(upip_stats_t *out) {
+    *out = stats;
+}
+
+void upip_stats_reset(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+void upip_stats_set_hook(upip_phase_hook_t hook, void *arg) {
+    phase_hook = hook;
+    phase_hook_arg = arg;
+}
+
+static void sample_heap(void) {
+    size_t used = UPIP_HEAP_USED();
+    if (used > stats.peak_heap) stats.peak_heap = used;
+}
+
+uint32_t stats_phase_begin(upip_phase_t phase) {
+    if (phase_hook) phase_hook(phase, false, 0, phase_hook_arg);
+    return upip_client_millis();
+}
+
+void stats_phase_end(upip_phase_t phase, uint32_t started, bool ok) {
+    uint32_t elapsed = upip_client_millis() - started;
+    upip_phase_stats_t *p = &stats.phase[phase];
+
+    p->calls++;
+    p->total_ms += elapsed;
+    if (elapsed > p->max_ms) p->max_ms = elapsed;
+    if (!ok) p->failures++;
+    sample_heap();
+
+    if (phase_hook) phase_hook(phase, true, elapsed, phase_hook_arg);
+}
+
+void stats_add_received(size_t bytes) {
+    stats.bytes_received += bytes;
+}
+
+void stats_add_written(size_t bytes) {
+    stats.bytes_written += bytes;
+}
+
+void stats_add_retry(void) {
+    stats.retries++;
+}
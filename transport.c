@@ -0,0 +1,223 @@
+//Transport multiplexer: requests stamped with an id, reply frames matched to them in whatever order they arrive
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+
+#include "upip.h"
+#include "upip_conf.h"
+#include "upip_internal.h"
+
+enum { REQUEST_FREE, REQUEST_PENDING, REQUEST_DONE };
+
+typedef struct {
+    uint16_t id;
+    uint8_t state;
+    bool allocated;             //buf was allocated for the reply, NUL terminated
+    uint8_t *buf;
+    size_t size;
+    size_t len;                 //bytes stored in buf
+} transport_request_t;
+
+static upip_transport_t backend;
+static bool backend_set;
+static transport_request_t requests[UPIP_TRANSPORT_SLOTS];
+static uint16_t last_id;
+
+//the frame being received, a backend may hand it over in pieces
+static uint8_t rx_header[TRANSPORT_HEADER_SIZE];
+static size_t rx_header_len;
+static transport_request_t *rx_request;     //NULL while a frame nobody waits for is skipped
+static uint32_t rx_len;
+static uint32_t rx_got;
+
+static transport_request_t *find(int id) {
+    if (id <= 0) return NULL;
+    for (int i = 0; i < UPIP_TRANSPORT_SLOTS; i++) {
+        if (requests[i].state != REQUEST_FREE && requests[i].id == id) return &requests[i];
+    }
+    return NULL;
+}
+
+static void release(transport_request_t *req) {
+    if (req == rx_request) rx_request = NULL; //the rest of its frame is skipped
+    if (req->allocated && req->buf) free(req->buf);
+    memset(req, 0, sizeof(*req));
+}
+
+//an id that no request in flight uses, 0 never goes out
+static uint16_t next_id(void) {
+    do {
+        if (++last_id == 0) last_id = 1;
+    } while (find(last_id));
+    return last_id;
+}
+
+//the header of a frame arrived, points the payload at the buffer of its request. a length no reply has
+//is skipped like a frame nobody waits for, its request times out like one whose reply was lost
+static void begin_frame(void) {
+    uint16_t id = (uint16_t)(rx_header[0] | (rx_header[1] << 8));
+    rx_len = upip_get_le32(rx_header + 2);
+    rx_got = 0;
+    if (rx_len > UPIP_TRANSPORT_MAX_REPLY) {
+        ESP_LOGE(TAG, "Reply frame of %u bytes exceeds UPIP_TRANSPORT_MAX_REPLY, skipped", (unsigned)rx_len);
+        rx_request = NULL;
+        return;
+    }
+    rx_request = find(id);
+    if (rx_request && rx_request->state != REQUEST_PENDING) rx_request = NULL; //duplicate reply
+
+    if (rx_request && rx_request->allocated) {
+        //without the memory the reply is dropped and completes empty
+        rx_request->buf = malloc((size_t)rx_len + 1);
+        rx_request->size = rx_request->buf ? rx_len : 0;
+    }
+}
+
+/**
+ * internal apis
+ */
+int transport_send(cJSON *message, uint8_t *buf, size_t size) {
+    transport_request_t *req = NULL;
+    int ret = -1;
+
+    if (!backend_set) {
+        ESP_LOGE(TAG, "No transport, see upip_set_transport");
+        return -1;
+    }
+    for (int i = 0; i < UPIP_TRANSPORT_SLOTS && !req; i++) {
+        if (requests[i].state == REQUEST_FREE) req = &requests[i];
+    }
+    if (!req) {
+        ESP_LOGE(TAG, "Too many requests in flight, raise UPIP_TRANSPORT_SLOTS");
+        return -1;
+    }
+
+    //updated in place, like the other fields of a request that is sent again
+    uint16_t id = next_id();
+    cJSON *id_item = cJSON_GetObjectItem(message, "id");
+    if (id_item) cJSON_SetNumberValue(id_item, id);
+    else if (!cJSON_AddNumberToObject(message, "id", id)) return -1;
+
+    size_t mark = cjson_arena_mark();
+    char *text = cJSON_PrintUnformatted(message);
+    if (text && backend.send(backend.ctx, text, strlen(text)) == 0) {
+        req->id = id;
+        req->state = REQUEST_PENDING;
+        req->allocated = !buf;
+        req->buf = buf;
+        req->size = buf ? size : 0;
+        ret = id;
+    }
+    if (text) cJSON_free(text);
+    cjson_arena_release(mark); //the serialised request
+    return ret;
+}
+
+int transport_poll(int timeout_ms) {
+    uint32_t started = upip_client_millis();
+    uint8_t skip[64];
+
+    while (1) {
+        int32_t left = timeout_ms - (int32_t)(upip_client_millis() - started);
+        if (left < 0) left = 0;
+
+        int got;
+        if (rx_header_len < TRANSPORT_HEADER_SIZE) {
+            got = backend.receive(backend.ctx, rx_header + rx_header_len, TRANSPORT_HEADER_SIZE - rx_header_len, left);
+            if (got > 0) {
+                rx_header_len += (size_t)got;
+                if (rx_header_len == TRANSPORT_HEADER_SIZE) begin_frame();
+            }
+        } else {
+            //past the end of the buffer of its request, or for nobody, the payload is read and dropped
+            uint32_t want = rx_len - rx_got;
+            uint8_t *dst = skip;
+            if (rx_request && rx_got < rx_request->size) {
+                dst = rx_request->buf + rx_got;
+                if (want > rx_request->size - rx_got) want = (uint32_t)(rx_request->size - rx_got);
+            } else if (want > sizeof(skip)) {
+                want = sizeof(skip);
+            }
+            got = want ? backend.receive(backend.ctx, dst, want, left) : 0;
+            if (got > 0) rx_got += (uint32_t)got;
+        }
+        if (got < 0) return -1;
+
+        if (rx_header_len == TRANSPORT_HEADER_SIZE && rx_got == rx_len) {
+            transport_request_t *req = rx_request;
+            rx_header_len = 0;
+            rx_request = NULL;
+            if (req) {
+                req->len = rx_len < req->size ? rx_len : req->size;
+                if (req->allocated && req->buf) req->buf[req->len] = '\0';
+                req->state = REQUEST_DONE;
+                return req->id;
+            }
+            continue;
+        }
+        if (got == 0 && left == 0) return 0;
+    }
+}
+
+int transport_take(int id, uint8_t **data) {
+    transport_request_t *req = find(id);
+    if (!req || req->state != REQUEST_DONE) return -1;
+
+    int len = (int)req->len;
+    if (data) *data = req->buf;
+    if (req->allocated && data) req->buf = NULL; //handed to the caller
+    release(req);
+    return len;
+}
+
+int transport_wait(int id, int timeout_ms, uint8_t **data) {
+    uint32_t started = upip_client_millis();
+    transport_request_t *req = find(id);
+
+    while (req && req->state == REQUEST_PENDING) {
+        int32_t left = timeout_ms - (int32_t)(upip_client_millis() - started);
+        if (left <= 0 || transport_poll(left) < 0) break;
+    }
+    if (req && req->state == REQUEST_DONE) return transport_take(id, data);
+    transport_cancel(id);
+    return -1;
+}
+
+void transport_cancel(int id) {
+    transport_request_t *req = find(id);
+    if (req) release(req);
+}
+
+char *transport_request(cJSON *message, int timeout_ms) {
+    uint8_t *reply = NULL;
+    int id = transport_send(message, NULL, 0);
+    int len = id > 0 ? transport_wait(id, timeout_ms, &reply) : -1;
+
+    //an empty reply is the server having no answer
+    if (len <= 0 && reply) {
+        free(reply);
+        reply = NULL;
+    }
+    return (char *)reply;
+}
+
+int transport_request_bytes(cJSON *message, uint8_t *buf, size_t size, int timeout_ms) {
+    int id = transport_send(message, buf, size);
+    return id > 0 ? transport_wait(id, timeout_ms, NULL) : -1;
+}
+
+/**
+ * public apis
+ */
+void upip_set_transport(const upip_transport_t *transport) {
+    for (int i = 0; i < UPIP_TRANSPORT_SLOTS; i++) {
+        if (requests[i].state != REQUEST_FREE) release(&requests[i]);
+    }
+    rx_header_len = 0;
+    rx_request = NULL;
+    backend_set = transport != NULL;
+    if (transport) backend = *transport;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "cJSON.h"
@@ -7,7 +8,12 @@
 
 #include "upip.h"
 #include "upip_conf.h"
+#include "upip_internal.h"
 #include "lib/oofatfs/ff.h"
+
+#if CHUNK_HEADER_SIZE + CHUNK_SIZE > UPIP_TRANSPORT_MAX_REPLY
+#error "UPIP_TRANSPORT_MAX_REPLY is too small for a chunk reply"
+#endif
 /*
 #define CHUNK_SIZE                      8192  // 8 KB per chunk
 #define MAX_FILE_PATH                   64
@@ -18,59 +24,14 @@
 */
 
 /**
- * return from a function
- */
-#define RETURN_IF_ZERO(lvar, op) if (((lvar) = (op)) == 0) goto cleanup
-#define RETURN_IF_NULL(lvar, op) if (((lvar) = (op)) == NULL) goto cleanup
-#define RETURN_IF_FILE_ERROR(lvar, op) if (((lvar) = (op)) != FR_OK) goto cleanup
-
-/**
- * break out one level out of an inner block
+ * helper functions for doing fatfs fileio. json files are loaded by the streaming parser in jsonload.c
  */
-#define BREAK_IF_ZERO(lvar, op) if (((lvar) = (op)) == 0) break
-#define BREAK_IF_NULL(lvar, op) if (((lvar) = (op)) == NULL) break
-#define BREAK_IF_FILE_ERROR(lvar, op) if (((lvar) = (op)) != FR_OK) break
+FRESULT __f_save_json_to_file(FATFS *fs, const char *fname, cJSON **json) {
+    if (!json || !*json) return FR_INVALID_PARAMETER;
 
-/**
- * more specific macro for early return in executing Fatfs op sequence
- */
-#define FTRY(op) RETURN_IF_FILE_ERROR(op, res)
-
-/**
- * helper functions for doing fatfs fileio. 
- */
-static FRESULT __f_load_file_to_json(FATFS *fs, const char *fpath, cJSON **json) {    
-    FRESULT res;
+    FRESULT res = FR_NOT_ENOUGH_CORE;
     FIL file = {0};
-    FILINFO fno = {0};
-    UINT bytes_read;
-    
-    //FATFS * fs;
-    //const char *pout;
-    //__fs_fatfs_at_mount_point(FLASH_FS_ROOT_FS_PATH, &pout, &fs);
-
-    FTRY(f_stat(fs, fpath, &fno));
-
-    char *buf = NULL;
-    buf = malloc(fno.fsize + 1);
-
-    FTRY(f_open(fs, &file, fpath, FA_READ));
-    FTRY(f_read(&file, buf, fno.fsize, &bytes_read));
-
-    buf[bytes_read] = '\0'; 
-    *json = cJSON_Parse(buf);
-
-    res = FR_OK;
-cleanup:
-    f_close(&file); 
-    if(buf) free(buf);
-    return res;
-}
-
-static FRESULT __f_save_json_to_file(FATFS *fs, const char *fname, cJSON **json) {
-    if (!json || !*json) return;
-
-    FRESULT res;
+    UINT bw;
     //FATFS * fs;
     //const char *pout;
     //__fs_fatfs_at_mount_point(FLASH_FS_ROOT_FS_PATH, &pout, &fs);
@@ -78,22 +39,18 @@ static FRESULT __f_save_json_to_file(FATFS *fs, const char *fname, cJSON **json)
 
     char *string = cJSON_Print(*json);
     if (string) {
-        FIL file = {0};
-        UINT bw;
-
         FTRY(f_open(fs, &file, fname, FA_WRITE | FA_CREATE_ALWAYS));
         FTRY(f_write(&file, string, strlen(string), &bw));
 
         FTRY(f_sync(&file));
-
-        free(string);
     }
 cleanup:
     f_close(&file);
+    if(string) cJSON_free(string);
     return res;     
 }
 
-static FRESULT __f_rm_r(FATFS *fs, const char *path) {
+FRESULT __f_rm_r(FATFS *fs, const char *path) {
     FF_DIR dir;
     FILINFO fno;
     FRESULT res;
@@ -104,7 +61,8 @@ static FRESULT __f_rm_r(FATFS *fs, const char *path) {
     //mount delegated
     FTRY(f_opendir(fs, &dir, path));
     while (1) {
-        FTRY(f_readdir(&dir, &fno));
+        BREAK_IF_FILE_ERROR(res, f_readdir(&dir, &fno));
+        if (fno.fname[0] == '\0') break; //end of dir
 
         //skip . and ..
         if (strcmp(fno.fname, ".") == 0 || strcmp(fno.fname, "..") == 0) {
@@ -114,9 +72,9 @@ static FRESULT __f_rm_r(FATFS *fs, const char *path) {
         snprintf(full_path, sizeof(full_path), "%s/%s", path, fno.fname);
 
         if (fno.fattrib & AM_DIR) {
-            FTRY(fatfs_delete_recursive(fs, full_path)); //recurse into subdirs
+            BREAK_IF_FILE_ERROR(res, __f_rm_r(fs, full_path)); //recurse into subdirs
         } else {
-            FTRY(f_unlink(fs, full_path));
+            BREAK_IF_FILE_ERROR(res, f_unlink(fs, full_path));
         }
     }
 
@@ -128,337 +86,2070 @@ static FRESULT __f_rm_r(FATFS *fs, const char *path) {
 cleanup:
     return res;
 }
+
 /**
- * apis for managing installed_db state on disk. note that this function may be called from 
- * anywhere and must load the context it operates on . the wrapper functions is_installed and get_installed_version 
- * handle this case and load the context they operate on if executed standalone therefore they are the exposed apis
+ * client mutex, see upip_set_mutex
  */
- static bool _is_installed(FATFS* fs, const char *pkg_name, char **ver_out, cJSON *pkgs_installed) {
-    bool pkgs_db_in_memory = true; 
-    if (!pkgs_installed) {
-        pkgs_db_in_memory = false; 
-        __f_load_file_to_json(fs, INSTALLED_PKGS_DB_PATH, &pkgs_installed);
-    }
-    
-    cJSON *item = cJSON_GetObjectItemCaseSensitive(pkgs_installed, pkg_name);
-    bool result = cJSON_IsString(item) && item->valuestring;
-    
-    if (result && ver_out) {
-        *ver_out = strdup(item->valuestring);  //caller must free!
-    }
+static upip_mutex_t client_mutex;
+
+void upip_set_mutex(const upip_mutex_t *mutex) {
+    if (mutex) client_mutex = *mutex;
+    else memset(&client_mutex, 0, sizeof(client_mutex));
+}
+
+void mutex_take(void) {
+    if (client_mutex.take) client_mutex.take(client_mutex.ctx);
+}
+
+void mutex_give(void) {
+    if (client_mutex.give) client_mutex.give(client_mutex.ctx);
+}
+
+/**
+ * apis for managing installed_db state on disk. the database lives in pkgs.db (see pkgdb.c), a lookup
+ * reads only the records it probes and mark_installed / mark_uninstalled rewrite a single record in place
+ */
+static void recover_state(FATFS *fs);
+static FRESULT finish_upgrades(FATFS *fs, cJSON *upgrades);
+static FRESULT finish_moves(FATFS *fs, cJSON *moves);
 
-    if (!pkgs_db_in_memory) {
-        cJSON_Delete(pkgs_installed);
+static bool _is_installed(FATFS* fs, const char *pkg_name, char **ver_out) {
+    char version[PKGDB_VERSION_SIZE];
+    recover_state(fs);
+    bool result = pkgdb_lookup(fs, pkg_name, version, sizeof(version)) == FR_OK;
+
+    if (result && ver_out) {
+        *ver_out = strdup(version);  //caller must free!
     }
-    
     return result;
 }
 
-bool is_installed(FATFS *fs char *pkg_name) {
-    return _is_installed(fs, pkg_name, NULL, NULL);
+bool is_installed(FATFS *fs, const char *pkg_name) {
+    mutex_take();
+    bool result = _is_installed(fs, pkg_name, NULL);
+    mutex_give();
+    return result;
 }
 
 char *get_installed_version(FATFS *fs, const char *pkg_name) {
     char *ver = NULL;
-    if (_is_installed(fs, pkg_name, &ver, NULL)) {
-        return ver;  //caller must free!
-    }
-    return NULL;
+    mutex_take();
+    if (!_is_installed(fs, pkg_name, &ver)) ver = NULL;
+    mutex_give();
+    return ver;  //caller must free!
 }
 
-static void mark_installed(const char *name, const char *version, cJSON *pkgs_installed) {
-    if (!name || !version || !pkgs_installed) {
-        return;
+static bool mark_installed(FATFS *fs, const char *name, const char *version) {
+    if (!name || !version) {
+        return false;
     }
-    cJSON_DeleteItemFromObjectCaseSensitive(pkgs_installed, name);
-    cJSON_AddStringToObject(pkgs_installed, name, version);
+    return pkgdb_set(fs, name, version) == FR_OK;
 }
 
-static void mark_uninstalled(const char *name, cJSON *pkgs_installed) {
-    if (!name || !pkgs_installed) {
-        return;
+static bool mark_uninstalled(FATFS *fs, const char *name) {
+    if (!name) {
+        return false;
     }
-    cJSON_DeleteItemFromObjectCaseSensitive(pkgs_installed, name);
+    return pkgdb_remove(fs, name) == FR_OK;
 }
 
 /**
- * helpers
+ * journal glue. pkgs.db and deps.db are updated in place once a transaction commits, the journal is
+ * cut when it grows past UPIP_JOURNAL_COMPACT_SIZE. adding an edge that exists, removing one that
+ * does not and writing a version that is already set change nothing, so replaying records that
+ * were already applied leaves the state unchanged. an upgrade whose files are not all swapped in
+ * yet and a package still in the staging dir are collected and finished once the replay is through
  */
-static void ensure_package_entry(cJSON *root, const char *name) {
-    if (!cJSON_HasObjectItem(root, name)) {
-        cJSON_AddItemToObject(root, name, cJSON_CreateArray());
+typedef struct {
+    FATFS *fs;
+    depgraph_t *graph;          //NULL to skip dependency records
+    bool apply_pkgdb;
+    FRESULT res;                //first failure of the replay
+    cJSON *upgrades;            //name -> "from to" of every JOURNAL_UPGRADE without its JOURNAL_UPGRADED
+    cJSON *moves;               //name of every JOURNAL_MOVE_IN without its JOURNAL_MOVED_IN
+} journal_apply_ctx_t;
+
+static void apply_journal_record(char op, const char *a, const char *b, void *arg) {
+    journal_apply_ctx_t *ctx = arg;
+    char version[PKGDB_VERSION_SIZE];
+    FRESULT res = FR_OK;
+
+    switch (op) {
+    case JOURNAL_INSTALLED:
+        if (ctx->apply_pkgdb && b) {
+            //skip the write when recovery finds the record already applied
+            if (pkgdb_lookup(ctx->fs, a, version, sizeof(version)) != FR_OK || strcmp(version, b) != 0) {
+                if (!mark_installed(ctx->fs, a, b)) res = FR_DENIED;
+            }
+        }
+        break;
+    case JOURNAL_UNINSTALLED:
+        if (ctx->apply_pkgdb) mark_uninstalled(ctx->fs, a);
+        if (ctx->graph) res = depgraph_remove_node(ctx->graph, a);
+        break;
+    case JOURNAL_RDEP_ADD:
+        if (ctx->graph && b) res = depgraph_add_edge(ctx->graph, b, a);
+        break;
+    case JOURNAL_RDEP_REMOVE:
+        if (ctx->graph && b) res = depgraph_remove_edge(ctx->graph, b, a);
+        break;
+    case JOURNAL_UPGRADE:
+        if (ctx->upgrades && b) {
+            cJSON_DeleteItemFromObject(ctx->upgrades, a);
+            cJSON_AddStringToObject(ctx->upgrades, a, b);
+        }
+        break;
+    case JOURNAL_UPGRADED:
+        if (ctx->upgrades) cJSON_DeleteItemFromObject(ctx->upgrades, a);
+        break;
+    case JOURNAL_MOVE_IN:
+        if (ctx->moves) {
+            cJSON_DeleteItemFromObject(ctx->moves, a);
+            cJSON_AddTrueToObject(ctx->moves, a);
+        }
+        break;
+    case JOURNAL_MOVED_IN:
+        if (ctx->moves) cJSON_DeleteItemFromObject(ctx->moves, a);
+        break;
+    default:
+        break;
     }
-}
 
-static void remove_item_from_array(cJSON *array, const char *value) {
-    int index = 0;
-    cJSON *item = NULL;
-    cJSON_ArrayForEach(item, array) {
-        if (strcmp(item->valuestring, value) == 0) {
-            cJSON_DeleteItemFromArray(array, index);
-            return;
-        }
-        index++;
+    if (res != FR_OK) {
+        ESP_LOGE(TAG, "Failed to apply journal record %c %s: %d", op, a, res);
+        if (ctx->res == FR_OK) ctx->res = res;
     }
 }
 
+//applies transactions that committed before a power loss but never reached the databases, once per boot
+static bool state_recovered = false;
+
+static void recover_state(FATFS *fs) {
+    if (state_recovered) return;
+    depgraph_t graph;
+    if (depgraph_open(fs, &graph, true) != FR_OK) return;
+
+    journal_apply_ctx_t ctx = {fs, &graph, true, FR_OK, cJSON_CreateObject(), cJSON_CreateObject()};
+    state_recovered = journal_recover(fs, apply_journal_record, &ctx) == FR_OK && ctx.res == FR_OK;
+    depgraph_close(&graph);
+    //an install or an upgrade that committed but lost power while its files were moved in
+    if (state_recovered && finish_moves(fs, ctx.moves) != FR_OK) state_recovered = false;
+    if (state_recovered && finish_upgrades(fs, ctx.upgrades) != FR_OK) state_recovered = false;
+    cJSON_Delete(ctx.moves);
+    cJSON_Delete(ctx.upgrades);
+}
 
 /**
- * apis for managing upips installed packages reverse dep tree
+ * commits the journal transaction, pkgs.db and deps.db are updated from the committed records. the
+ * journal is cut once it grows past UPIP_JOURNAL_COMPACT_SIZE and every record in it was applied
  */
-static cJSON *get_reverse_dependencies(const char *name, cJSON *pkgs_rdt) {
-    cJSON *deps = cJSON_GetObjectItemCaseSensitive(pkgs_rdt, name);
-    if (!deps || !cJSON_IsArray(deps)) {
-        return cJSON_CreateArray(); //return empty array if not found
+static FRESULT commit_changes(FATFS *fs, journal_t *journal) {
+    FRESULT res;
+    depgraph_t graph = {0};
+    journal_apply_ctx_t ctx = {fs, &graph, true, FR_OK, cJSON_CreateObject(), cJSON_CreateObject()};
+    uint32_t started = stats_phase_begin(UPIP_PHASE_COMMIT);
+
+    FTRY(depgraph_open(fs, &graph, true));
+    FTRY(journal_commit(journal, apply_journal_record, &ctx));
+    depgraph_close(&graph);
+    if (ctx.res == FR_OK) ctx.res = finish_moves(fs, ctx.moves);
+    if (ctx.res == FR_OK) ctx.res = finish_upgrades(fs, ctx.upgrades);
+    //a record that failed to apply or a move or swap left halfway is finished by the next recovery, so the journal keeps it
+    if (ctx.res != FR_OK) state_recovered = false;
+    else if (journal_size(fs) >= UPIP_JOURNAL_COMPACT_SIZE) {
+        //records a session holds in RAM only are written back before the journal lets go of them
+        if (pkgdb_sync(fs) != FR_OK || journal_reset(fs) != FR_OK) ESP_LOGE(TAG, "Journal compaction failed");
     }
 
-    cJSON *result = cJSON_Duplicate(deps, 1);
-    return result;
+cleanup:
+    depgraph_close(&graph);
+    if (ctx.moves) cJSON_Delete(ctx.moves);
+    if (ctx.upgrades) cJSON_Delete(ctx.upgrades);
+    stats_phase_end(UPIP_PHASE_COMMIT, started, res == FR_OK);
+    return res;
 }
 
-static void add_reverse_dependency(const char *dependency, const char *dependent, cJSON *pkgs_rdt) {
-    ensure_package_entry(pkgs_rdt, dependency);
-    ensure_package_entry(pkgs_rdt, dependent);
+/**
+ * sessions. the journal keeps every record a session has not written back, so a flush that fails
+ * or a power loss before it leaves them to the next recovery
+ */
+struct upip_ctx {
+    FATFS *fs;
+};
 
-    cJSON *array = cJSON_GetObjectItemCaseSensitive(pkgs_rdt, dependency);
+static upip_ctx_t *session = NULL;
 
-    cJSON *item;
-    cJSON_ArrayForEach(item, array) {
-        if (strcmp(item->valuestring, dependent) == 0) {
-            return; 
-        }
+upip_ctx_t *upip_ctx_open(FATFS *fs) {
+    upip_ctx_t *ctx = NULL;
+
+    mutex_take();
+    if (session) {
+        ESP_LOGE(TAG, "A session is open already");
+        goto cleanup;
+    }
+    RETURN_IF_NULL(ctx, malloc(sizeof(*ctx)));
+
+    recover_state(fs); //pkgs.db is read once it has every committed record
+    if (pkgdb_attach(fs) != FR_OK) {
+        ESP_LOGE(TAG, "Failed to load the package database");
+        free(ctx);
+        ctx = NULL;
+        goto cleanup;
     }
+    ctx->fs = fs;
+    session = ctx;
 
-    cJSON_AddItemToArray(array, cJSON_CreateString(dependent));
+cleanup:
+    mutex_give();
+    return ctx;
 }
 
-static void remove_reverse_dependency(const char *dependency, const char *dependent, cJSON *pkgs_rdt) {
-    cJSON *array = cJSON_GetObjectItemCaseSensitive(pkgs_rdt, dependency);
-    if (array && cJSON_IsArray(array)) {
-        remove_item_from_array(array, dependent);
+bool upip_ctx_flush(upip_ctx_t *ctx) {
+    bool ok = false;
+
+    mutex_take();
+    if (!ctx || ctx != session) goto cleanup;
+    ok = pkgdb_sync(ctx->fs) == FR_OK;
+    if (!ok) {
+        ESP_LOGE(TAG, "Failed to write back the package database");
+        state_recovered = false;
     }
+
+cleanup:
+    mutex_give();
+    return ok;
 }
 
-static int has_reverse_dependencies(const char *name, cJSON *pkgs_rdt) {
-    cJSON *array = cJSON_GetObjectItemCaseSensitive(pkgs_rdt, name);
-    int result = (array && cJSON_GetArraySize(array) > 0) ? 1 : 0;
-    return result;
+bool upip_ctx_close(upip_ctx_t *ctx) {
+    bool ok = false;
+
+    mutex_take();
+    if (!ctx || ctx != session) goto cleanup;
+    ok = upip_ctx_flush(ctx);
+    pkgdb_detach();
+    session = NULL;
+    free(ctx);
+
+cleanup:
+    mutex_give();
+    return ok;
 }
 
 /**
- * procedure for downloading package from repository in a given filesystem fd
- * files stored on the server are assumed to be utf8 encoded .note that this function 
- * changes the state of the filesystem i.e writes new files and changes cwd to that of the newly installed package
- * 
- * TODO: preserve the state of fs before pkg installation
+ * download sink. everything received for a file goes through sink_write, which hashes the bytes on their
+ * way to f_write and records a checkpoint (file index, durable offset, running hash) in the staging dir
+ * every UPIP_CHECKPOINT_INTERVAL bytes. an interrupted download resumes from the last checkpoint
  */
-static bool upip_download_pkg(FATFS *fs, const char *package, const char *version, FRESULT *fres_out) {
-    bool ret = false;
-    cJSON *request = NULL;
-    cJSON *metadata = NULL;
-    char *pkg_chunk = NULL; 
-    cJSON *pkg_chunk_json = NULL;    
-
-    RETURN_IF_NULL(metadata, (repo_get_metadata(package, version)));
+typedef struct {
+    char magic[4];
+    char version[PKGDB_VERSION_SIZE];
+    uint32_t file_index;
+    uint32_t offset;
+    sha256_ctx_t hash;
+} download_checkpoint_t;
+
+typedef struct {
+    FATFS *fs;
+    FIL file;
+    const char *version;
+    const char *checkpoint;     //path of the checkpoint file, NULL when not resumable
+    uint32_t index;
+    uint32_t offset;            //bytes written to file
+    uint32_t checkpointed;      //offset of the last checkpoint
+    uint32_t received;          //bytes of the transfer accepted, the encoded size for compressed files
+    sha256_ctx_t hash;
+    bool resumable;             //write checkpoints, off for files that are not downloaded in place
+    lzss_t *decoder;            //set while a compressed file is received
+    FRESULT *decode_fres;
+    uint32_t store_ms;          //time spent storing decoder output
+} file_sink_t;
+
+static upip_transfer_stats_t transfer_stats;
+
+void upip_transfer_get_stats(upip_transfer_stats_t *out) {
+    *out = transfer_stats;
+}
 
-    cJSON *files = cJSON_GetObjectItem(metadata, "files");
-    int file_count;
-    RETURN_IF_ZERO(file_count, (cJSON_GetArraySize(files)));
+void upip_transfer_reset_stats(void) {
+    memset(&transfer_stats, 0, sizeof(transfer_stats));
+}
 
-    request = cJSON_CreateObject();
-    cJSON_AddStringToObject(request, "method", "getFileChunk");
-    cJSON_AddStringToObject(request, "filename", "");
-    cJSON_AddNumberToObject(request, "offset", 0);
-    cJSON_AddNumberToObject(request, "length", CHUNK_SIZE);
+static void sink_rewind(file_sink_t *sink) {
+    sink->offset = sink->checkpointed = sink->received = 0;
+    sha256_init(&sink->hash);
+}
 
-    
+static FRESULT save_checkpoint(file_sink_t *sink) {
+    FRESULT res;
+    FIL file = {0};
     UINT bw;
-    //FRESULT res;
-    //FATFS * fs;
-    //const char *pout;
-    //RETURN_IF_FILE_ERROR((*fres_out), __fs_fatfs_at_mount_point(FLASH_FS_ROOT_FS_PATH, &pout, &fs)); //pout? possiblity of memory leakage!
+    download_checkpoint_t ckpt = {{'U', 'P', 'C', 'K'}, {0}, sink->index, sink->offset, sink->hash};
+    snprintf(ckpt.version, sizeof(ckpt.version), "%s", sink->version);
 
-    //change into the upip_pkgs dir, 
-    //then into the package folder to reconstruct the package files
-    RETURN_IF_FILE_ERROR((*fres_out), (f_chdir(fs, UPIP_PKGS_BASE_PATH)));
-    RETURN_IF_FILE_ERROR((*fres_out), (f_mkdir(fs, package)));
-    RETURN_IF_FILE_ERROR((*fres_out), (f_chdir(fs, package)));
+    FTRY(f_open(sink->fs, &file, sink->checkpoint, FA_WRITE | FA_OPEN_ALWAYS));
+    FTRY(f_write(&file, &ckpt, sizeof(ckpt), &bw));
+    FTRY(f_sync(&file));
+    sink->checkpointed = sink->offset;
+cleanup:
+    f_close(&file);
+    return res;
+}
+
+static bool load_checkpoint(FATFS *fs, const char *path, const char *version, download_checkpoint_t *ckpt) {
+    FIL file = {0};
+    UINT br = 0;
+    if (f_open(fs, &file, path, FA_READ) != FR_OK) return false;
+    f_read(&file, ckpt, sizeof(*ckpt), &br);
+    f_close(&file);
+    return br == sizeof(*ckpt) && memcmp(ckpt->magic, "UPCK", 4) == 0 && strncmp(ckpt->version, version, PKGDB_VERSION_SIZE) == 0;
+}
 
-    for (int i = 0; i < file_count; i++) {
-        cJSON *file = cJSON_GetArrayItem(files, i);
-        const char *filename = cJSON_GetObjectItem(file, "filename")->valuestring;
-        int total_size = cJSON_GetObjectItem(file, "size")->valueint;
+//writes file content, hashing it and checkpointing resumable files
+static bool sink_store(file_sink_t *sink, const void *data, UINT len, FRESULT *fres_out) {
+    UINT bw = 0;
+    uint32_t started = stats_phase_begin(UPIP_PHASE_WRITE);
+    *fres_out = f_write(&sink->file, data, len, &bw);
+    stats_phase_end(UPIP_PHASE_WRITE, started, *fres_out == FR_OK && bw == len);
+    stats_add_written(bw);
+    if (*fres_out != FR_OK || bw != len) return false;
+
+    sha256_update(&sink->hash, data, len);
+    sink->offset += len;
+    transfer_stats.file_bytes += len;
+
+    if (sink->resumable && sink->offset - sink->checkpointed >= UPIP_CHECKPOINT_INTERVAL) {
+        //the data must be durable before the checkpoint points past it
+        if ((*fres_out = f_sync(&sink->file)) != FR_OK) return false;
+        if ((*fres_out = save_checkpoint(sink)) != FR_OK) return false;
+    }
+    return true;
+}
 
-        FIL file;
-        RETURN_IF_FILE_ERROR((*fres_out), (f_open(fs, &file, filename, FA_WRITE | FA_CREATE_ALWAYS)));
-        int current_offset = 0;
-        bool success = false;
+static bool sink_decoded(const void *data, UINT len, void *arg) {
+    file_sink_t *sink = arg;
+    uint32_t started = upip_client_millis();
+    bool ok = sink_store(sink, data, len, sink->decode_fres);
+    sink->store_ms += upip_client_millis() - started;
+    transfer_stats.compressed_file_bytes += len;
+    return ok;
+}
 
-        while (current_offset < total_size) {
-            cJSON_ReplaceItemInObject(request, "filename", cJSON_CreateString(filename));
-            cJSON_ReplaceItemInObject(request, "offset", cJSON_CreateNumber(current_offset));
+//takes the bytes of the transfer, compressed files pass through the decoder on their way to sink_store
+static bool sink_write(file_sink_t *sink, const void *data, UINT len, FRESULT *fres_out) {
+    sink->received += len;
+    transfer_stats.wire_bytes += len;
+    if (!sink->decoder) return sink_store(sink, data, len, fres_out);
+
+    uint32_t started = upip_client_millis();
+    uint32_t store_ms = sink->store_ms;
+    sink->decode_fres = fres_out;
+    bool ok = lzss_feed(sink->decoder, data, len);
+    transfer_stats.decode_ms += (upip_client_millis() - started) - (sink->store_ms - store_ms);
+    transfer_stats.compressed_wire_bytes += len;
+    return ok;
+}
 
-            int remaining = total_size - current_offset;
-            int chunk_size = (remaining < CHUNK_SIZE) ? remaining : CHUNK_SIZE;
-            cJSON_ReplaceItemInObject(request, "length", cJSON_CreateNumber(chunk_size));
+//compares the streamed hash against the lowercase hex sha256 from GET_META, files without one pass
+static bool sink_verify(file_sink_t *sink, const char *expected) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    if (!expected) return true;
 
-            BREAK_IF_NULL(pkg_chunk, (upip_client_request_await_response(request, MEDIUM_TIMEOUT)));
-            BREAK_IF_NULL(pkg_chunk_json, (cJSON_Parse(pkg_chunk)));
-            free(pkg_chunk);
-            pkg_chunk = NULL; 
+    sha256_ctx_t hash = sink->hash;
+    sha256_final(&hash, digest);
+    sha256_hex(digest, hex);
+    return strcmp(hex, expected) == 0;
+}
 
-            if (!cJSON_GetObjectItem(pkg_chunk_json, "success")->valueint) {
-                const char *error = cJSON_GetStringValue(cJSON_GetObjectItem(pkg_chunk_json, "message"));
-                ESP_LOGE(TAG, "Server error: %s", error);
-                break;
-            }
-            
-            cJSON *result = cJSON_GetObjectItem(pkg_chunk_json, "result");
-            const char *code_chunk = cJSON_GetObjectItem(result, "data")->valuestring
+/**
+ * compressed transfer. GET_META marks a file compressed with "encoding": "lzss" plus its encoded_size and
+ * the window and lookahead bits it was encoded with, chunk requests then ask for the encoded bytes and
+ * their offsets count in the encoded stream. such a file is fetched again from the start after an
+ * interruption, only uncompressed files resume mid-file
+ */
+#if UPIP_BINARY_CHUNKS && UPIP_COMPRESSED_TRANSFER
+#define COMPRESSED_TRANSFER 1
+#else
+#define COMPRESSED_TRANSFER 0
+#endif
 
-            int code_len = strlen(code_chunk);
-            BREAK_IF_FILE_ERROR((*fres_out), (f_write(&file, code_chunk, code_len, &bw)));
-            if (bw != code_len) {
-                break;
-            }
+/**
+ * chunk requests. one request object per package naming the package and version the file belongs to,
+ * its other fields are updated in place before each send
+ */
+typedef struct {
+    cJSON *root;
+    cJSON *filename;
+    cJSON *offset;
+    cJSON *length;
+    cJSON *encoding;
+} chunk_request_t;
+
+static bool chunk_request_init(chunk_request_t *req, const char *package, const char *version) {
+    req->root = cJSON_CreateObject();
+    if (!req->root) return false;
+    cJSON_AddStringToObject(req->root, "method", UPIP_BINARY_CHUNKS ? "getFileChunkBin" : "getFileChunk");
+    cJSON_AddStringToObject(req->root, "package", package);
+    cJSON_AddStringToObject(req->root, "version", version);
+    req->filename = cJSON_AddStringToObject(req->root, "filename", "");
+    req->offset = cJSON_AddNumberToObject(req->root, "offset", 0);
+    req->length = cJSON_AddNumberToObject(req->root, "length", CHUNK_SIZE);
+    cJSON_AddNumberToObject(req->root, "id", 0); //before any arena mark, transport_send only updates it
+#if COMPRESSED_TRANSFER
+    req->encoding = cJSON_AddStringToObject(req->root, "encoding", "identity");
+    if (!req->encoding) return false;
+#endif
+    return req->filename && req->offset && req->length;
+}
+
+static void chunk_request_set(chunk_request_t *req, uint32_t offset, uint32_t length) {
+    cJSON_SetNumberValue(req->offset, offset);
+    cJSON_SetNumberValue(req->length, length);
+}
+
+//points the request and sink at the next file, transfer_size is what has to be fetched for it
+static bool chunk_request_file(chunk_request_t *req, file_sink_t *sink, cJSON *file_meta, lzss_t **decoder, uint32_t *transfer_size) {
+    cJSON_SetValuestring(req->filename, cJSON_GetObjectItem(file_meta, "filename")->valuestring);
+    *transfer_size = (uint32_t)cJSON_GetObjectItem(file_meta, "size")->valueint;
+    sink->decoder = NULL;
+    transfer_stats.files++;
+
+#if COMPRESSED_TRANSFER
+    const char *encoding = cJSON_GetStringValue(cJSON_GetObjectItem(file_meta, "encoding"));
+    if (encoding && strcmp(encoding, "lzss") == 0) {
+        cJSON *encoded_size = cJSON_GetObjectItem(file_meta, "encoded_size");
+        cJSON *window = cJSON_GetObjectItem(file_meta, "window");
+        cJSON *lookahead = cJSON_GetObjectItem(file_meta, "lookahead");
+        if (!cJSON_IsNumber(encoded_size) || !cJSON_IsNumber(window) || !cJSON_IsNumber(lookahead)) return false;
+
+        if (!*decoder && !(*decoder = malloc(sizeof(lzss_t)))) return false;
+        if (!lzss_init(*decoder, (uint8_t)window->valueint, (uint8_t)lookahead->valueint, sink_decoded, sink)) {
+            ESP_LOGE(TAG, "Unsupported lzss parameters %d/%d", window->valueint, lookahead->valueint);
+            return false;
+        }
+        sink->decoder = *decoder;
+        *transfer_size = (uint32_t)encoded_size->valueint;
+        transfer_stats.compressed_files++;
+    }
+    cJSON_SetValuestring(req->encoding, sink->decoder ? "lzss" : "identity");
+#else
+    (void)decoder;
+#endif
+    return true;
+}
+
+#if UPIP_BINARY_CHUNKS
+/**
+ * sliding window receiver. getFileChunkBin replies carry a CHUNK_HEADER_SIZE byte header (little endian
+ * offset:u32, length:u32, status:u8, 3 reserved bytes) followed by length raw bytes, or by an error
+ * message when status is not CHUNK_STATUS_OK. up to download_window requests are in flight, the transport
+ * receives each reply straight into the buffer of its slot and they are written out in offset order.
+ * a slot whose reply does not arrive within MEDIUM_TIMEOUT is cancelled and re-sent on its own, a late
+ * reply to the cancelled request is dropped by the transport
+ */
+enum { CHUNK_FREE, CHUNK_IN_FLIGHT, CHUNK_RECEIVED };
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t sent;
+    uint32_t deadline;
+    int request;                //transport id of the request in flight
+    uint8_t retries;
+    uint8_t state;
+    uint8_t worker;             //download worker the slot was sent for
+} chunk_slot_t;
+
+typedef struct {
+    chunk_slot_t slots[UPIP_DOWNLOAD_WINDOW_MAX];
+    int size;
+} chunk_window_t;
+
+static int download_window = UPIP_DOWNLOAD_WINDOW;
+
+void upip_set_download_window(int slots) {
+    if (slots < 1) slots = 1;
+    if (slots > UPIP_DOWNLOAD_WINDOW_MAX) slots = UPIP_DOWNLOAD_WINDOW_MAX;
+    download_window = slots;
+}
+
+static void chunk_window_free(chunk_window_t *w) {
+    for (int i = 0; i < w->size; i++) {
+        if (w->slots[i].buf) free(w->slots[i].buf);
+    }
+    memset(w, 0, sizeof(*w));
+}
+
+static bool chunk_window_init(chunk_window_t *w) {
+    memset(w, 0, sizeof(*w));
+    w->size = download_window;
+    for (int i = 0; i < w->size; i++) {
+        w->slots[i].buf = malloc(CHUNK_HEADER_SIZE + CHUNK_SIZE);
+        if (!w->slots[i].buf) break;
+    }
+    if (!w->slots[w->size - 1].buf) {
+        chunk_window_free(w);
+        return false;
+    }
+    return true;
+}
 
-            cJSON_Delete(pkg_chunk_json);
-            pkg_chunk_json = NULL; 
+static bool send_chunk(chunk_request_t *req, chunk_slot_t *slot) {
+    chunk_request_set(req, slot->offset, slot->length);
+    slot->request = transport_send(req->root, slot->buf, CHUNK_HEADER_SIZE + CHUNK_SIZE);
+    if (slot->request < 0) return false;
+    slot->state = CHUNK_IN_FLIGHT;
+    slot->sent = stats_phase_begin(UPIP_PHASE_CHUNK);
+    slot->deadline = slot->sent + MEDIUM_TIMEOUT;
+    return true;
+}
+
+//takes the reply to request into its slot, false only on a server error
+static bool accept_chunk(chunk_window_t *w, int request) {
+    chunk_slot_t *slot = NULL;
+    for (int i = 0; i < w->size && !slot; i++) {
+        if (w->slots[i].state == CHUNK_IN_FLIGHT && w->slots[i].request == request) slot = &w->slots[i];
+    }
+    if (!slot) return true; //not a chunk of this window
+
+    int received = transport_take(request, NULL);
+    uint32_t chunk_offset = upip_get_le32(slot->buf);
+    uint32_t chunk_len = upip_get_le32(slot->buf + 4);
+    uint8_t status = slot->buf[8];
+    if (received < CHUNK_HEADER_SIZE || chunk_offset != slot->offset) {
+        slot->deadline = upip_client_millis(); //malformed, re-sent right away
+        return true;
+    }
+
+    if (status != CHUNK_STATUS_OK) {
+        ESP_LOGE(TAG, "Server error: %.*s", received - CHUNK_HEADER_SIZE, (const char *)slot->buf + CHUNK_HEADER_SIZE);
+        stats_phase_end(UPIP_PHASE_CHUNK, slot->sent, false);
+        slot->state = CHUNK_FREE;
+        return false;
+    }
+    if (chunk_len != slot->length || chunk_len != (uint32_t)(received - CHUNK_HEADER_SIZE)) {
+        slot->deadline = upip_client_millis();
+        return true;
+    }
+
+    slot->state = CHUNK_RECEIVED;
+    stats_phase_end(UPIP_PHASE_CHUNK, slot->sent, true);
+    stats_add_received(chunk_len);
+    return true;
+}
+
+//how long a receive may wait, no longer than the earliest deadline and not at all with nothing in flight
+static int window_wait_ms(const chunk_window_t *w) {
+    uint32_t now = upip_client_millis();
+    int wait_ms = -1;
+    for (int i = 0; i < w->size; i++) {
+        if (w->slots[i].state != CHUNK_IN_FLIGHT) continue;
+        int32_t left = (int32_t)(w->slots[i].deadline - now);
+        if (left < 0) left = 0;
+        if (wait_ms < 0 || left < wait_ms) wait_ms = left < MEDIUM_TIMEOUT ? left : MEDIUM_TIMEOUT;
+    }
+    return wait_ms < 0 ? 0 : wait_ms;
+}
+
+//frees a slot whose reply is overdue, false once it ran out of re-sends
+static bool chunk_expired(chunk_slot_t *slot) {
+    stats_phase_end(UPIP_PHASE_CHUNK, slot->sent, false);
+    transport_cancel(slot->request);
+    slot->state = CHUNK_FREE;
+    if (slot->retries++ >= UPIP_CHUNK_RETRIES) {
+        ESP_LOGE(TAG, "Chunk at offset %u timed out", (unsigned)slot->offset);
+        return false;
+    }
+    stats_add_retry();
+    return true;
+}
+
+static void window_reset(chunk_window_t *w) {
+    for (int i = 0; i < w->size; i++) {
+        if (w->slots[i].state == CHUNK_IN_FLIGHT) {
+            stats_phase_end(UPIP_PHASE_CHUNK, w->slots[i].sent, false);
+            transport_cancel(w->slots[i].request);
+        }
+        w->slots[i].state = CHUNK_FREE;
+    }
+}
+
+static bool download_file(chunk_request_t *req, file_sink_t *sink, uint32_t total_size, chunk_window_t *w, FRESULT *fres_out) {
+    uint32_t next_send = sink->received;
+    uint32_t next_write = sink->received;
+    bool ret = false;
 
-            current_offset += chunk_size;
-            success = true; 
+    while (next_write < total_size) {
+        //keep the window full
+        for (int i = 0; i < w->size && next_send < total_size; i++) {
+            chunk_slot_t *slot = &w->slots[i];
+            if (slot->state != CHUNK_FREE) continue;
+            slot->offset = next_send;
+            slot->length = (total_size - next_send < CHUNK_SIZE) ? total_size - next_send : CHUNK_SIZE;
+            slot->retries = 0;
+            if (!send_chunk(req, slot)) goto cleanup;
+            next_send += slot->length;
         }
 
-        f_sync(&file);
-        f_close(&file);
+        int request = transport_poll(window_wait_ms(w));
+        if (request < 0 || (request > 0 && !accept_chunk(w, request))) goto cleanup;
+
+        //re-send the chunks that timed out
+        uint32_t now = upip_client_millis();
+        for (int i = 0; i < w->size; i++) {
+            chunk_slot_t *slot = &w->slots[i];
+            if (slot->state != CHUNK_IN_FLIGHT || (int32_t)(now - slot->deadline) < 0) continue;
+            if (!chunk_expired(slot) || !send_chunk(req, slot)) goto cleanup;
+        }
 
-        if (!success) {
-            //ESP_LOGE(TAG, "Download failed for file: %s", filename);
-            //upip_client_stop();  // Optional: cancel ongoing transfer
+        //write out whatever continues the file
+        for (int i = 0; i < w->size; i++) {
+            chunk_slot_t *slot = &w->slots[i];
+            if (slot->state != CHUNK_RECEIVED || slot->offset != next_write) continue;
 
-            //back up and intermediate files
-            RETURN_IF_FILE_ERROR((*fres_out), (f_chdir(fs, "..")));
-            __f_rm_r(fs, package);
-            ret = false;
-            break; 
+            if (!sink_write(sink, slot->buf + CHUNK_HEADER_SIZE, slot->length, fres_out)) goto cleanup;
+            next_write += slot->length;
+            slot->state = CHUNK_FREE;
+            i = -1; //rescan, the next chunk may sit in an earlier slot
         }
-       ret = true;  
     }
-    
-    //f_chdir(fs, FLASH_FS_ROOT_FS_PATH); //restore cwd to fs root
+    ret = true;
 
 cleanup:
-    if(pkg_chunk) free(pkg_chunk);
-    if(request) cJSON_Delete(request);
-    if(metadata) cJSON_Delete(metadata);
-    if(pkg_chunk_json) cJSON_Delete(pkg_chunk_json);
+    window_reset(w);
     return ret;
 }
+#else
+typedef struct {
+    int size;
+} chunk_window_t;
+
+static bool chunk_window_init(chunk_window_t *w) {
+    w->size = 1;
+    return true;
+}
 
+static void chunk_window_free(chunk_window_t *w) {
+    (void)w;
+}
 
-bool install_package(FATFS *fs, const char *name, const char *constraint) {
-    bool ret = false; 
-    cJSON *plan = NULL;
-    cJSON *pkgs_installed = NULL;
-    cJSON *pkgs_revdeptree = NULL;
+void upip_set_download_window(int slots) {
+    (void)slots; //JSON chunks are fetched one at a time
+}
+
+static bool fetch_chunk(chunk_request_t *req, file_sink_t *sink, FRESULT *fres_out) {
+    bool ret = false;
+    char *pkg_chunk = NULL;
+    cJSON *pkg_chunk_json = NULL;
+    size_t mark = cjson_arena_mark();
+    uint32_t started = stats_phase_begin(UPIP_PHASE_CHUNK);
 
-    __f_load_file_to_json(fs, INSTALLED_PKGS_DB_PATH, &pkgs_installed );
-    __f_load_file_to_json(fs, REV_DEPS_TREE_FILE_PATH, &pkgs_revdeptree);
-    if(!pkgs_installed || !pkgs_revdeptree) goto cleanup;
+    RETURN_IF_NULL(pkg_chunk, (transport_request(req->root, MEDIUM_TIMEOUT)));
+    RETURN_IF_NULL(pkg_chunk_json, (cJSON_Parse(pkg_chunk)));
 
-    RETURN_IF_NULL(plan, (resolve((char *)name, constraint)));
+    if (!cJSON_IsTrue(cJSON_GetObjectItem(pkg_chunk_json, "success"))) {
+        const char *error = cJSON_GetStringValue(cJSON_GetObjectItem(pkg_chunk_json, "message"));
+        ESP_LOGE(TAG, "Server error: %s", error ? error : "");
+        goto cleanup;
+    }
+
+    cJSON *result = cJSON_GetObjectItem(pkg_chunk_json, "result");
+    const char *code_chunk = cJSON_GetStringValue(cJSON_GetObjectItem(result, "data"));
+    if (!code_chunk) goto cleanup;
+
+    stats_add_received(strlen(code_chunk));
+    ret = sink_write(sink, code_chunk, strlen(code_chunk), fres_out);
+
+cleanup:
+    stats_phase_end(UPIP_PHASE_CHUNK, started, ret);
+    if(pkg_chunk) free(pkg_chunk);
+    if(pkg_chunk_json) cJSON_Delete(pkg_chunk_json);
+    cjson_arena_release(mark); //one reply per chunk, nothing of it survives
+    return ret;
+}
+
+static bool download_file(chunk_request_t *req, file_sink_t *sink, uint32_t total_size, chunk_window_t *w, FRESULT *fres_out) {
+    (void)w;
+    while (sink->received < total_size) {
+        uint32_t remaining = total_size - sink->received;
+        chunk_request_set(req, sink->received, remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE);
+        if (!fetch_chunk(req, sink, fres_out)) return false;
+    }
+    return true;
+}
+#endif
+
+#if UPIP_BATCHED_RESOLVE
+#define PREFETCH_WINDOW     (UPIP_META_CACHE_ENTRIES < MAX_RESOLVE_BATCH ? UPIP_META_CACHE_ENTRIES : MAX_RESOLVE_BATCH)
 
+//the next plan entries to download without metadata at hand, for one RESOLVE_BATCH instead of a GET_META each
+static cJSON *plan_metadata_batch(FATFS *fs, cJSON *plan, int from, const char *upgrade) {
+    cJSON *batch = cJSON_CreateArray();
     int count = cJSON_GetArraySize(plan);
-    for (int i = 0; i < count; i++) {
+
+    for (int i = from; i < count && cJSON_GetArraySize(batch) < PREFETCH_WINDOW; i++) {
         cJSON *pkg = cJSON_GetArrayItem(plan, i);
         const char *pkg_name = cJSON_GetObjectItem(pkg, "name")->valuestring;
         const char *pkg_version = cJSON_GetObjectItem(pkg, "version")->valuestring;
+        if (upgrade && strcmp(pkg_name, upgrade) == 0) continue;
+        if (meta_cache_has(pkg_name, pkg_version) || _is_installed(fs, pkg_name, NULL)) continue;
+        cJSON_AddItemToArray(batch, cJSON_Duplicate(pkg, 1));
+    }
+    return batch;
+}
 
-        if (!_is_installed(fs, pkg_name, NULL, pkgs_installed)) {
-            if (!upip_download_pkg(pkg_name, pkg_version)) {
-                fprintf(stderr, "Failed to install %s@%s\n", pkg_name, pkg_version);
-                goto cleanup;
-            }
+static void prefetch_plan_metadata(FATFS *fs, cJSON *plan, int from, const char *upgrade) {
+    cJSON *batch = plan_metadata_batch(fs, plan, from, upgrade);
+    //a single package costs the same round trip either way
+    if (cJSON_GetArraySize(batch) > 1) repo_prefetch_metadata(batch);
+    cJSON_Delete(batch);
+}
+#endif
 
-            mark_installed(pkg_name, pkg_version, pkgs_installed);
+/**
+ * download workers. every package of a plan that is not installed yet is fetched into its own dir under
+ * STAGING_DIR_PATH and moved in by install_staged once their install committed. files are checked against
+ * the sha256 listed for them in GET_META while they stream in. a failed download leaves the staging dir and its
+ * checkpoint behind, the next attempt for the same version skips the files that completed and continues the
+ * interrupted one from its last checkpoint, a package that completed is not fetched again
+ */
+enum { WORKER_IDLE, WORKER_BUSY };
+
+typedef struct {
+    uint8_t index;
+    uint8_t state;
+    const char *package;
+    const char *version;
+    cJSON *metadata;
+    cJSON *files;
+    int file_count;
+    int file;                   //index of the file being received
+    chunk_request_t request;
+    file_sink_t sink;
+    bool sink_open;
+    lzss_t *decoder;            //kept from one package to the next
+    uint32_t transfer_size;
+    uint32_t next_send;
+    uint32_t next_write;
+    char dir[128];
+    char checkpoint[128];
+} download_worker_t;
+
+static int download_workers = UPIP_DOWNLOAD_WORKERS;
+
+void upip_set_download_workers(int workers) {
+    if (workers < 1) workers = 1;
+    if (workers > UPIP_DOWNLOAD_WORKERS_MAX) workers = UPIP_DOWNLOAD_WORKERS_MAX;
+    download_workers = workers;
+}
 
-            //add reverse dep if not root package
-            for (int j = 0; j < count; j++) {
-                if (j != i) {
-                    const char *dependent = cJSON_GetObjectItem(cJSON_GetArrayItem(plan, j), "name")->valuestring;
-                    add_reverse_dependency(pkg_name, dependent, pkgs_revdeptree);
-                }
-            }
-        }
+static void staging_path(char *out, size_t len, const char *package, const char *filename) {
+    if (filename) snprintf(out, len, "%s/%s/%s", STAGING_DIR_PATH, package, filename);
+    else snprintf(out, len, "%s/%s", STAGING_DIR_PATH, package);
+}
+
+static void worker_release(download_worker_t *wk) {
+    if (wk->sink_open) f_close(&wk->sink.file);
+    wk->sink_open = false;
+    if (wk->request.root) cJSON_Delete(wk->request.root);
+    if (wk->metadata) cJSON_Delete(wk->metadata);
+    wk->request.root = NULL;
+    wk->metadata = NULL;
+    wk->state = WORKER_IDLE;
+}
+
+//interrupts the download of a worker, the file it was receiving resumes from its checkpoint next time
+static void worker_stop(download_worker_t *wk) {
+    if (wk->state == WORKER_BUSY && wk->sink_open) {
+        f_sync(&wk->sink.file);
+        f_close(&wk->sink.file);
+        wk->sink_open = false;
+        if (!wk->sink.resumable) sink_rewind(&wk->sink);
+        save_checkpoint(&wk->sink);
+    }
+    worker_release(wk);
+}
+
+//opens the next file of the package, past the last one the worker is done with it
+static bool worker_next_file(FATFS *fs, download_worker_t *wk, const download_checkpoint_t *ckpt, FRESULT *fres_out) {
+    bool ret = false;
+    char path[128];
+
+    if (wk->file >= wk->file_count) {
+        //kept while it is at hand, committing the plan reads it back for the dependency edges
+        meta_cache_put(wk->package, wk->version, wk->metadata);
+        meta_cache_persist(fs, wk->package, wk->version);
+        worker_release(wk);
+        return true;
     }
-    
-    __f_save_json_to_file(fs, INSTALLED_PKGS_DB_PATH, &pkgs_installed);
-    __f_save_json_to_file(fs, REV_DEPS_TREE_FILE_PATH, pkgs_revdeptree);
 
-    ret= true;
+    cJSON *file_meta = cJSON_GetArrayItem(wk->files, wk->file);
+    staging_path(path, sizeof(path), wk->package, cJSON_GetObjectItem(file_meta, "filename")->valuestring);
+    if (!chunk_request_file(&wk->request, &wk->sink, file_meta, &wk->decoder, &wk->transfer_size)) goto cleanup;
+    wk->sink.resumable = !wk->sink.decoder;
+    wk->sink.index = wk->file;
+
+    if (ckpt && ckpt->offset > 0 && wk->sink.resumable) {
+        //resume: drop whatever was written past the checkpoint
+        RETURN_IF_FILE_ERROR((*fres_out), (f_open(fs, &wk->sink.file, path, FA_WRITE | FA_OPEN_ALWAYS)));
+        wk->sink_open = true;
+        RETURN_IF_FILE_ERROR((*fres_out), (f_lseek(&wk->sink.file, ckpt->offset)));
+        RETURN_IF_FILE_ERROR((*fres_out), (f_truncate(&wk->sink.file)));
+        wk->sink.offset = wk->sink.checkpointed = wk->sink.received = ckpt->offset;
+        wk->sink.hash = ckpt->hash;
+    } else {
+        RETURN_IF_FILE_ERROR((*fres_out), (f_open(fs, &wk->sink.file, path, FA_WRITE | FA_CREATE_ALWAYS)));
+        wk->sink_open = true;
+        sink_rewind(&wk->sink);
+    }
+    wk->next_send = wk->next_write = wk->sink.received;
+    ret = true;
 
 cleanup:
-    if(plan) cJSON_Delete(plan);
-    if(pkgs_installed) cJSON_Delete(pkgs_installed);
-    if(pkgs_revdeptree) cJSON_Delete(pkgs_revdeptree);
-    return ret; 
+    return ret;
 }
 
-bool uninstall_package(FATFS *fs, const char *pkg_name) {
-    bool ret = false;
-    char *version = NULL;  
-    cJSON *pkgs_installed = NULL;
-    cJSON *pkgs_revdeptree = NULL;
+//closes a file that arrived in full and moves on to the next one, false when it does not match its hash
+static bool worker_finish_file(FATFS *fs, download_worker_t *wk, FRESULT *fres_out) {
+    cJSON *file_meta = cJSON_GetArrayItem(wk->files, wk->file);
+    const char *filename = cJSON_GetObjectItem(file_meta, "filename")->valuestring;
+    int total_size = cJSON_GetObjectItem(file_meta, "size")->valueint;
+    const char *sha256 = cJSON_GetStringValue(cJSON_GetObjectItem(file_meta, "sha256"));
+
+    f_sync(&wk->sink.file);
+    f_close(&wk->sink.file);
+    wk->sink_open = false;
+
+    if (wk->sink.offset != (uint32_t)total_size || !sink_verify(&wk->sink, sha256)) {
+        char path[128];
+        ESP_LOGE(TAG, "Hash mismatch for %s/%s", wk->package, filename);
+        staging_path(path, sizeof(path), wk->package, filename);
+        f_unlink(fs, path);
+        sink_rewind(&wk->sink);
+        save_checkpoint(&wk->sink); //refetch this file from scratch next time
+        return false;
+    }
 
-    __f_load_file_to_json(fs, INSTALLED_PKGS_DB_PATH, &pkgs_installed );
-    if (!_is_installed(fs, pkg_name, &version, pkgs_installed)){
-        ret = true;
+    //completed files are never fetched again, a checkpoint past the last file marks the package complete
+    wk->sink.index = ++wk->file;
+    sink_rewind(&wk->sink);
+    save_checkpoint(&wk->sink);
+    return worker_next_file(fs, wk, NULL, fres_out);
+}
+
+static bool worker_start(FATFS *fs, download_worker_t *wk, cJSON *entry, FRESULT *fres_out) {
+    bool ret = false;
+    download_checkpoint_t ckpt = {0};
+
+    wk->package = cJSON_GetObjectItem(entry, "name")->valuestring;
+    wk->version = cJSON_GetObjectItem(entry, "version")->valuestring;
+    RETURN_IF_NULL(wk->metadata, (meta_cache_get(fs, wk->package, wk->version)));
+    wk->files = cJSON_GetObjectItem(wk->metadata, "files");
+    RETURN_IF_ZERO(wk->file_count, (cJSON_GetArraySize(wk->files)));
+    if (!chunk_request_init(&wk->request, wk->package, wk->version)) goto cleanup;
+
+    *fres_out = f_mkdir(fs, STAGING_DIR_PATH);
+    if (*fres_out != FR_OK && *fres_out != FR_EXIST) goto cleanup;
+    staging_path(wk->dir, sizeof(wk->dir), wk->package, NULL);
+    staging_path(wk->checkpoint, sizeof(wk->checkpoint), wk->package, CHECKPOINT_FILE_NAME);
+    *fres_out = f_mkdir(fs, wk->dir);
+    if (*fres_out == FR_EXIST && !load_checkpoint(fs, wk->checkpoint, wk->version, &ckpt)) {
+        //leftovers of another version, start clean
+        RETURN_IF_FILE_ERROR((*fres_out), (__f_rm_r(fs, wk->dir)));
+        RETURN_IF_FILE_ERROR((*fres_out), (f_mkdir(fs, wk->dir)));
+    } else if (*fres_out != FR_OK && *fres_out != FR_EXIST) {
         goto cleanup;
     }
+    *fres_out = FR_OK;
 
-    __f_load_file_to_json(fs, REV_DEPS_TREE_FILE_PATH, &pkgs_revdeptree );
-    if(!pkgs_installed || !pkgs_revdeptree) goto cleanup;
+    memset(&wk->sink, 0, sizeof(wk->sink));
+    wk->sink.fs = fs;
+    wk->sink.version = wk->version;
+    wk->sink.checkpoint = wk->checkpoint;
+    wk->file = (int)ckpt.file_index;
+    wk->state = WORKER_BUSY;
+    ret = worker_next_file(fs, wk, &ckpt, fres_out);
 
-    if (has_reverse_dependencies(pkg_name, pkgs_revdeptree)) {
-        fprintf(stderr, "Cannot uninstall %s: still required by other packages.\n", pkg_name);
+cleanup:
+    if (!ret) worker_release(wk);
+    return ret;
+}
+
+/**
+ * moves a downloaded package out of the staging dir once its install committed, over the leftovers of
+ * an older copy. a package without a staged dir was moved in before a power loss cut the install short
+ */
+static FRESULT install_staged(FATFS *fs, const char *package) {
+    FRESULT res;
+    FILINFO fno;
+    char staged[128];
+    char installed[128];
+
+    staging_path(staged, sizeof(staged), package, NULL);
+    snprintf(installed, sizeof(installed), "%s%s", UPIP_PKGS_BASE_PATH, package);
+    res = f_stat(fs, staged, &fno);
+    if (res == FR_OK) {
+        res = __f_rm_r(fs, installed);
+        if (res != FR_OK && res != FR_NO_PATH && res != FR_NO_FILE) goto cleanup;
+        FTRY(f_rename(fs, staged, installed));
+    } else if (res != FR_NO_PATH && res != FR_NO_FILE) {
         goto cleanup;
     }
 
-    cJSON *meta = repo_get_metadata(pkg_name, version);
-    if (!meta) goto cleanup;
+    snprintf(installed, sizeof(installed), "%s%s/%s", UPIP_PKGS_BASE_PATH, package, CHECKPOINT_FILE_NAME);
+    f_unlink(fs, installed);
+    res = FR_OK;
 
-    // Remove actual files (abstracted)
-    //remove_package_files(pkg_name);
-    __f_rm_r(fs, pkg_name);
+cleanup:
+    return res;
+}
 
-    cJSON *deps = cJSON_GetObjectItem(meta, "dependencies");
-    if (deps && cJSON_IsArray(deps)) {
-        cJSON *dep = NULL;
-        cJSON_ArrayForEach(dep, deps) {
-            const char *dep_name = cJSON_GetObjectItem(dep, "name")->valuestring;
-            remove_reverse_dependency(dep_name, pkg_name, pkgs_revdeptree);
+/**
+ * a download runs in steps so that an operation can return to its caller in between. up to
+ * download_workers packages are received at once, all of them by the calling task through the one chunk
+ * window: the workers take turns for free slots, so a worker draining the window at the end of a file or
+ * a package leaves the slots to the others instead of to an idle link. metadata is fetched before a
+ * package is handed out. when it is not in RAM a RESOLVE_BATCH for it goes out beside the chunks in
+ * flight and the package waits for the reply while the other workers keep the window busy. without
+ * batched resolve the window is drained first and GET_META runs on its own
+ */
+enum { STEP_MORE, STEP_DONE, STEP_FAILED };
+
+typedef struct {
+    cJSON *packages;
+    download_worker_t *workers;
+    download_worker_t *failed;
+    chunk_window_t window;
+    int n;
+    int count;
+    int next;                   //first package not handed out yet
+    int turn;                   //worker first in line for a free slot
+    int meta_request;           //transport id of the metadata asked for beside the chunks, 0 for none
+    int meta_for;               //package it was asked for, asked once, the next attempt waits for the window
+    unsigned long bytes;        //transfer bytes written out
+    const char *current;        //package handed out last
+} download_t;
+
+static bool downloads_init(download_t *d, cJSON *packages) {
+    memset(d, 0, sizeof(*d));
+    d->packages = packages;
+    d->meta_for = -1;
+    d->count = cJSON_GetArraySize(packages);
+    if (d->count == 0) return true;
+
+#if UPIP_BINARY_CHUNKS
+    d->n = download_workers < d->count ? download_workers : d->count;
+#else
+    d->n = 1;
+#endif
+    d->workers = calloc(d->n, sizeof(*d->workers));
+    if (!d->workers) return false;
+    for (int k = 0; k < d->n; k++) d->workers[k].index = (uint8_t)k;
+    return chunk_window_init(&d->window);
+}
+
+//an unfinished download is interrupted, its files resume from their checkpoints next time
+static void downloads_free(download_t *d) {
+    if (d->failed) fprintf(stderr, "Failed to install %s@%s\n", d->failed->package, d->failed->version);
+#if UPIP_BINARY_CHUNKS
+    window_reset(&d->window);
+#endif
+    if (d->meta_request > 0) transport_cancel(d->meta_request);
+    d->meta_request = 0;
+    for (int k = 0; d->workers && k < d->n; k++) {
+        worker_stop(&d->workers[k]);
+        if (d->workers[k].decoder) free(d->workers[k].decoder);
+    }
+    chunk_window_free(&d->window);
+    if (d->workers) free(d->workers);
+    d->workers = NULL;
+}
+
+//hands the next package to an idle worker, false when its metadata has to wait for the window to drain
+static bool downloads_hand_out(FATFS *fs, download_t *d, download_worker_t *wk, bool window_busy, FRESULT *fres_out, bool *ok) {
+    cJSON *entry = cJSON_GetArrayItem(d->packages, d->next);
+    const char *pkg_name = cJSON_GetObjectItem(entry, "name")->valuestring;
+    const char *pkg_version = cJSON_GetObjectItem(entry, "version")->valuestring;
+
+    *ok = true;
+    if (!meta_cache_has(pkg_name, pkg_version)) {
+#if UPIP_BATCHED_RESOLVE
+        if (window_busy && d->meta_for != d->next) {
+            cJSON *batch = plan_metadata_batch(fs, d->packages, d->next, NULL);
+            d->meta_request = repo_send_metadata_request(batch);
+            d->meta_for = d->next;
+            cJSON_Delete(batch);
         }
+        if (window_busy) return false;
+        if (d->meta_request > 0) {
+            repo_metadata_result(d->meta_request); //what is left of the wait
+            d->meta_request = 0;
+        } else if (d->meta_for != d->next) {
+            prefetch_plan_metadata(fs, d->packages, d->next, NULL);
+        }
+#else
+        if (window_busy) return false;
+#endif
+    }
+    d->next++;
+    d->current = pkg_name;
+    if (!worker_start(fs, wk, entry, fres_out)) {
+        d->failed = wk;
+        *ok = false;
     }
+    return true;
+}
 
-    mark_uninstalled(pkg_name, pkgs_installed);
+#if UPIP_BINARY_CHUNKS
+//wait_ms bounds the wait for replies, negative waits up to the earliest deadline
+static int downloads_step(FATFS *fs, download_t *d, int wait_ms, FRESULT *fres_out) {
+    int busy = 0;
+    bool starved = false;
+    bool in_flight = false;
+    bool ok;
+
+    for (int i = 0; i < d->window.size; i++) in_flight |= d->window.slots[i].state == CHUNK_IN_FLIGHT;
+
+    //hand out the next packages, a package may turn out complete from an earlier attempt
+    for (int k = 0; k < d->n; k++) {
+        download_worker_t *wk = &d->workers[k];
+        while (wk->state == WORKER_IDLE && d->next < d->count && !starved) {
+            starved = !downloads_hand_out(fs, d, wk, in_flight, fres_out, &ok);
+            if (!ok) return STEP_FAILED;
+        }
+        if (wk->state == WORKER_BUSY) busy++;
+    }
+    if (busy == 0) return STEP_DONE;
+
+    //keep the window full, the workers take turns. a hand out starved without its metadata on the way lets it drain instead
+    bool drain = starved && d->meta_request <= 0;
+    for (int i = 0; i < d->window.size && !drain; i++) {
+        chunk_slot_t *slot = &d->window.slots[i];
+        if (slot->state != CHUNK_FREE) continue;
+
+        download_worker_t *wk = NULL;
+        for (int t = 0; t < d->n && !wk; t++) {
+            download_worker_t *candidate = &d->workers[(d->turn + t) % d->n];
+            if (candidate->state == WORKER_BUSY && candidate->next_send < candidate->transfer_size) wk = candidate;
+        }
+        if (!wk) break;
+        d->turn = (wk->index + 1) % d->n;
+
+        uint32_t remaining = wk->transfer_size - wk->next_send;
+        slot->offset = wk->next_send;
+        slot->length = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+        slot->retries = 0;
+        slot->worker = wk->index;
+        if (!send_chunk(&wk->request, slot)) {
+            d->failed = wk;
+            return STEP_FAILED;
+        }
+        wk->next_send += slot->length;
+    }
 
-    //recursively remove orphaned dependencies
-    if (deps && cJSON_IsArray(deps)) {
-        cJSON *dep = NULL;
-        cJSON_ArrayForEach(dep, deps) {
-            const char *dep_name = cJSON_GetObjectItem(dep, "name")->valuestring;
-            if (!has_reverse_dependencies(dep_name, pkgs_revdeptree)) {
-                uninstall_package(dep_name);
+    int wait = window_wait_ms(&d->window);
+    if (wait_ms >= 0 && wait_ms < wait) wait = wait_ms;
+    int request = transport_poll(wait);
+    if (request < 0) return STEP_FAILED;
+    if (request > 0 && request == d->meta_request) {
+        repo_metadata_result(request); //a failure leaves the package to GET_META once the window drained
+        d->meta_request = 0;
+    } else if (request > 0 && !accept_chunk(&d->window, request)) {
+        return STEP_FAILED;
+    }
+
+    //re-send the chunks that timed out
+    uint32_t now = upip_client_millis();
+    for (int i = 0; i < d->window.size; i++) {
+        chunk_slot_t *slot = &d->window.slots[i];
+        if (slot->state != CHUNK_IN_FLIGHT || (int32_t)(now - slot->deadline) < 0) continue;
+        if (!chunk_expired(slot) || !send_chunk(&d->workers[slot->worker].request, slot)) {
+            d->failed = &d->workers[slot->worker];
+            return STEP_FAILED;
+        }
+    }
+
+    //write out whatever continues the files
+    for (int i = 0; i < d->window.size; i++) {
+        chunk_slot_t *slot = &d->window.slots[i];
+        download_worker_t *wk = &d->workers[slot->worker];
+        if (slot->state != CHUNK_RECEIVED || slot->offset != wk->next_write) continue;
+
+        if (!sink_write(&wk->sink, slot->buf + CHUNK_HEADER_SIZE, slot->length, fres_out)) {
+            d->failed = wk;
+            return STEP_FAILED;
+        }
+        wk->next_write += slot->length;
+        d->bytes += slot->length;
+        slot->state = CHUNK_FREE;
+        i = -1; //rescan, the next chunk may sit in an earlier slot
+    }
+    for (int k = 0; k < d->n; k++) {
+        download_worker_t *wk = &d->workers[k];
+        while (wk->state == WORKER_BUSY && wk->next_write >= wk->transfer_size) {
+            if (!worker_finish_file(fs, wk, fres_out)) {
+                d->failed = wk;
+                return STEP_FAILED;
             }
         }
     }
-    __f_save_json_to_file(fs, INSTALLED_PKGS_DB_PATH, pkgs_installed);
-    __f_save_json_to_file(fs, REV_DEPS_TREE_FILE_PATH, pkgs_revdeptree);
-    ret = true; 
+    return STEP_MORE;
+}
+#else
+//JSON chunks are fetched one at a time, so is every package. each step is one blocking round trip
+static int downloads_step(FATFS *fs, download_t *d, int wait_ms, FRESULT *fres_out) {
+    download_worker_t *wk = d->workers;
+    bool ok;
+    (void)wait_ms;
+
+    if (d->count == 0 || (wk->state == WORKER_IDLE && d->next == d->count)) return STEP_DONE;
+    if (wk->state == WORKER_IDLE) {
+        downloads_hand_out(fs, d, wk, false, fres_out, &ok);
+        return ok ? STEP_MORE : STEP_FAILED;
+    }
 
-cleanup:   
-    if(meta) cJSON_Delete(plan);
-    if(pkgs_installed) cJSON_Delete(pkgs_installed);
-    if(pkgs_revdeptree) cJSON_Delete(pkgs_revdeptree);
-    return ret; 
+    if (wk->sink.received < wk->transfer_size) {
+        uint32_t received = wk->sink.received;
+        uint32_t remaining = wk->transfer_size - received;
+        chunk_request_set(&wk->request, received, remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE);
+        if (!fetch_chunk(&wk->request, &wk->sink, fres_out)) {
+            d->failed = wk;
+            return STEP_FAILED;
+        }
+        d->bytes += wk->sink.received - received;
+        return STEP_MORE;
+    }
+    if (!worker_finish_file(fs, wk, fres_out)) {
+        d->failed = wk;
+        return STEP_FAILED;
+    }
+    return STEP_MORE;
+}
+#endif
+
+static bool download_packages(FATFS *fs, cJSON *packages, FRESULT *fres_out) {
+    download_t d;
+    int rc = STEP_FAILED;
+    if (downloads_init(&d, packages)) {
+        while ((rc = downloads_step(fs, &d, -1, fres_out)) == STEP_MORE) {}
+    }
+    downloads_free(&d);
+    return rc == STEP_DONE;
+}
+
+/**
+ * upgrades. every file of the new version is rebuilt next to the installed one as <file>.new, from a
+ * binary patch against the installed file where the server has one and by a full download otherwise.
+ * once all of them are complete and verified the upgrade journals JOURNAL_UPGRADE, and only after its
+ * transaction committed are the new files swapped in, followed by a JOURNAL_UPGRADED transaction. a
+ * power loss in between leaves the swap to the next recovery, which finishes it from the .new files
+ */
+#if UPIP_BINARY_CHUNKS && UPIP_DELTA_UPGRADES
+enum { DELTA_APPLIED, DELTA_UNAVAILABLE, DELTA_FAILED };
+
+typedef struct {
+    file_sink_t *sink;
+    FRESULT *fres_out;
+} patch_sink_arg_t;
+
+static bool patch_to_sink(const void *data, UINT len, void *arg) {
+    patch_sink_arg_t *a = arg;
+    return sink_store(a->sink, data, len, a->fres_out);
+}
+
+/**
+ * getFileDelta replies use the getFileChunkBin framing. the patch is fetched in CHUNK_SIZE pieces until a
+ * short one and applied as it arrives. CHUNK_STATUS_NO_DELTA on the first piece means there is no patch
+ */
+static int fetch_delta(const char *package, const char *filename, const char *from, const char *to, FIL *src, file_sink_t *sink, uint8_t *rx_buf, FRESULT *fres_out) {
+    int ret = DELTA_FAILED;
+    patch_t patch;
+    patch_sink_arg_t arg = {sink, fres_out};
+    uint32_t offset = 0;
+
+    cJSON *request = cJSON_CreateObject();
+    if (!request) return DELTA_FAILED;
+    cJSON_AddStringToObject(request, "method", "getFileDelta");
+    cJSON_AddStringToObject(request, "package", package);
+    cJSON_AddStringToObject(request, "filename", filename);
+    cJSON_AddStringToObject(request, "from", from);
+    cJSON_AddStringToObject(request, "to", to);
+    cJSON *req_offset = cJSON_AddNumberToObject(request, "offset", 0);
+    cJSON_AddNumberToObject(request, "length", CHUNK_SIZE);
+    cJSON_AddNumberToObject(request, "id", 0);
+
+    patch_init(&patch, src, patch_to_sink, &arg);
+    while (1) {
+        cJSON_SetNumberValue(req_offset, offset);
+        uint32_t started = stats_phase_begin(UPIP_PHASE_CHUNK);
+        int received = transport_request_bytes(request, rx_buf, CHUNK_HEADER_SIZE + CHUNK_SIZE, MEDIUM_TIMEOUT);
+        stats_phase_end(UPIP_PHASE_CHUNK, started, received >= CHUNK_HEADER_SIZE);
+        if (received < CHUNK_HEADER_SIZE) break;
+        stats_add_received((size_t)(received - CHUNK_HEADER_SIZE));
+
+        uint32_t chunk_len = upip_get_le32(rx_buf + 4);
+        uint8_t status = rx_buf[8];
+        if (status == CHUNK_STATUS_NO_DELTA && offset == 0) {
+            ret = DELTA_UNAVAILABLE;
+            break;
+        }
+        if (status != CHUNK_STATUS_OK || upip_get_le32(rx_buf) != offset || chunk_len != (uint32_t)(received - CHUNK_HEADER_SIZE)) break;
+        if (!patch_feed(&patch, rx_buf + CHUNK_HEADER_SIZE, chunk_len)) break;
+
+        offset += chunk_len;
+        if (chunk_len < CHUNK_SIZE) {
+            ret = patch_done(&patch) ? DELTA_APPLIED : DELTA_FAILED;
+            break;
+        }
+    }
+
+    cJSON_Delete(request);
+    return ret;
+}
+#endif
+
+static bool meta_has_file(cJSON *meta, const char *filename) {
+    cJSON *file_meta = NULL;
+    cJSON_ArrayForEach(file_meta, cJSON_GetObjectItem(meta, "files")) {
+        const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(file_meta, "filename"));
+        if (name && strcmp(name, filename) == 0) return true;
+    }
+    return false;
+}
+
+static void upgrade_tmp_name(char *out, size_t len, const char *filename) {
+    snprintf(out, len, "%s%s", filename, UPGRADE_TMP_SUFFIX);
+}
+
+static bool upgrade_files(FATFS *fs, const char *package, const char *from, const char *to, FRESULT *fres_out) {
+    bool ret = false;
+    cJSON *old_meta = NULL;
+    cJSON *new_meta = NULL;
+    chunk_request_t request = {0};
+    chunk_window_t window = {0};
+    file_sink_t sink = {0};
+    bool sink_open = false;
+    char tmp_name[MAX_FILE_PATH];
+    int prepared = 0;
+    lzss_t *decoder = NULL;
+    cJSON *files = NULL;
+    int file_count = 0;
+
+    RETURN_IF_NULL(new_meta, (meta_cache_get(fs, package, to)));
+    old_meta = meta_cache_get(fs, package, from); //without it every file is fetched in full
+
+    files = cJSON_GetObjectItem(new_meta, "files");
+    file_count = cJSON_GetArraySize(files);
+    if (!chunk_request_init(&request, package, to) || !chunk_window_init(&window)) goto cleanup;
+
+    RETURN_IF_FILE_ERROR((*fres_out), (f_chdir(fs, UPIP_PKGS_BASE_PATH)));
+    RETURN_IF_FILE_ERROR((*fres_out), (f_chdir(fs, package)));
+
+    sink.fs = fs;
+    sink.version = to;
+    sink.resumable = false;
+
+    for (; prepared < file_count; prepared++) {
+        cJSON *file_meta = cJSON_GetArrayItem(files, prepared);
+        const char *filename = cJSON_GetObjectItem(file_meta, "filename")->valuestring;
+        int total_size = cJSON_GetObjectItem(file_meta, "size")->valueint;
+        const char *sha256 = cJSON_GetStringValue(cJSON_GetObjectItem(file_meta, "sha256"));
+
+        upgrade_tmp_name(tmp_name, sizeof(tmp_name), filename);
+        RETURN_IF_FILE_ERROR((*fres_out), (f_open(fs, &sink.file, tmp_name, FA_WRITE | FA_CREATE_ALWAYS)));
+        sink_open = true;
+        sink_rewind(&sink);
+        bool patched = false;
+
+#if UPIP_BINARY_CHUNKS && UPIP_DELTA_UPGRADES
+        FIL src = {0};
+        if (old_meta && meta_has_file(old_meta, filename) && f_open(fs, &src, filename, FA_READ) == FR_OK) {
+            patched = fetch_delta(package, filename, from, to, &src, &sink, window.slots[0].buf, fres_out) == DELTA_APPLIED;
+            f_close(&src);
+            if (!patched) {
+                //drop partial patch output before the full download
+                RETURN_IF_FILE_ERROR((*fres_out), (f_lseek(&sink.file, 0)));
+                RETURN_IF_FILE_ERROR((*fres_out), (f_truncate(&sink.file)));
+                sink_rewind(&sink);
+            }
+        }
+#endif
+        if (!patched) {
+            uint32_t transfer_size;
+            if (!chunk_request_file(&request, &sink, file_meta, &decoder, &transfer_size)) goto cleanup;
+            if (!download_file(&request, &sink, transfer_size, &window, fres_out)) goto cleanup;
+        }
+
+        f_sync(&sink.file);
+        f_close(&sink.file);
+        sink_open = false;
+
+        if (sink.offset != (uint32_t)total_size || !sink_verify(&sink, sha256)) {
+            ESP_LOGE(TAG, "Upgraded %s/%s failed verification", package, filename);
+            goto cleanup;
+        }
+    }
+
+    ret = true; //everything is verified, the swap waits for the commit
+
+cleanup:
+    if(sink_open) f_close(&sink.file);
+    for (int i = 0; !ret && i <= prepared && i < file_count; i++) {
+        upgrade_tmp_name(tmp_name, sizeof(tmp_name), cJSON_GetObjectItem(cJSON_GetArrayItem(files, i), "filename")->valuestring);
+        f_unlink(fs, tmp_name);
+    }
+    if(decoder) free(decoder);
+    chunk_window_free(&window);
+    if(request.root) cJSON_Delete(request.root);
+    if(old_meta) cJSON_Delete(old_meta);
+    if(new_meta) cJSON_Delete(new_meta);
+    return ret;
+}
+
+//moves <file>.new over file, a file without one was moved in already
+static FRESULT swap_in_file(FATFS *fs, const char *package, const char *filename) {
+    char path[128];
+    char tmp_path[128 + sizeof(UPGRADE_TMP_SUFFIX)];
+    FILINFO fno;
+
+    snprintf(path, sizeof(path), "%s%s/%s", UPIP_PKGS_BASE_PATH, package, filename);
+    upgrade_tmp_name(tmp_path, sizeof(tmp_path), path);
+    FRESULT res = f_stat(fs, tmp_path, &fno);
+    if (res == FR_NO_FILE) return FR_OK;
+    if (res != FR_OK) return res;
+    res = f_unlink(fs, path);
+    if (res != FR_OK && res != FR_NO_FILE) return res;
+    return f_rename(fs, tmp_path, path);
+}
+
+//every .new file in the package dir, the dir is read again after each rename
+static FRESULT swap_in_leftovers(FATFS *fs, const char *package) {
+    FRESULT res;
+    FF_DIR dir;
+    FILINFO fno;
+    char dir_path[128];
+    char filename[sizeof(fno.fname)];
+    size_t suffix_len = strlen(UPGRADE_TMP_SUFFIX);
+
+    snprintf(dir_path, sizeof(dir_path), "%s%s", UPIP_PKGS_BASE_PATH, package);
+    while (1) {
+        filename[0] = '\0';
+        FTRY(f_opendir(fs, &dir, dir_path));
+        while ((res = f_readdir(&dir, &fno)) == FR_OK && fno.fname[0] != '\0') {
+            size_t len = strlen(fno.fname);
+            if (len > suffix_len && strcmp(fno.fname + len - suffix_len, UPGRADE_TMP_SUFFIX) == 0) {
+                snprintf(filename, sizeof(filename), "%.*s", (int)(len - suffix_len), fno.fname);
+                break;
+            }
+        }
+        f_closedir(&dir);
+        if (res != FR_OK || filename[0] == '\0') break;
+        FTRY(swap_in_file(fs, package, filename));
+    }
+cleanup:
+    return res;
+}
+
+/**
+ * swaps the verified files of package@to in and drops the ones only from shipped. doing it again
+ * changes nothing. without the metadata of to, after a power loss with UPIP_META_CACHE_PERSIST off,
+ * every .new file in the package dir is taken and files of from are left
+ */
+static FRESULT swap_upgraded_files(FATFS *fs, const char *package, const char *from, const char *to) {
+    FRESULT res = FR_OK;
+    char path[128];
+    cJSON *new_meta = meta_cache_peek(fs, package, to);
+    cJSON *old_meta = NULL;
+    cJSON *file_meta = NULL;
+    if (!new_meta) return swap_in_leftovers(fs, package);
+
+    cJSON_ArrayForEach(file_meta, cJSON_GetObjectItem(new_meta, "files")) {
+        FTRY(swap_in_file(fs, package, cJSON_GetObjectItem(file_meta, "filename")->valuestring));
+    }
+    old_meta = meta_cache_peek(fs, package, from);
+    cJSON_ArrayForEach(file_meta, cJSON_GetObjectItem(old_meta, "files")) {
+        const char *filename = cJSON_GetStringValue(cJSON_GetObjectItem(file_meta, "filename"));
+        if (!filename || meta_has_file(new_meta, filename)) continue;
+        snprintf(path, sizeof(path), "%s%s/%s", UPIP_PKGS_BASE_PATH, package, filename);
+        f_unlink(fs, path);
+    }
+
+cleanup:
+    if (old_meta) cJSON_Delete(old_meta);
+    cJSON_Delete(new_meta);
+    return res;
+}
+
+//the swaps of committed upgrades, each one is marked done in a transaction of its own
+static FRESULT finish_upgrades(FATFS *fs, cJSON *upgrades) {
+    FRESULT res = FR_OK;
+    journal_t journal = {0};
+    cJSON *item = NULL;
+
+    cJSON_ArrayForEach(item, upgrades) {
+        char from[2 * PKGDB_VERSION_SIZE];
+        snprintf(from, sizeof(from), "%s", item->valuestring);
+        char *to = strchr(from, ' ');
+        if (!to) continue;
+        *to++ = '\0';
+
+        FTRY(swap_upgraded_files(fs, item->string, from, to));
+        FTRY(journal_begin(fs, &journal));
+        FTRY(journal_append(&journal, JOURNAL_UPGRADED, item->string, NULL));
+        FTRY(journal_commit(&journal, NULL, NULL));
+    }
+
+cleanup:
+    journal_abort(&journal);
+    if (res != FR_OK) ESP_LOGE(TAG, "Failed to swap in the files of upgraded %s: %d", item->string, res);
+    return res;
+}
+
+//the staged packages of committed installs, each one is marked moved in a transaction of its own
+static FRESULT finish_moves(FATFS *fs, cJSON *moves) {
+    FRESULT res = FR_OK;
+    journal_t journal = {0};
+    cJSON *item = NULL;
+
+    cJSON_ArrayForEach(item, moves) {
+        FTRY(install_staged(fs, item->string));
+        FTRY(journal_begin(fs, &journal));
+        FTRY(journal_append(&journal, JOURNAL_MOVED_IN, item->string, NULL));
+        FTRY(journal_commit(&journal, NULL, NULL));
+    }
+
+cleanup:
+    journal_abort(&journal);
+    if (res != FR_OK) ESP_LOGE(TAG, "Failed to move in the staged files of %s: %d", item->string, res);
+    return res;
+}
+
+static const char *plan_version(cJSON *plan, const char *name) {
+    cJSON *pkg = NULL;
+    cJSON_ArrayForEach(pkg, plan) {
+        if (strcmp(cJSON_GetObjectItem(pkg, "name")->valuestring, name) == 0) {
+            return cJSON_GetObjectItem(pkg, "version")->valuestring;
+        }
+    }
+    return NULL;
+}
+
+static bool lists_dependency(cJSON *deps, const char *name) {
+    cJSON *dep = NULL;
+    cJSON_ArrayForEach(dep, deps) {
+        if (strcmp(cJSON_GetObjectItem(dep, "name")->valuestring, name) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * journals an edge from pkg to every dependency of version to, with from set the edges to
+ * dependencies only the old version had are removed. the metadata was fetched for the download
+ */
+static bool journal_dependency_edges(FATFS *fs, journal_t *journal, const char *pkg, const char *from, const char *to) {
+    bool ret = false;
+    cJSON *old_meta = NULL;
+    cJSON *new_meta = NULL;
+    cJSON *dep = NULL;
+
+    RETURN_IF_NULL(new_meta, (meta_cache_get(fs, pkg, to)));
+    cJSON *new_deps = cJSON_GetObjectItem(new_meta, "dependencies");
+    if (from) {
+        RETURN_IF_NULL(old_meta, (meta_cache_get(fs, pkg, from)));
+        cJSON_ArrayForEach(dep, cJSON_GetObjectItem(old_meta, "dependencies")) {
+            const char *dep_name = cJSON_GetObjectItem(dep, "name")->valuestring;
+            if (lists_dependency(new_deps, dep_name)) continue;
+            if (journal_append(journal, JOURNAL_RDEP_REMOVE, dep_name, pkg) != FR_OK) goto cleanup;
+        }
+    }
+    cJSON_ArrayForEach(dep, new_deps) {
+        const char *dep_name = cJSON_GetObjectItem(dep, "name")->valuestring;
+        if (journal_append(journal, JOURNAL_RDEP_ADD, dep_name, pkg) != FR_OK) goto cleanup;
+    }
+    ret = true;
+
+cleanup:
+    if(old_meta) cJSON_Delete(old_meta);
+    if(new_meta) cJSON_Delete(new_meta);
+    return ret;
+}
+
+//the plan entries that are not installed yet, as references into plan
+static cJSON *pending_downloads(FATFS *fs, cJSON *plan, const char *upgrade) {
+    cJSON *downloads = cJSON_CreateArray();
+    cJSON *pkg = NULL;
+    if (!downloads) return NULL;
+
+    cJSON_ArrayForEach(pkg, plan) {
+        const char *pkg_name = cJSON_GetObjectItem(pkg, "name")->valuestring;
+        if (upgrade && strcmp(pkg_name, upgrade) == 0) continue;
+        if (!_is_installed(fs, pkg_name, NULL)) cJSON_AddItemReferenceToArray(downloads, pkg);
+    }
+    return downloads;
+}
+
+/**
+ * journals one plan entry once every download arrived: a package that is not installed yet is moved
+ * out of the staging dir after the transaction committed, the package named in upgrade is installed at
+ * upgrade_from and is moved to the version of its plan entry
+ */
+static bool install_plan_entry(FATFS *fs, cJSON *pkg, journal_t *journal, const char *upgrade, const char *upgrade_from) {
+    FRESULT fres = FR_OK;
+    const char *pkg_name = cJSON_GetObjectItem(pkg, "name")->valuestring;
+    const char *pkg_version = cJSON_GetObjectItem(pkg, "version")->valuestring;
+
+    if (upgrade && strcmp(pkg_name, upgrade) == 0) {
+        if (strcmp(pkg_version, upgrade_from) == 0) return true; //already the newest matching version
+        if (!upgrade_files(fs, pkg_name, upgrade_from, pkg_version, &fres)) {
+            fprintf(stderr, "Failed to upgrade %s from %s to %s\n", pkg_name, upgrade_from, pkg_version);
+            return false;
+        }
+        char versions[2 * PKGDB_VERSION_SIZE];
+        snprintf(versions, sizeof(versions), "%s %s", upgrade_from, pkg_version);
+        if (journal_append(journal, JOURNAL_INSTALLED, pkg_name, pkg_version) != FR_OK) return false;
+        if (!journal_dependency_edges(fs, journal, pkg_name, upgrade_from, pkg_version)) return false;
+        if (journal_append(journal, JOURNAL_UPGRADE, pkg_name, versions) != FR_OK) return false;
+        meta_cache_persist(fs, pkg_name, pkg_version); //the swap reads it, also in a recovery
+        return true;
+    }
+
+    if (_is_installed(fs, pkg_name, NULL)) return true;
+    if (journal_append(journal, JOURNAL_INSTALLED, pkg_name, pkg_version) != FR_OK) return false;
+    if (!journal_dependency_edges(fs, journal, pkg_name, NULL, pkg_version)) return false;
+    return journal_append(journal, JOURNAL_MOVE_IN, pkg_name, NULL) == FR_OK;
+}
+
+//downloads every plan entry that is not installed yet side by side, then journals the plan in order
+static bool apply_plan(FATFS *fs, cJSON *plan, journal_t *journal, const char *upgrade, const char *upgrade_from) {
+    bool ret = false;
+    FRESULT fres = FR_OK;
+    cJSON *downloads = NULL;
+    cJSON *pkg = NULL;
+
+    RETURN_IF_NULL(downloads, (pending_downloads(fs, plan, upgrade)));
+    if (!download_packages(fs, downloads, &fres)) goto cleanup;
+
+    cJSON_ArrayForEach(pkg, plan) {
+        if (!install_plan_entry(fs, pkg, journal, upgrade, upgrade_from)) goto cleanup;
+    }
+    ret = true;
+
+cleanup:
+    if(downloads) cJSON_Delete(downloads);
+    return ret;
+}
+
+/**
+ * removes one package and appends the dependencies nothing else needs any more to orphans. a package
+ * that is not installed counts as removed, one that is still required is refused
+ */
+static bool remove_package(FATFS *fs, const char *pkg_name, cJSON *orphans) {
+    bool ret = false;
+    char *version = NULL;  
+    cJSON *deps = NULL;
+    depgraph_t graph = {0};
+    uint16_t dependents = 0;
+    journal_t journal = {0};
+    FRESULT fres;
+
+    recover_state(fs);
+    if (!_is_installed(fs, pkg_name, &version)){
+        ret = true;
+        goto cleanup;
+    }
+
+    //everything needed comes from deps.db, uninstalling works without the server
+    RETURN_IF_FILE_ERROR(fres, (depgraph_open(fs, &graph, false)));
+    RETURN_IF_FILE_ERROR(fres, (depgraph_dependents(&graph, pkg_name, &dependents)));
+    if (dependents > 0) {
+        fprintf(stderr, "Cannot uninstall %s: still required by other packages.\n", pkg_name);
+        goto cleanup;
+    }
+    RETURN_IF_FILE_ERROR(fres, (depgraph_dependencies(&graph, pkg_name, &deps)));
+    depgraph_close(&graph);
+
+    RETURN_IF_FILE_ERROR(fres, (journal_begin(fs, &journal)));
+
+    cJSON *dep = NULL;
+    cJSON_ArrayForEach(dep, deps) {
+        RETURN_IF_FILE_ERROR(fres, (journal_append(&journal, JOURNAL_RDEP_REMOVE, dep->valuestring, pkg_name)));
+    }
+    RETURN_IF_FILE_ERROR(fres, (journal_append(&journal, JOURNAL_UNINSTALLED, pkg_name, NULL)));
+
+    //commit before looking at the dependencies, their dependent counts are read from disk
+    RETURN_IF_FILE_ERROR(fres, (commit_changes(fs, &journal)));
+    meta_cache_forget(fs, pkg_name, version);
+
+    // Remove actual files (abstracted)
+    //remove_package_files(pkg_name);
+    char pkg_path[128];
+    snprintf(pkg_path, sizeof(pkg_path), "%s%s", UPIP_PKGS_BASE_PATH, pkg_name);
+    __f_rm_r(fs, pkg_path);
+
+    RETURN_IF_FILE_ERROR(fres, (depgraph_open(fs, &graph, false)));
+    cJSON_ArrayForEach(dep, deps) {
+        if (depgraph_dependents(&graph, dep->valuestring, &dependents) == FR_OK && dependents == 0) {
+            cJSON_AddItemToArray(orphans, cJSON_CreateString(dep->valuestring));
+        }
+    }
+    ret = true; 
+
+cleanup:   
+    depgraph_close(&graph);
+    journal_abort(&journal);
+    if(version) free(version);
+    if(deps) cJSON_Delete(deps);
+    return ret; 
+}
+
+/**
+ * lockfiles. a lockfile is the plan of an install written down once it resolved, every entry in the
+ * shape RESOLVE_BATCH returns (name, version, dependencies and files with their size and sha256) in
+ * install order:
+ *   {"format":1,"packages":[{"name":..,"version":..,"dependencies":[..],"files":[..]},..]}
+ * a pinned install takes it as its plan and its entries stand in for GET_META, the server is only
+ * asked for file chunks. entries are written one at a time so that a long plan is never printed whole
+ */
+#define LOCK_FORMAT     1
+
+static FRESULT write_text(FIL *file, const char *text) {
+    UINT bw;
+    FRESULT res = f_write(file, text, strlen(text), &bw);
+    return res == FR_OK && bw != strlen(text) ? FR_DENIED : res;
+}
+
+//the metadata of one plan entry with its name and version, NULL when the server has none
+static cJSON *lock_entry(FATFS *fs, cJSON *pkg) {
+    const char *pkg_name = cJSON_GetObjectItem(pkg, "name")->valuestring;
+    const char *pkg_version = cJSON_GetObjectItem(pkg, "version")->valuestring;
+    cJSON *meta = meta_cache_get(fs, pkg_name, pkg_version);
+    cJSON *entry = meta ? cJSON_CreateObject() : NULL;
+    if (!entry) goto cleanup;
+
+    cJSON_AddStringToObject(entry, "name", pkg_name);
+    cJSON_AddStringToObject(entry, "version", pkg_version);
+    if (!cJSON_GetObjectItem(meta, "dependencies")) cJSON_AddArrayToObject(entry, "dependencies");
+    while (meta->child) {
+        cJSON *field = cJSON_DetachItemFromArray(meta, 0);
+        if (strcmp(field->string, "name") == 0 || strcmp(field->string, "version") == 0) cJSON_Delete(field);
+        else cJSON_AddItemToObject(entry, field->string, field);
+    }
+
+cleanup:
+    if (meta) cJSON_Delete(meta);
+    return entry;
+}
+
+//the packages of a lockfile, NULL when it is missing, from another format or an entry is malformed
+static cJSON *load_lock(FATFS *fs, const char *path) {
+    cJSON *lock = NULL;
+    cJSON *packages = NULL;
+    cJSON *entry = NULL;
+
+    if (__f_load_file_to_json(fs, path, &lock) != FR_OK || !lock) {
+        ESP_LOGE(TAG, "Failed to read lockfile %s", path);
+        return NULL;
+    }
+    cJSON *format = cJSON_GetObjectItem(lock, "format");
+    if (!cJSON_IsNumber(format) || format->valueint != LOCK_FORMAT) {
+        ESP_LOGE(TAG, "Lockfile %s is not in format %d", path, LOCK_FORMAT);
+        goto cleanup;
+    }
+    packages = cJSON_DetachItemFromObject(lock, "packages");
+    if (!cJSON_IsArray(packages)) goto invalid;
+    cJSON_ArrayForEach(entry, packages) {
+        const char *pkg_name = cJSON_GetStringValue(cJSON_GetObjectItem(entry, "name"));
+        const char *pkg_version = cJSON_GetStringValue(cJSON_GetObjectItem(entry, "version"));
+        if (!pkg_name || !pkg_version || !cJSON_IsArray(cJSON_GetObjectItem(entry, "files"))) goto invalid;
+        //what pkgs.db could not record is refused before the download, as resolve does
+        if (strlen(pkg_name) >= PKGDB_NAME_SIZE || strlen(pkg_version) >= PKGDB_VERSION_SIZE) goto invalid;
+    }
+    goto cleanup;
+
+invalid:
+    ESP_LOGE(TAG, "Malformed lockfile %s", path);
+    if (packages) cJSON_Delete(packages);
+    packages = NULL;
+cleanup:
+    cJSON_Delete(lock);
+    return packages;
+}
+
+//a package installed at another version than the lockfile pins would leave the device off the plan
+static bool lock_matches_installed(FATFS *fs, cJSON *packages) {
+    cJSON *entry = NULL;
+    cJSON_ArrayForEach(entry, packages) {
+        const char *pkg_name = cJSON_GetObjectItem(entry, "name")->valuestring;
+        const char *pkg_version = cJSON_GetObjectItem(entry, "version")->valuestring;
+        char *installed_version = get_installed_version(fs, pkg_name);
+        bool matches = !installed_version || strcmp(installed_version, pkg_version) == 0;
+        if (!matches) ESP_LOGE(TAG, "%s is installed at %s, the lockfile pins %s", pkg_name, installed_version, pkg_version);
+        if (installed_version) free(installed_version);
+        if (!matches) return false;
+    }
+    return true;
+}
+
+bool upip_lock_export(FATFS *fs, const upip_requirement_t *packages, size_t count, const char *path) {
+    FRESULT res = FR_OK;
+    FIL file = {0};
+    bool opened = false;
+    char header[32];
+    cJSON *plan = NULL;
+    cJSON *pkg = NULL;
+
+    mutex_take();
+    cjson_arena_enter();
+    //what the device has installed does not belong in a plan meant for any device
+    plan = resolve_requirements(fs, packages, count, NULL, 0, RESOLVE_NOTHING_INSTALLED);
+    if (!plan) {
+        res = FR_NO_FILE;
+        goto cleanup;
+    }
+
+    FTRY(f_open(fs, &file, path, FA_WRITE | FA_CREATE_ALWAYS));
+    opened = true;
+    snprintf(header, sizeof(header), "{\"format\":%d,\"packages\":[", LOCK_FORMAT);
+    FTRY(write_text(&file, header));
+    cJSON_ArrayForEach(pkg, plan) {
+        size_t mark = cjson_arena_mark();
+        cJSON *entry = lock_entry(fs, pkg);
+        char *text = entry ? cJSON_PrintUnformatted(entry) : NULL;
+        res = !entry ? FR_NO_FILE : text ? FR_OK : FR_NOT_ENOUGH_CORE;
+        if (res == FR_OK && pkg != plan->child) res = write_text(&file, ",");
+        if (res == FR_OK) res = write_text(&file, text);
+        if (text) cJSON_free(text);
+        if (entry) cJSON_Delete(entry);
+        cjson_arena_release(mark); //one entry at a time
+        if (res != FR_OK) goto cleanup;
+    }
+    FTRY(write_text(&file, "]}"));
+    FTRY(f_sync(&file));
+
+cleanup:
+    if (opened) f_close(&file);
+    if (res != FR_OK) {
+        ESP_LOGE(TAG, "Failed to export lockfile %s: %d", path, res);
+        if (opened) f_unlink(fs, path); //no half written lockfile is left to install from
+    }
+    if (plan) cJSON_Delete(plan);
+    cjson_arena_leave();
+    mutex_give();
+    return res == FR_OK;
+}
+
+/**
+ * operations. an install goes through resolve, download, install and commit, an uninstall removes one
+ * package per step. every step returns to the caller: a download step waits for replies no longer than
+ * its budget, an install step journals one package. the resolve step runs the resolver to the end, its
+ * round trips block like the resolve api does, unless the offline index serves it. nothing is recorded
+ * in pkgs.db and nothing leaves the staging dir before the commit step, a cancelled install leaves its
+ * downloads staged
+ */
+enum { OP_INSTALL, OP_UNINSTALL };
+
+struct upip_op {
+    FATFS *fs;
+    uint8_t kind;
+    bool cancelled;
+    upip_op_status_t status;
+    upip_progress_t progress;
+    upip_progress_cb_t on_progress;
+    void *progress_arg;
+    cjson_arena_t arena;        //parked between steps
+    upip_requirement_t *requests;
+    size_t request_count;
+    cJSON *plan;
+    bool locked;                //the plan came from a lockfile and answers for GET_META
+    cJSON *queue;               //install: plan entries to download, uninstall: packages to remove
+    download_t download;
+    bool downloading;
+    journal_t journal;
+    int cursor;                 //install: next plan entry to journal, uninstall: packages looked at
+};
+
+static upip_op_t *active_op = NULL;
+
+static void op_report(upip_op_t *op) {
+    if (op->on_progress) op->on_progress(&op->progress, op->progress_arg);
+}
+
+static void op_enter(upip_op_t *op, upip_op_phase_t phase) {
+    op->progress.phase = phase;
+    op->progress.package = NULL;
+    op_report(op);
+}
+
+static void op_finish(upip_op_t *op, upip_op_status_t status) {
+    if (op->downloading) downloads_free(&op->download);
+    op->downloading = false;
+    journal_abort(&op->journal); //no-op once committed
+    if (op->locked) meta_cache_use_lock(NULL);
+    op->locked = false;
+    if (op->queue) cJSON_Delete(op->queue);
+    if (op->plan) cJSON_Delete(op->plan);
+    op->queue = op->plan = NULL;
+    op->status = status;
+}
+
+//the mutex is held from here to the end of the start function
+static upip_op_t *op_create(FATFS *fs, uint8_t kind, upip_progress_cb_t on_progress, void *arg) {
+    mutex_take();
+    upip_op_t *op = active_op ? NULL : calloc(1, sizeof(*op)); //the link and the databases are not shared
+    if (!op) {
+        mutex_give();
+        return NULL;
+    }
+
+    op->fs = fs;
+    op->kind = kind;
+    op->status = UPIP_OP_RUNNING;
+    op->on_progress = on_progress;
+    op->progress_arg = arg;
+    active_op = op;
+    cjson_arena_enter();
+    return op;
+}
+
+static void install_step(upip_op_t *op, int budget_ms) {
+    FATFS *fs = op->fs;
+    FRESULT fres = FR_OK;
+
+    switch (op->progress.phase) {
+    case UPIP_PROGRESS_RESOLVE:
+        recover_state(fs);
+        if (op->locked) {
+            //the lockfile is the plan, nothing is resolved
+            if (!lock_matches_installed(fs, op->plan)) break;
+            meta_cache_use_lock(op->plan);
+        } else {
+            //one plan for all of them, a dependency they share is resolved and downloaded once
+            op->plan = resolve_requirements(fs, op->requests, op->request_count, NULL, 0, NULL);
+        }
+        if (!op->plan || !(op->queue = pending_downloads(fs, op->plan, NULL))) break;
+        if (journal_begin(fs, &op->journal) != FR_OK) break;
+        op->downloading = true;
+        if (!downloads_init(&op->download, op->queue)) break;
+        op->progress.packages_total = cJSON_GetArraySize(op->queue);
+        op_enter(op, UPIP_PROGRESS_DOWNLOAD);
+        return;
+
+    case UPIP_PROGRESS_DOWNLOAD: {
+        const char *current = op->download.current;
+        int rc = downloads_step(fs, &op->download, budget_ms, &fres);
+        if (rc == STEP_FAILED) break;
+        if (rc == STEP_DONE) {
+            downloads_free(&op->download);
+            op->downloading = false;
+            op_enter(op, UPIP_PROGRESS_INSTALL);
+        } else if (op->download.bytes != op->progress.bytes || op->download.current != current) {
+            op->progress.bytes = op->download.bytes;
+            op->progress.package = op->download.current;
+            op_report(op);
+        }
+        return;
+    }
+
+    case UPIP_PROGRESS_INSTALL: {
+        cJSON *pkg = cJSON_GetArrayItem(op->plan, op->cursor++);
+        if (!pkg) {
+            op_enter(op, UPIP_PROGRESS_COMMIT);
+            return;
+        }
+        op->progress.package = cJSON_GetObjectItem(pkg, "name")->valuestring;
+        if (_is_installed(fs, op->progress.package, NULL)) return;
+        if (!install_plan_entry(fs, pkg, &op->journal, NULL, NULL)) break;
+        op->progress.packages_done++;
+        op_report(op);
+        return;
+    }
+
+    case UPIP_PROGRESS_COMMIT:
+        //a single transaction, a failed download leaves pkgs.db and deps.db as they were
+        if (commit_changes(fs, &op->journal) != FR_OK) break;
+        op_finish(op, UPIP_OP_DONE);
+        return;
+
+    default:
+        break;
+    }
+    op_finish(op, UPIP_OP_FAILED);
+}
+
+static void uninstall_step(upip_op_t *op) {
+    cJSON *next = cJSON_DetachItemFromArray(op->queue, 0);
+    if (!next) {
+        op_finish(op, UPIP_OP_DONE);
+        return;
+    }
+
+    op->progress.package = next->valuestring;
+    op_report(op);
+    bool removed = remove_package(op->fs, next->valuestring, op->queue);
+    if (removed) op->progress.packages_done++;
+    op->progress.package = NULL;
+    cJSON_Delete(next);
+    //only the package asked for has to go, a dependency that cannot is kept
+    if (!removed && op->cursor == 0) op_finish(op, UPIP_OP_FAILED);
+    op->cursor++;
+}
+
+/**
+ * public apis for operations
+ */
+upip_op_t *upip_install_start(FATFS *fs, const upip_requirement_t *packages, size_t count, upip_progress_cb_t on_progress, void *arg) {
+    upip_op_t *op = op_create(fs, OP_INSTALL, on_progress, arg);
+    if (!op) return NULL;
+
+    //the caller's strings need not outlive the call
+    op->requests = calloc(count ? count : 1, sizeof(*op->requests));
+    for (size_t i = 0; op->requests && i < count; i++) {
+        op->requests[i].name = strdup(packages[i].name);
+        op->requests[i].constraint = packages[i].constraint ? strdup(packages[i].constraint) : NULL;
+        op->request_count = i + 1;
+        if (!op->requests[i].name || (packages[i].constraint && !op->requests[i].constraint)) break;
+    }
+    if (!op->requests || op->request_count != count) op_finish(op, UPIP_OP_FAILED);
+    op->progress.phase = UPIP_PROGRESS_RESOLVE;
+    cjson_arena_suspend(&op->arena);
+    mutex_give();
+    return op;
+}
+
+upip_op_t *upip_install_locked_start(FATFS *fs, const char *path, upip_progress_cb_t on_progress, void *arg) {
+    upip_op_t *op = op_create(fs, OP_INSTALL, on_progress, arg);
+    if (!op) return NULL;
+
+    op->plan = load_lock(fs, path);
+    op->locked = op->plan != NULL;
+    if (!op->plan) op_finish(op, UPIP_OP_FAILED);
+    op->progress.phase = UPIP_PROGRESS_RESOLVE;
+    cjson_arena_suspend(&op->arena);
+    mutex_give();
+    return op;
+}
+
+upip_op_t *upip_uninstall_start(FATFS *fs, const char *name, upip_progress_cb_t on_progress, void *arg) {
+    upip_op_t *op = op_create(fs, OP_UNINSTALL, on_progress, arg);
+    if (!op) return NULL;
+
+    op->progress.phase = UPIP_PROGRESS_REMOVE;
+    op->queue = cJSON_CreateArray();
+    if (!op->queue || !cJSON_AddItemToArray(op->queue, cJSON_CreateString(name))) op_finish(op, UPIP_OP_FAILED);
+    cjson_arena_suspend(&op->arena);
+    mutex_give();
+    return op;
+}
+
+upip_op_status_t upip_op_step(upip_op_t *op, int budget_ms) {
+    if (op->status != UPIP_OP_RUNNING) return op->status;
+
+    //the arena is the op's for the step only, a call from another task waits for the mutex
+    mutex_take();
+    cjson_arena_resume(&op->arena);
+    if (op->cancelled) op_finish(op, UPIP_OP_CANCELLED);
+    else if (op->kind == OP_INSTALL) install_step(op, budget_ms);
+    else uninstall_step(op);
+    cjson_arena_suspend(&op->arena);
+    mutex_give();
+    return op->status;
+}
+
+upip_op_status_t upip_op_run(upip_op_t *op) {
+    while (upip_op_step(op, -1) == UPIP_OP_RUNNING) {}
+    return op->status;
+}
+
+void upip_op_cancel(upip_op_t *op) {
+    op->cancelled = true;
+}
+
+void upip_op_free(upip_op_t *op) {
+    if (!op) return;
+
+    mutex_take();
+    cjson_arena_resume(&op->arena);
+    if (op->status == UPIP_OP_RUNNING) op_finish(op, UPIP_OP_CANCELLED);
+    cjson_arena_leave();
+    for (size_t i = 0; i < op->request_count; i++) {
+        free((char *)op->requests[i].name);
+        free((char *)op->requests[i].constraint);
+    }
+    free(op->requests);
+    if (active_op == op) active_op = NULL;
+    free(op);
+    mutex_give();
+}
+
+/**
+ * blocking apis, an operation run to the end
+ */
+bool install_package(FATFS *fs, const char *name, const char *constraint) {
+    upip_requirement_t request = {name, constraint};
+    return install_packages(fs, &request, 1);
+}
+
+bool install_packages(FATFS *fs, const upip_requirement_t *packages, size_t count) {
+    upip_op_t *op = upip_install_start(fs, packages, count, NULL, NULL);
+    bool ret = op && upip_op_run(op) == UPIP_OP_DONE;
+    upip_op_free(op);
+    return ret;
+}
+
+bool install_locked(FATFS *fs, const char *path) {
+    upip_op_t *op = upip_install_locked_start(fs, path, NULL, NULL);
+    bool ret = op && upip_op_run(op) == UPIP_OP_DONE;
+    upip_op_free(op);
+    return ret;
+}
+
+bool upgrade_package(FATFS *fs, const char *name, const char *constraint) {
+    bool ret = false;
+    char *installed_version = NULL;
+    cJSON *plan = NULL;
+    journal_t journal = {0};
+    FRESULT fres;
+
+    mutex_take();
+    cjson_arena_enter();
+    if (active_op) {
+        //the operation's journal and downloads are not shared, nor is the link
+        ESP_LOGE(TAG, "Cannot upgrade %s while an operation is running", name);
+        goto cleanup;
+    }
+    recover_state(fs);
+    installed_version = get_installed_version(fs, name);
+    if (!installed_version) {
+        ret = install_package(fs, name, constraint);
+        goto cleanup;
+    }
+
+    RETURN_IF_NULL(plan, (resolve_internal(fs, name, constraint, NULL, 0, name)));
+    RETURN_IF_FILE_ERROR(fres, (journal_begin(fs, &journal)));
+
+    if (!apply_plan(fs, plan, &journal, name, installed_version)) goto cleanup;
+
+    RETURN_IF_FILE_ERROR(fres, (commit_changes(fs, &journal)));
+
+    const char *new_version = plan_version(plan, name);
+    if (new_version && strcmp(new_version, installed_version) != 0) {
+        meta_cache_forget(fs, name, installed_version);
+    }
+    ret = true;
+
+cleanup:
+    journal_abort(&journal);
+    if(installed_version) free(installed_version);
+    if(plan) cJSON_Delete(plan);
+    cjson_arena_leave();
+    mutex_give();
+    return ret;
+}
+
+bool uninstall_package(FATFS *fs, const char *pkg_name) {
+    upip_op_t *op = upip_uninstall_start(fs, pkg_name, NULL, NULL);
+    bool ret = op && upip_op_run(op) == UPIP_OP_DONE;
+    upip_op_free(op);
+    return ret;
 }
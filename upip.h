@@ -2,7 +2,10 @@
 #define UPIP_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "cJSON.h"
+#include "lib/oofatfs/ff.h"
 
 // File paths
 
@@ -12,10 +15,155 @@
 #define MEDIUM_TIMEOUT               5000
 #define LONG_TIMEOUT                10000
 
+// Transport
+#define TRANSPORT_HEADER_SIZE           6   // reply frames: id:u16, length:u32 (little endian)
+#ifndef UPIP_TRANSPORT_SLOTS
+#define UPIP_TRANSPORT_SLOTS           24   // requests in flight at once: the download window plus a GET_META per worker
+#endif
+#ifndef UPIP_TRANSPORT_MAX_REPLY
+#define UPIP_TRANSPORT_MAX_REPLY    65536   // longest reply frame accepted, a longer one is read off the link and dropped
+#endif
+
 // Size limits (in bytes)
 #define MAX_LINE_SIZE                5120
 #define MAX_DLOAD_TRANSACTION_SIZE   5120
 
+// Chunk transfer
+#ifndef UPIP_BINARY_CHUNKS
+#define UPIP_BINARY_CHUNKS              1   // getFileChunkBin: fixed header + raw bytes instead of JSON wrapped text
+#endif
+#define CHUNK_HEADER_SIZE              12   // offset:u32, length:u32, status:u8, 3 reserved (little endian)
+#define CHUNK_STATUS_OK                 0
+/**
+ * binary chunks are pipelined: up to the window size of getFileChunkBin requests are in flight and
+ * replies are written in order as they arrive. every window slot holds the receive buffer its reply
+ * lands in, so a download costs
+ *     window * (CHUNK_HEADER_SIZE + CHUNK_SIZE + 24) bytes
+ * i.e. about 8 KB per slot with the default CHUNK_SIZE of 8192. lower CHUNK_SIZE on small targets
+ * rather than the window when latency dominates
+ */
+#ifndef UPIP_DOWNLOAD_WINDOW
+#define UPIP_DOWNLOAD_WINDOW            4   // default requests in flight, see upip_set_download_window
+#endif
+#define UPIP_DOWNLOAD_WINDOW_MAX       16
+#ifndef UPIP_DOWNLOAD_WORKERS
+#define UPIP_DOWNLOAD_WORKERS           3   // packages of a plan received at once, they share the window, see upip_set_download_workers
+#endif
+#define UPIP_DOWNLOAD_WORKERS_MAX       8
+#define STAGING_DIR_PATH                UPIP_PKGS_BASE_PATH ".stage" // packages are downloaded there and moved in on install
+#define UPIP_CHUNK_RETRIES              3   // re-sends of a single chunk before the download fails
+#ifndef UPIP_CHECKPOINT_INTERVAL
+#define UPIP_CHECKPOINT_INTERVAL    32768   // bytes between download checkpoints, each one costs an f_sync
+#endif
+#define CHECKPOINT_FILE_NAME            ".ckpt" // inside the package dir while a download is incomplete
+
+// Databases
+#ifndef UPIP_JSON_READ_BUF
+#define UPIP_JSON_READ_BUF            128   // read buffer of the streaming json loader
+#endif
+
+// Compressed transfer
+#ifndef UPIP_COMPRESSED_TRANSFER
+#define UPIP_COMPRESSED_TRANSFER        1   // fetch files GET_META lists with "encoding": "lzss" compressed, needs binary chunks
+#endif
+#ifndef UPIP_LZSS_WINDOW_BITS
+#define UPIP_LZSS_WINDOW_BITS          12   // largest window accepted (4..15), the decoder holds 1 << bits bytes
+#endif
+
+// Upgrades
+#ifndef UPIP_DELTA_UPGRADES
+#define UPIP_DELTA_UPGRADES             1   // ask for getFileDelta patches against the installed files, needs binary chunks
+#endif
+#define CHUNK_STATUS_NO_DELTA           2   // getFileDelta: the server has no patch between the two versions
+#define UPGRADE_TMP_SUFFIX              ".new"
+
+// Resolver
+#ifndef UPIP_BATCHED_RESOLVE
+#define UPIP_BATCHED_RESOLVE            1   // one RESOLVE_BATCH round trip per tree level instead of GET_VER + GET_META per package
+#endif
+#define MAX_RESOLVE_BATCH              16   // packages per RESOLVE_BATCH request, bounds the response size
+#ifndef UPIP_RESOLVE_MAX_PACKAGES
+#define UPIP_RESOLVE_MAX_PACKAGES      64   // packages a single resolve() can hold
+#endif
+#ifndef UPIP_BACKTRACKING_RESOLVE
+#define UPIP_BACKTRACKING_RESOLVE       1   // on a version conflict search the candidate version lists with backjumping
+#endif
+#ifndef UPIP_RESOLVE_MAX_FETCHES
+#define UPIP_RESOLVE_MAX_FETCHES       64   // GET_VERSIONS + GET_META requests a backtracking search may spend on top of two per package
+#endif
+#define UPIP_RESOLVE_MAX_NOGOODS       32   // learned incompatible version combinations, oldest is replaced
+#define UPIP_NOGOOD_MAX_SIZE            4   // packages in one learned combination, larger ones are not kept
+
+// Repository index, see upip_index_refresh
+#ifndef UPIP_OFFLINE_INDEX
+#define UPIP_OFFLINE_INDEX              1   // resolve from INDEX_FILE_PATH when it exists, needs the backtracking resolver
+#endif
+#define INDEX_FILE_PATH                 UPIP_PKGS_BASE_PATH "index.bin"
+#ifndef UPIP_INDEX_PAGE_PACKAGES
+#define UPIP_INDEX_PAGE_PACKAGES       16   // packages per GET_INDEX reply
+#endif
+#ifndef UPIP_INDEX_READ_BUF
+#define UPIP_INDEX_READ_BUF           128   // buffer records are read and written through
+#endif
+
+// Version constraints, compiled into interval sets by semver.c
+#ifndef UPIP_SEMVER_MAX_INTERVALS
+#define UPIP_SEMVER_MAX_INTERVALS       4   // disjoint intervals a compiled constraint holds, more fail to compile
+#endif
+// scratch block for a resolve of n packages: hash slots at load factor 1/2 plus ~48 bytes of names per package
+#define UPIP_RESOLVE_SCRATCH_SIZE(n)    ((size_t)(n) * (4 * 4 * sizeof(void *) + 48))
+
+// Installed package database, pkgs.json (INSTALLED_PKGS_DB_PATH) is migrated into it once. a plan with a longer
+// name or version than the sizes below fails to resolve, a pkgs.json holding one is kept and not migrated
+#define INSTALLED_PKGS_BIN_DB_PATH      UPIP_PKGS_BASE_PATH "pkgs.db"
+#define PKGDB_NAME_SIZE                31   // longest package name + 1
+#define PKGDB_VERSION_SIZE             16   // longest version string + 1
+// a candidate whose prerelease tag (the part after '-') is longer than SEMVER_PRE_SIZE allows does not parse, the
+// resolver reports and skips it. every version pkgs.db can hold parses: 1.0.0-beta.20231015 parses, and is then
+// refused at resolve time for being longer than PKGDB_VERSION_SIZE allows
+#ifndef SEMVER_PRE_SIZE
+#define SEMVER_PRE_SIZE                24   // longest prerelease tag + 1, a compiled constraint holds 2 * UPIP_SEMVER_MAX_INTERVALS
+#endif
+#ifndef UPIP_PKGDB_MIN_SLOTS
+#define UPIP_PKGDB_MIN_SLOTS           32   // initial record count of pkgs.db, doubles at 3/4 load
+#endif
+
+// Dependency graph, revdeptree.json (REV_DEPS_TREE_FILE_PATH) is migrated into it once
+#define DEPGRAPH_FILE_PATH              UPIP_PKGS_BASE_PATH "deps.db"
+#define REV_DEPS_TREE_TMP_PATH          UPIP_PKGS_BASE_PATH "revdeptree.tmp"
+#ifndef UPIP_DEPGRAPH_MIN_SLOTS
+#define UPIP_DEPGRAPH_MIN_SLOTS        64   // initial record count of deps.db, doubles at 3/4 load
+#endif
+
+// Journal, changes are appended there and applied to pkgs.db and deps.db when they commit
+#define JOURNAL_FILE_PATH               UPIP_PKGS_BASE_PATH "journal.log"
+#ifndef UPIP_JOURNAL_COMPACT_SIZE
+#define UPIP_JOURNAL_COMPACT_SIZE    4096   // journal bytes before it is cut, everything in it is applied by then
+#endif
+
+// Metadata cache
+#ifndef UPIP_META_CACHE_ENTRIES
+#define UPIP_META_CACHE_ENTRIES         8   // GET_META replies held in RAM, least recently used is evicted
+#endif
+#ifndef UPIP_META_CACHE_PERSIST
+#define UPIP_META_CACHE_PERSIST         1   // keep metadata of installed packages on the FAT volume
+#endif
+#define META_CACHE_KEY_SIZE            64   // longest name@version that is cached
+#define META_CACHE_DIR_PATH             UPIP_PKGS_BASE_PATH ".meta"
+
+// Instrumentation
+#ifndef UPIP_HEAP_USED
+#define UPIP_HEAP_USED()                0   // bytes of heap in use, sampled at the end of every phase for peak_heap
+#endif
+
+// cJSON allocation
+#ifndef UPIP_CJSON_ARENA
+#define UPIP_CJSON_ARENA                1   // run the cJSON work of every public call out of one arena
+#endif
+#ifndef UPIP_CJSON_ARENA_SIZE
+#define UPIP_CJSON_ARENA_SIZE       16384   // size it from the high_water of upip_cjson_arena_get_stats
+#endif
+
 
 /**
  * platform abstraction layer
@@ -23,7 +171,39 @@
 //cJSON *load_file_to_json(const char *fname);
 //void save_json_to_file(const char *fname, cJSON **json);
 //int write_to_file(const char *filename, const char *data, size_t size);
-char *upip_client_request_await_response(cJSON* message, int timeout_ms);
+/**
+ * transport. requests go out as JSON text with an "id" member, each reply comes back as one frame: a
+ * TRANSPORT_HEADER_SIZE byte header (little endian id:u16, length:u32) and length bytes of payload, the
+ * JSON text or the getFileChunkBin reply the request asked for. replies may come in any order and
+ * several requests are in flight at once. a backend (UART, TCP, BLE, an in-process loopback) only moves
+ * bytes: send hands over one request and returns 0 on success, receive reads up to len bytes of the reply
+ * stream into buf and returns how many, 0 when nothing arrived within timeout_ms and -1 on a broken link.
+ * the transport is set before the first call and not while one runs
+ */
+typedef struct {
+    void *ctx;
+    int (*send)(void *ctx, const char *message, size_t len);
+    int (*receive)(void *ctx, uint8_t *buf, size_t len, int timeout_ms);
+} upip_transport_t;
+
+void upip_set_transport(const upip_transport_t *transport);
+//monotonic milliseconds, timeouts and stats are measured with it
+uint32_t upip_client_millis(void);
+
+/**
+ * public api for calling upip from more than one task. every call that touches the link, the
+ * databases or the cJSON hooks holds the mutex while it runs and an operation holds it for each step,
+ * so a call from another task waits for the step to end. upip takes it again from inside its own calls,
+ * it has to be recursive (a FreeRTOS recursive mutex). without one every call, the steps of an
+ * operation included, has to come from the same task. the mutex is set before the first call
+ */
+typedef struct {
+    void *ctx;
+    void (*take)(void *ctx);
+    void (*give)(void *ctx);
+} upip_mutex_t;
+
+void upip_set_mutex(const upip_mutex_t *mutex);
 
 /**
  * public apis for accessing packages database
@@ -32,13 +212,198 @@ bool is_installed(FATFS *fs,const char *name);
 char *get_installed_version(FATFS *fs, const char *name); //returns malloc allocated string
 
 /**
- * public api for the greedy solver
+ * public api for sessions. between upip_ctx_open and upip_ctx_close the packages database of fs is
+ * held in RAM: is_installed, get_installed_version, the resolver and every install and uninstall on
+ * fs read it from there without touching its records. it is reloaded when pkgs.db changes on disk:
+ * every write bumps a generation in its header, and each call reads that header. what installs
+ * change is written back by upip_ctx_flush or upip_ctx_close. until then the journal holds it, so a
+ * power loss loses nothing. one session is open at a time, upip_ctx_close ends it even when writing
+ * back fails
+ */
+typedef struct upip_ctx upip_ctx_t;
+
+upip_ctx_t *upip_ctx_open(FATFS *fs);
+bool upip_ctx_flush(upip_ctx_t *ctx);
+bool upip_ctx_close(upip_ctx_t *ctx);
+
+/**
+ * public api for the solver. the greedy pass takes the version the server prefers for every package,
+ * if that ends in a conflict the backtracking search (UPIP_BACKTRACKING_RESOLVE) takes over.
+ * resolve_ex runs the resolver bookkeeping in a caller supplied, pointer aligned scratch block
+ * (see UPIP_RESOLVE_SCRATCH_SIZE) instead of the heap. constraints are comma or space separated
+ * comparators (>=1.2.0, <2, ==1.4.2, ^1.2.3, ~1.4, 1.x, *) with "||" between alternatives
+ */
+cJSON *resolve(FATFS *fs, const char *package, const char *constraint);
+cJSON *resolve_ex(FATFS *fs, const char *package, const char *constraint, void *scratch, size_t scratch_size);
+
+/**
+ * public api for the repository index. upip_index_refresh downloads the index when the server has a
+ * newer revision than the one held (one round trip when it does not), after that resolve runs
+ * without the server. when the index cannot resolve a request, e.g. a package newer than the index,
+ * resolve asks the server as if no index was held. upip_index_revision returns 0 when no index is held
  */
-cJSON *resolve(char *package, const char *constraint);
+bool upip_index_refresh(FATFS *fs);
+uint32_t upip_index_revision(FATFS *fs);
 
 /**
- * public api for upip
+ * public api for the metadata cache. disk_hits are lookups served from the FAT volume,
+ * misses are the ones that went to the server
  */
+typedef struct {
+    unsigned long hits;
+    unsigned long disk_hits;
+    unsigned long misses;
+    unsigned long evictions;
+    int entries;
+} upip_meta_cache_stats_t;
+
+void upip_meta_cache_get_stats(upip_meta_cache_stats_t *out);
+void upip_meta_cache_reset_stats(void);
+void upip_meta_cache_clear(void);
+
+/**
+ * public api for transfer statistics. the compressed_* counters cover files that arrived lzss encoded,
+ * their ratio is compressed_file_bytes / compressed_wire_bytes. decode_ms is the time spent decoding,
+ * without the writes of the output, taken from upip_client_millis around every chunk
+ */
+typedef struct {
+    unsigned long files;
+    unsigned long wire_bytes;
+    unsigned long file_bytes;
+    unsigned long compressed_files;
+    unsigned long compressed_wire_bytes;
+    unsigned long compressed_file_bytes;
+    unsigned long decode_ms;
+} upip_transfer_stats_t;
+
+void upip_transfer_get_stats(upip_transfer_stats_t *out);
+void upip_transfer_reset_stats(void);
+
+/**
+ * public api for instrumentation. every phase keeps its call count, cumulative and max latency in
+ * milliseconds and the calls that failed. chunk latency runs from sending a request to its reply,
+ * write is the f_write of package files and commit a journal commit including compaction.
+ * the hook, if set, fires at the start (end false, elapsed_ms 0) and the end of every phase
+ */
+typedef enum {
+    UPIP_PHASE_RESOLVE,     // GET_VER / RESOLVE_BATCH / GET_VERSIONS round trips
+    UPIP_PHASE_METADATA,    // GET_META round trips
+    UPIP_PHASE_CHUNK,       // chunk and patch requests
+    UPIP_PHASE_WRITE,
+    UPIP_PHASE_COMMIT,
+    UPIP_PHASE_COUNT
+} upip_phase_t;
+
+typedef struct {
+    unsigned long calls;
+    unsigned long failures;
+    unsigned long total_ms;
+    unsigned long max_ms;
+} upip_phase_stats_t;
+
+typedef struct {
+    upip_phase_stats_t phase[UPIP_PHASE_COUNT];
+    unsigned long bytes_received;   // chunk payload, as transferred
+    unsigned long bytes_written;    // package file bytes
+    unsigned long retries;          // chunk requests re-sent after a timeout
+    size_t peak_heap;               // highest UPIP_HEAP_USED() seen
+} upip_stats_t;
+
+typedef void (*upip_phase_hook_t)(upip_phase_t phase, bool end, uint32_t elapsed_ms, void *arg);
+
+void upip_stats_get(upip_stats_t *out);
+void upip_stats_reset(void);
+void upip_stats_set_hook(upip_phase_hook_t hook, void *arg);
+
+/**
+ * public api for the cJSON arena. every public call installs the arena with cJSON_InitHooks and drops
+ * it when it returns, high_water is the most any call used and overflow_bytes what went to the heap
+ * because the arena was full. calls from more than one task need upip_set_mutex
+ */
+typedef struct {
+    size_t size;
+    size_t high_water;
+    size_t last_used;
+    unsigned long overflows;
+    unsigned long overflow_bytes;
+} upip_cjson_arena_stats_t;
+
+void upip_cjson_arena_get_stats(upip_cjson_arena_stats_t *out);
+void upip_cjson_arena_reset_stats(void);
+
+/**
+ * public api for upip. upip_set_download_window sets the number of chunk requests kept in flight
+ * (1..UPIP_DOWNLOAD_WINDOW_MAX), see UPIP_DOWNLOAD_WINDOW for the memory cost. upip_set_download_workers
+ * sets the number of packages received at once (1..UPIP_DOWNLOAD_WORKERS_MAX), each one holds a file
+ * handle and the metadata of its package
+ */
+void upip_set_download_window(int slots);
+void upip_set_download_workers(int workers);
 bool uninstall_package(FATFS *fs, const char *name);
 bool install_package(FATFS *fs, const char *name, const char *constraints);
+//a package and the versions of it that are acceptable, see resolve for the constraint syntax
+typedef struct {
+    const char *name;
+    const char *constraint;     //NULL for any version
+} upip_requirement_t;
+//installs count packages from one joint resolve and one database commit, nothing is recorded unless every one installs
+bool install_packages(FATFS *fs, const upip_requirement_t *packages, size_t count);
+//moves an installed package to the newest version matching constraints, installs it if missing
+bool upgrade_package(FATFS *fs, const char *name, const char *constraints);
+
+/**
+ * lockfiles. upip_lock_export resolves packages as for a device with nothing installed and writes the
+ * plan to path: every package at its exact version in install order, with its dependencies and the size
+ * and sha256 of its files. install_locked installs that plan as it is, the server only serves file chunks,
+ * no GET_VER, GET_META or RESOLVE_BATCH goes out. it fails without changes when a package is installed at
+ * another version than the one pinned
+ */
+bool upip_lock_export(FATFS *fs, const upip_requirement_t *packages, size_t count, const char *path);
+bool install_locked(FATFS *fs, const char *path);
+
+/**
+ * operations: the same install and uninstall, one bounded step per call. upip_op_step does a piece of
+ * work and returns, a download step waits no longer than budget_ms for replies (0 polls, negative waits
+ * as long as the link needs), so a main loop can keep serving everything else between steps. the
+ * resolve step is the exception, it takes the round trips the resolver needs unless the index is
+ * cached. upip_op_run steps until the end, for a task of its own. one operation runs at a time, the
+ * start functions return NULL and upgrade_package fails while another one exists. a cancelled install
+ * records nothing, the packages it downloaded stay staged for the next attempt, and so does one whose
+ * commit fails. upip_op_free cancels a running operation. from another task than the steps, see
+ * upip_set_mutex
+ */
+typedef enum {
+    UPIP_PROGRESS_RESOLVE,
+    UPIP_PROGRESS_DOWNLOAD,
+    UPIP_PROGRESS_INSTALL,
+    UPIP_PROGRESS_COMMIT,
+    UPIP_PROGRESS_REMOVE,
+} upip_op_phase_t;
+
+typedef struct {
+    upip_op_phase_t phase;
+    const char *package;        //the package being worked on, NULL between packages
+    unsigned long bytes;        //received so far by the download phase
+    int packages_done;
+    int packages_total;         //packages to download, 0 for an uninstall
+} upip_progress_t;
+
+typedef enum {
+    UPIP_OP_RUNNING,
+    UPIP_OP_DONE,
+    UPIP_OP_FAILED,
+    UPIP_OP_CANCELLED,
+} upip_op_status_t;
+
+typedef struct upip_op upip_op_t;
+//called from inside upip_op_step, progress is only valid during the call
+typedef void (*upip_progress_cb_t)(const upip_progress_t *progress, void *arg);
+
+upip_op_t *upip_install_start(FATFS *fs, const upip_requirement_t *packages, size_t count, upip_progress_cb_t on_progress, void *arg);
+upip_op_t *upip_install_locked_start(FATFS *fs, const char *path, upip_progress_cb_t on_progress, void *arg);
+upip_op_t *upip_uninstall_start(FATFS *fs, const char *name, upip_progress_cb_t on_progress, void *arg);
+upip_op_status_t upip_op_step(upip_op_t *op, int budget_ms);
+upip_op_status_t upip_op_run(upip_op_t *op);
+void upip_op_cancel(upip_op_t *op); //the only call that does not wait for the mutex, it takes effect at the next step
+void upip_op_free(upip_op_t *op);
 #endif // UPIP_H_
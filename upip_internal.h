@@ -0,0 +1,341 @@
+#ifndef UPIP_INTERNAL_H_
+#define UPIP_INTERNAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+#include "lib/oofatfs/ff.h"
+
+#include "upip.h"
+
+/**
+ * return from a function
+ */
+#define RETURN_IF_ZERO(lvar, op) if (((lvar) = (op)) == 0) goto cleanup
+#define RETURN_IF_NULL(lvar, op) if (((lvar) = (op)) == NULL) goto cleanup
+#define RETURN_IF_FILE_ERROR(lvar, op) if (((lvar) = (op)) != FR_OK) goto cleanup
+
+/**
+ * break out one level out of an inner block
+ */
+#define BREAK_IF_ZERO(lvar, op) if (((lvar) = (op)) == 0) break
+#define BREAK_IF_NULL(lvar, op) if (((lvar) = (op)) == NULL) break
+#define BREAK_IF_FILE_ERROR(lvar, op) if (((lvar) = (op)) != FR_OK) break
+
+/**
+ * more specific macro for early return in executing Fatfs op sequence
+ */
+#define FTRY(op) RETURN_IF_FILE_ERROR(res, op)
+
+/**
+ * FNV-1a, used by the in-memory and on-disk hash tables
+ */
+static inline unsigned int upip_hash_str(const char *str) {
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t upip_get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * streaming SHA-256 (sha256.c)
+ */
+#define SHA256_DIGEST_SIZE      32
+#define SHA256_HEX_SIZE         (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    uint32_t buffered;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *out);
+
+/**
+ * instrumentation (stats.c). stats_phase_begin returns the start time to hand to stats_phase_end
+ */
+uint32_t stats_phase_begin(upip_phase_t phase);
+void stats_phase_end(upip_phase_t phase, uint32_t started, bool ok);
+void stats_add_received(size_t bytes);
+void stats_add_written(size_t bytes);
+void stats_add_retry(void);
+
+/**
+ * the client mutex (upip.c). public calls bracket their work with mutex_take / mutex_give, both do
+ * nothing until upip_set_mutex set one
+ */
+void mutex_take(void);
+void mutex_give(void);
+
+/**
+ * cJSON arena (arena.c). public calls bracket their work with cjson_arena_enter / cjson_arena_leave,
+ * nested calls share the outermost arena. cJSON that has to outlive the call is moved to the heap
+ * with cjson_arena_export. cjson_arena_release drops everything allocated since cjson_arena_mark and
+ * is only for transient work like a request that is serialised and sent. an operation that returns
+ * to the caller between steps parks its arena with cjson_arena_suspend, which leaves the caller
+ * with the default allocator, and takes it back with cjson_arena_resume
+ */
+typedef struct {
+    uint8_t *arena;
+    size_t used;
+    int depth;
+} cjson_arena_t;
+
+void cjson_arena_enter(void);
+void cjson_arena_leave(void);
+cJSON *cjson_arena_export(cJSON *item);
+size_t cjson_arena_mark(void);
+void cjson_arena_release(size_t mark);
+void cjson_arena_suspend(cjson_arena_t *saved);
+void cjson_arena_resume(const cjson_arena_t *saved);
+
+/**
+ * streaming json loading (jsonload.c). files are parsed through a UPIP_JSON_READ_BUF byte buffer, so a
+ * load costs the resulting tree plus the longest string in the file. __f_load_json_key builds only the
+ * value of one top level key and skips the rest without allocating. malformed json loads as NULL
+ */
+FRESULT __f_load_file_to_json(FATFS *fs, const char *fpath, cJSON **json);
+FRESULT __f_load_json_key(FATFS *fs, const char *fpath, const char *key, cJSON **json);
+
+/**
+ * fatfs helpers (upip.c)
+ */
+FRESULT __f_save_json_to_file(FATFS *fs, const char *fname, cJSON **json);
+FRESULT __f_rm_r(FATFS *fs, const char *path);
+
+/**
+ * transport multiplexer (transport.c). transport_send stamps a request with a fresh id and sends it,
+ * its reply is received into buf and cut at size bytes. a NULL buf has the reply allocated, NUL
+ * terminated and handed over with free, for JSON of unknown size. transport_poll receives for up to
+ * timeout_ms and returns the id of the request whose reply completed, 0 when none did and -1 when the
+ * link broke. a frame longer than UPIP_TRANSPORT_MAX_REPLY is read off the link and dropped.
+ * transport_take returns the reply length of a completed request and forgets it, transport_wait polls
+ * until one id completes and cancels it on a timeout. replies to other requests
+ * that come in meanwhile are kept for them, replies to cancelled requests are dropped
+ */
+int transport_send(cJSON *message, uint8_t *buf, size_t size);
+int transport_poll(int timeout_ms);
+int transport_take(int id, uint8_t **data);
+int transport_wait(int id, int timeout_ms, uint8_t **data);
+void transport_cancel(int id);
+char *transport_request(cJSON *message, int timeout_ms);
+int transport_request_bytes(cJSON *message, uint8_t *buf, size_t size, int timeout_ms);
+
+/**
+ * repository requests and resolver (resolver.c). resolve_internal treats the package named in
+ * upgrade as not installed so that a newer version of it can be planned, RESOLVE_NOTHING_INSTALLED
+ * treats every package that way. resolve_requirements plans several packages at once, shared
+ * dependencies are resolved once
+ */
+#define RESOLVE_NOTHING_INSTALLED   "*"     // never a package name
+cJSON *repo_get_metadata(const char *package, const char *version);
+cJSON *resolve_internal(FATFS *fs, const char *package, const char *constraint, void *scratch, size_t scratch_size, const char *upgrade);
+cJSON *resolve_requirements(FATFS *fs, const upip_requirement_t *packages, size_t count, void *scratch, size_t scratch_size, const char *upgrade);
+bool repo_prefetch_metadata(cJSON *packages);
+int repo_send_metadata_request(cJSON *packages);
+bool repo_metadata_result(int id);
+
+/**
+ * repository index (index.c). index_lookup returns FR_NO_FILE for a package the index does not
+ * hold, otherwise its versions newest first and an object mapping each version to its dependencies
+ */
+typedef struct {
+    char magic[4];      //written last when building a file, a zeroed magic marks an incomplete file
+    uint16_t format;
+    uint16_t entry_size;
+    uint32_t revision;
+    uint32_t packages;
+} index_header_t;
+
+typedef struct {
+    FIL file;
+    index_header_t hdr;
+    uint8_t buf[UPIP_INDEX_READ_BUF];
+    bool open;
+} index_t;
+
+FRESULT index_open(FATFS *fs, index_t *index);
+FRESULT index_lookup(index_t *index, const char *name, cJSON **versions, cJSON **deps_of);
+void index_close(index_t *index);
+
+/**
+ * version constraints (semver.c). comparators are >=, >, <=, <, ==, =, ^, ~ or a bare version,
+ * partial versions and "*" are accepted. a prerelease only satisfies a constraint that names a
+ * prerelease of the same major.minor.patch. semver_range_intersect fails when the result does not fit,
+ * semver_range_format writes a range back as a constraint
+ */
+typedef struct {
+    uint32_t major, minor, patch;
+    char pre[SEMVER_PRE_SIZE];
+} semver_t;
+
+typedef struct {
+    semver_t version;
+    uint8_t flags;
+} semver_bound_t;
+
+typedef struct {
+    semver_bound_t lo, hi;
+} semver_interval_t;
+
+typedef struct {
+    uint8_t count;      //0 is a constraint nothing satisfies
+    semver_interval_t intervals[UPIP_SEMVER_MAX_INTERVALS];
+} semver_range_t;
+
+bool semver_parse(const char *str, semver_t *out);
+int semver_compare(const semver_t *a, const semver_t *b);
+bool semver_range_compile(const char *constraint, semver_range_t *out);
+bool semver_range_intersect(const semver_range_t *a, const semver_range_t *b, semver_range_t *out);
+bool semver_range_contains(const semver_range_t *range, const semver_t *version);
+bool semver_range_format(const semver_range_t *range, char *buf, size_t len);
+bool semver_satisfies(const char *version, const char *constraint);
+
+/**
+ * installed package database (pkgdb.c). pkgdb_lookup returns FR_NO_FILE for a package
+ * that is not installed. updates are done in place on the record of the package.
+ * between pkgdb_attach and pkgdb_detach the records of fs are resident: lookups are served from RAM,
+ * reloaded when pkgs.db changes on disk, and updates stay in RAM until pkgdb_sync writes them back
+ */
+FRESULT pkgdb_lookup(FATFS *fs, const char *name, char *version_out, size_t len);
+FRESULT pkgdb_set(FATFS *fs, const char *name, const char *version);
+FRESULT pkgdb_remove(FATFS *fs, const char *name);
+FRESULT pkgdb_attach(FATFS *fs);
+FRESULT pkgdb_sync(FATFS *fs);
+void pkgdb_detach(void);
+
+/**
+ * write-ahead journal (journal.c). a transaction is a run of records appended between
+ * journal_begin and journal_commit, only committed transactions are ever applied.
+ * journal_recover also cuts off the tail of a transaction interrupted by a power loss
+ */
+#define JOURNAL_INSTALLED       'I'     // name version
+#define JOURNAL_UNINSTALLED     'U'     // name
+#define JOURNAL_RDEP_ADD        '+'     // dependency dependent
+#define JOURNAL_RDEP_REMOVE     '-'     // dependency dependent
+#define JOURNAL_UPGRADE         'S'     // name "from to", its verified .new files are to be swapped in
+#define JOURNAL_UPGRADED        'W'     // name, the swap of its last upgrade finished
+#define JOURNAL_MOVE_IN         'M'     // name, its staged dir is to be moved into UPIP_PKGS_BASE_PATH
+#define JOURNAL_MOVED_IN        'N'     // name, the move finished
+#define JOURNAL_COMMIT          'C'     // record count
+
+typedef struct {
+    FIL file;
+    FSIZE_t start;      //offset of the first record of the transaction
+    int records;
+    bool open;
+} journal_t;
+
+typedef void (*journal_apply_fn)(char op, const char *a, const char *b, void *arg);
+
+FRESULT journal_begin(FATFS *fs, journal_t *j);
+FRESULT journal_append(journal_t *j, char op, const char *a, const char *b);
+FRESULT journal_commit(journal_t *j, journal_apply_fn apply, void *arg);
+void journal_abort(journal_t *j);
+FRESULT journal_replay(FATFS *fs, journal_apply_fn apply, void *arg);
+FRESULT journal_recover(FATFS *fs, journal_apply_fn apply, void *arg);
+FSIZE_t journal_size(FATFS *fs);
+FRESULT journal_reset(FATFS *fs);
+
+/**
+ * dependency graph (depgraph.c). edges run from a dependent to its dependencies, every package
+ * keeps the count of its dependents so that an orphan is found without walking the graph. adding
+ * an edge that exists or removing one that does not is a no-op, journal replays depend on it
+ */
+typedef struct {
+    char magic[4];      //written last when building a file, a zeroed magic marks an incomplete file
+    uint16_t format;
+    uint16_t record_size;
+    uint32_t slots;
+    uint32_t used;      //slots that are not empty, deleted ones included
+} depgraph_header_t;
+
+typedef struct {
+    FATFS *fs;
+    FIL file;
+    depgraph_header_t hdr;
+    bool writable;
+    bool open;
+} depgraph_t;
+
+FRESULT depgraph_open(FATFS *fs, depgraph_t *g, bool writable);
+void depgraph_close(depgraph_t *g);
+FRESULT depgraph_add_edge(depgraph_t *g, const char *dependent, const char *dependency);
+FRESULT depgraph_remove_edge(depgraph_t *g, const char *dependent, const char *dependency);
+FRESULT depgraph_remove_node(depgraph_t *g, const char *name);
+FRESULT depgraph_dependents(depgraph_t *g, const char *name, uint16_t *count);
+FRESULT depgraph_dependencies(depgraph_t *g, const char *name, cJSON **out);
+
+/**
+ * binary patches (delta.c). a patch is a run of ops, all integers little endian:
+ *   'C' src_offset:u32 length:u32      copy length bytes of the installed file from src_offset
+ *   'A' length:u32 <length bytes>      append the literal bytes that follow
+ * patch_feed takes the patch in arbitrary pieces as it arrives and hands the output to write
+ */
+typedef bool (*patch_write_fn)(const void *data, UINT len, void *arg);
+
+typedef struct {
+    FIL *src;
+    patch_write_fn write;
+    void *arg;
+    uint8_t op[9];
+    uint8_t op_have;
+    uint32_t add_left;
+    bool failed;
+} patch_t;
+
+void patch_init(patch_t *p, FIL *src, patch_write_fn write, void *arg);
+bool patch_feed(patch_t *p, const uint8_t *data, size_t len);
+bool patch_done(const patch_t *p);
+
+/**
+ * streaming LZSS decoder (lzss.c) for the heatshrink bitstream, read MSB first: a 1 bit then an 8 bit
+ * literal, or a 0 bit then window_bits of back reference distance - 1 and lookahead_bits of length - 1.
+ * the window is the whole history, its 1 << UPIP_LZSS_WINDOW_BITS bytes bound the decoder's memory.
+ * output goes to write as it is produced, at the latest when lzss_feed returns
+ */
+typedef struct {
+    patch_write_fn write;
+    void *arg;
+    uint32_t acc;
+    uint8_t acc_bits;
+    uint8_t state;
+    uint8_t window_bits;
+    uint8_t lookahead_bits;
+    uint16_t distance;
+    uint16_t head;
+    uint16_t flushed;
+    bool failed;
+    uint8_t window[1 << UPIP_LZSS_WINDOW_BITS];
+} lzss_t;
+
+bool lzss_init(lzss_t *d, uint8_t window_bits, uint8_t lookahead_bits, patch_write_fn write, void *arg);
+bool lzss_feed(lzss_t *d, const uint8_t *data, size_t len);
+
+/**
+ * metadata cache (metacache.c). entries are keyed by name@version, meta_cache_get returns
+ * a copy the caller must free. meta_cache_persist keeps the entry of an installed package on
+ * the FAT volume so that uninstall does not need the server. while meta_cache_use_lock has the
+ * entries of a lockfile set they answer for their packages and the server is never asked
+ */
+cJSON *meta_cache_get(FATFS *fs, const char *package, const char *version);
+void meta_cache_put(const char *package, const char *version, const cJSON *meta);
+bool meta_cache_has(const char *package, const char *version);
+void meta_cache_use_lock(const cJSON *packages);
+cJSON *meta_cache_peek(FATFS *fs, const char *package, const char *version);
+FRESULT meta_cache_persist(FATFS *fs, const char *package, const char *version);
+void meta_cache_forget(FATFS *fs, const char *package, const char *version);
+
+#endif // UPIP_INTERNAL_H_